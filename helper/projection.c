@@ -0,0 +1,200 @@
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "projection.h"
+
+#define SQRT2 1.41421356237309504880
+#define TAN_PI_8 0.41421356237309504880
+// Adding this rounds a double (|x| < 2^51) to the nearest integer, which is
+// then found in the low bits of its representation.
+#define ROUND_MAGIC 6755399441055744.0
+
+static inline double
+_clamp(double v, double min, double max)
+{
+    return fmin(fmax(v, min), max);
+}
+
+static inline double
+_clamp_lat(double lat)
+{
+    return _clamp(lat, -PROJECTION_MAX_LAT, PROJECTION_MAX_LAT);
+}
+
+/*************************************/
+/** Scalar reference **/
+/*************************************/
+void
+projection_lonlat_to_pixel(double zoom, double tile_size, double lon, double lat, double *x, double *y)
+{
+    double size = pow(2, zoom) * tile_size;
+
+    if (x) *x = (lon + 180.0) / 360.0 * size;
+    if (y) {
+        double r = _clamp_lat(lat) * M_PI / 180.0;
+        *y = (1.0 - log(tan(r) + (1.0 / cos(r))) / M_PI) / 2.0 * size;
+    }
+}
+
+void
+projection_pixel_to_lonlat(double zoom, double tile_size, double x, double y, double *lon, double *lat)
+{
+    double size = pow(2, zoom) * tile_size;
+
+    if (lon) *lon = (x / size * 360.0) - 180;
+    if (lat) {
+        double n = M_PI - (2.0 * M_PI * y / size);
+        *lat = 180.0 / M_PI * atan(0.5 * (exp(n) - exp(-n)));
+    }
+}
+
+/*************************************/
+/** Approximations **/
+/*************************************/
+// sin(x) for |x| <= PROJECTION_MAX_LAT in radians: Taylor series up to
+// x^15, truncation error < 3e-12.
+static inline double
+_sin_approx(double x)
+{
+    double x2 = x * x;
+    double p = -1.0 / 1307674368000.0;
+    p = p * x2 + 1.0 / 6227020800.0;
+    p = p * x2 - 1.0 / 39916800.0;
+    p = p * x2 + 1.0 / 362880.0;
+    p = p * x2 - 1.0 / 5040.0;
+    p = p * x2 + 1.0 / 120.0;
+    p = p * x2 - 1.0 / 6.0;
+    p = p * x2 + 1.0;
+    return x * p;
+}
+
+// log(x) for x > 0: x = m * 2^e with m in [sqrt(1/2), sqrt(2)), then
+// log(m) = 2 atanh((m - 1)/(m + 1)) by its series up to t^13,
+// truncation error < 2e-13.
+static inline double
+_log_approx(double x)
+{
+    uint64_t bits, ebits;
+    double m, e;
+    memcpy(&bits, &x, sizeof(bits));
+    // exponent field converted to double without an int64 conversion
+    ebits = ((bits >> 52) & 0x7ff) | 0x4330000000000000ULL;
+    memcpy(&e, &ebits, sizeof(e));
+    e -= 4503599627370496.0 + 1023.0;
+    bits = (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+    memcpy(&m, &bits, sizeof(m));
+
+    double big = (double)(m > SQRT2);
+    m *= 1.0 - 0.5 * big;
+    e += big;
+
+    double t = (m - 1.0) / (m + 1.0);
+    double t2 = t * t;
+    double p = 2.0 / 13.0;
+    p = p * t2 + 2.0 / 11.0;
+    p = p * t2 + 2.0 / 9.0;
+    p = p * t2 + 2.0 / 7.0;
+    p = p * t2 + 2.0 / 5.0;
+    p = p * t2 + 2.0 / 3.0;
+    p = p * t2 + 2.0;
+    return t * p + e * M_LN2;
+}
+
+// exp(x) for |x| <= pi: x = k ln2 + r with |r| <= ln2/2, then
+// exp(r) by its series up to r^11, truncation error < 1e-14.
+static inline double
+_exp_approx(double x)
+{
+    double k = (x * M_LOG2E + ROUND_MAGIC) - ROUND_MAGIC;
+    double r = x - k * M_LN2;
+    double p = 1.0 / 39916800.0;
+    p = p * r + 1.0 / 3628800.0;
+    p = p * r + 1.0 / 362880.0;
+    p = p * r + 1.0 / 40320.0;
+    p = p * r + 1.0 / 5040.0;
+    p = p * r + 1.0 / 720.0;
+    p = p * r + 1.0 / 120.0;
+    p = p * r + 1.0 / 24.0;
+    p = p * r + 1.0 / 6.0;
+    p = p * r + 0.5;
+    p = p * r + 1.0;
+    p = p * r + 1.0;
+
+    // 2^k built directly in the exponent bits
+    double kb = k + ROUND_MAGIC;
+    uint64_t bits;
+    memcpy(&bits, &kb, sizeof(bits));
+    bits = (bits - 0x4338000000000000ULL + 1023) << 52;
+    double s;
+    memcpy(&s, &bits, sizeof(s));
+    return p * s;
+}
+
+// atan(x) for |x| <= 1: reduced to |t| <= tan(pi/8) with
+// atan(x) = pi/4 + atan((x - 1)/(x + 1)), then its series up to t^23,
+// truncation error < 2e-11.
+static inline double
+_atan_approx(double x)
+{
+    double ax = fabs(x);
+    double big = (double)(ax > TAN_PI_8);
+    // t = big ? (ax - 1)/(ax + 1) : ax
+    double t = (ax - big) / (1.0 + big * ax);
+    double t2 = t * t;
+    double p = -1.0 / 23.0;
+    p = p * t2 + 1.0 / 21.0;
+    p = p * t2 - 1.0 / 19.0;
+    p = p * t2 + 1.0 / 17.0;
+    p = p * t2 - 1.0 / 15.0;
+    p = p * t2 + 1.0 / 13.0;
+    p = p * t2 - 1.0 / 11.0;
+    p = p * t2 + 1.0 / 9.0;
+    p = p * t2 - 1.0 / 7.0;
+    p = p * t2 + 1.0 / 5.0;
+    p = p * t2 - 1.0 / 3.0;
+    p = p * t2 + 1.0;
+    double r = t * p + big * M_PI_4;
+    return copysign(r, x);
+}
+
+/*************************************/
+/** Batch **/
+/*************************************/
+void
+projection_lonlat_to_pixel_batch(double zoom, double tile_size, const double *lon, const double *lat, double *x, double *y, unsigned int num)
+{
+    double size = pow(2, zoom) * tile_size;
+    double xscale = size / 360.0;
+    double yscale = size / (2.0 * M_PI);
+    unsigned int i;
+
+    for (i = 0 ; i < num ; i++)
+        x[i] = (lon[i] + 180.0) * xscale;
+
+    // Mercator y = atanh(sin(lat)) = log((1 + s)/(1 - s)) / 2
+    for (i = 0 ; i < num ; i++) {
+        double s = _sin_approx(_clamp_lat(lat[i]) * (M_PI / 180.0));
+        double merc = 0.5 * _log_approx((1.0 + s) / (1.0 - s));
+        y[i] = size / 2.0 - merc * yscale;
+    }
+}
+
+void
+projection_pixel_to_lonlat_batch(double zoom, double tile_size, const double *x, const double *y, double *lon, double *lat, unsigned int num)
+{
+    double size = pow(2, zoom) * tile_size;
+    double xscale = 360.0 / size;
+    double yscale = 2.0 * M_PI / size;
+    unsigned int i;
+
+    for (i = 0 ; i < num ; i++)
+        lon[i] = x[i] * xscale - 180.0;
+
+    // lat = gd(n) = 2 atan(tanh(n/2)) = 2 atan((e^n - 1)/(e^n + 1))
+    for (i = 0 ; i < num ; i++) {
+        double n = _clamp(M_PI - y[i] * yscale, -M_PI, M_PI);
+        double e = _exp_approx(n);
+        lat[i] = (360.0 / M_PI) * _atan_approx((e - 1.0) / (e + 1.0));
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef __PROJECTION_H__
+#define __PROJECTION_H__
+
+#include <stdbool.h>
+
+// Web Mercator (Slippy map) projection between lon/lat in degrees and
+// pixel coordinates of the whole map at a zoom level.
+// Reference: http://wiki.openstreetmap.org/wiki/Slippy_map_tilenames
+
+// Latitudes are clamped to the square Mercator world.
+#define PROJECTION_MAX_LAT 85.0511287798066
+
+// Scalar reference (libm)
+void projection_lonlat_to_pixel(double zoom, double tile_size, double lon, double lat, double *x, double *y);
+void projection_pixel_to_lonlat(double zoom, double tile_size, double x, double y, double *lon, double *lat);
+
+// Batch versions over SoA arrays of num points. The input and output arrays
+// must not overlap. They use branch free polynomial approximations which
+// compilers can vectorize:
+//  - lonlat -> pixel: |error| < 1e-10 of the world size,
+//    i.e. below 0.01 pixel at zoom 19 with 256 pixel tiles.
+//  - pixel -> lonlat: |error| < 1e-8 degree.
+void projection_lonlat_to_pixel_batch(double zoom, double tile_size, const double *lon, const double *lat, double *x, double *y, unsigned int num);
+void projection_pixel_to_lonlat_batch(double zoom, double tile_size, const double *x, const double *y, double *lon, double *lat, unsigned int num);
+
+#endif
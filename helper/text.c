@@ -29,6 +29,7 @@
 #include "log.h"
 #include "text.h"
 #include "nemolist.h"
+#include "trace.h"
 
 #define EPSILON 0.001
 #define EQUAL(a, b) ((a >b) ? ((a-b) < EPSILON) : ((b-a) < EPSILON))
@@ -618,6 +619,7 @@ _font_list_get(int *num)
 MyFont *
 _font_load(const char *font_family, const char *font_style, int font_slant, int font_weight, int font_width, int font_spacing)
 {
+    TRACE_FUNC();
     MyFont *font = NULL, *temp;
     FcBool ret;
     FcPattern *pattern;
@@ -924,6 +926,7 @@ _text_hb_create(hb_buffer_t *_hb_buffer, const char *utf8, unsigned int utf8_len
         hb_direction_t hb_dir, hb_script_t hb_script, hb_language_t hb_lang,
         bool kerning, hb_font_t *hb_font)
 {
+    TRACE_FUNC();
     hb_buffer_t *hb_buffer;
 
     RET_IF(!utf8 || utf8_len <= 0 || !hb_font, NULL);
@@ -1216,10 +1219,27 @@ _text_create(const char *utf8)
     return t;
 }
 
+// Loads the font and shapes the text only, no line layout.
+// Returns the number of glyphs
+unsigned int
+_text_shape(Text *t)
+{
+    RET_IF(!t, 0);
+
+    t->font = _font_load(t->font_family, t->font_style, t->font_slant,
+            t->font_weight, t->font_width, t->font_spacing);
+    // FIXME: Use cache for hb_buffer if possible
+    t->hb_buffer = _text_hb_create(t->hb_buffer, t->utf8, t->utf8_len,
+            t->hb_dir, t->hb_script, t->hb_lang, t->kerning, t->font->hb_font);
+    if (!t->hb_buffer) return 0;
+    return hb_buffer_get_length(t->hb_buffer);
+}
+
 void
 _text_draw(Text *t, cairo_t *cr)
 {
     RET_IF(!t);
+    TRACE_FUNC();
 
     if (!t->dirty) goto _text_draw_again;
     t->dirty = false;
@@ -1244,18 +1264,11 @@ _text_draw(Text *t, cairo_t *cr)
     if (t->hint_height && (t->font_size > t->hint_height)) t->font_size = t->hint_height;
     if (t->hint_width && (t->font_size > t->hint_width))   t->font_size = t->hint_width;
 
-    unsigned int num_glyphs = 0;
-    t->font = _font_load(t->font_family, t->font_style, t->font_slant,
-            t->font_weight, t->font_width, t->font_spacing);
+    unsigned int num_glyphs = _text_shape(t);
 
     // harfbuzz was scaled up as upem, scaled it down as font pixel size.
     t->cairo_scale = t->font_size / (double)t->font->ft_face->max_advance_height;
 
-    // FIXME: Use cache for hb_buffer if possible
-    t->hb_buffer = _text_hb_create(t->hb_buffer, t->utf8, t->utf8_len,
-            t->hb_dir, t->hb_script, t->hb_lang, t->kerning, t->font->hb_font);
-    num_glyphs = hb_buffer_get_length(t->hb_buffer);
-
     double maxw, maxh;
     bool vertical = HB_DIRECTION_IS_VERTICAL(t->hb_dir);
     if (vertical) {
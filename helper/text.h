@@ -17,6 +17,7 @@ const char *_font_style_get(MyFont *font);
 
 void _text_destroy(Text *t);
 Text *_text_create(const char *utf8);
+unsigned int _text_shape(Text *t);
 void _text_draw(Text *t, cairo_t *cr);
 bool _text_set_font_family(Text *t, const char *font_family);
 const char * _text_get_font_family(Text *t);
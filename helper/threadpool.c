@@ -0,0 +1,399 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "nemolist.h"
+#include "threadpool.h"
+
+typedef struct _TaskThen TaskThen;
+struct _TaskThen
+{
+    struct nemolist link;
+    TaskDone done;
+    void *data;
+};
+
+struct _Task
+{
+    struct nemolist link;   // completion queue
+    ThreadPool *pool;
+    TaskWork work;
+    void *data;
+    void *result;
+    bool future;            // false: fire and forget
+    bool done;
+    struct nemolist thens;
+};
+
+// Ring of tasks, the owner works on the back, thieves on the front
+typedef struct _Deque Deque;
+struct _Deque
+{
+    pthread_mutex_t lock;
+    Task **tasks;
+    unsigned int head, tail;    // [head, tail), masked by alloc - 1
+    unsigned int alloc;         // power of 2
+};
+
+struct _ThreadPool
+{
+    unsigned int workers;   // deques
+    unsigned int started;   // threads, a deque without one is only stolen from
+    pthread_t *threads;
+    Deque *deques;
+    unsigned int next;      // round robin for submissions from outside
+
+    // Idle workers sleep until there is pending work
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending;            // queued, not started yet
+    bool stopping;
+
+    // Completion queue, drained by the main thread
+    int efd;
+    pthread_mutex_t done_lock;
+    pthread_cond_t done_cond;
+    struct nemolist done_list;
+};
+
+typedef struct _Worker Worker;
+struct _Worker
+{
+    ThreadPool *pool;
+    unsigned int idx;
+};
+
+static __thread Worker *_worker;
+
+/*************************************/
+/** Deque **/
+/*************************************/
+static void
+_deque_init(Deque *dq)
+{
+    pthread_mutex_init(&dq->lock, NULL);
+    dq->alloc = 64;
+    dq->tasks = malloc(sizeof(Task *) * dq->alloc);
+    dq->head = dq->tail = 0;
+}
+
+static void
+_deque_fini(Deque *dq)
+{
+    pthread_mutex_destroy(&dq->lock);
+    free(dq->tasks);
+}
+
+static void
+_deque_push_back(Deque *dq, Task *task)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail - dq->head == dq->alloc) {
+        unsigned int i, alloc = dq->alloc * 2;
+        Task **tasks = malloc(sizeof(Task *) * alloc);
+        for (i = dq->head ; i != dq->tail ; i++)
+            tasks[i & (alloc - 1)] = dq->tasks[i & (dq->alloc - 1)];
+        free(dq->tasks);
+        dq->tasks = tasks;
+        dq->alloc = alloc;
+    }
+    dq->tasks[dq->tail & (dq->alloc - 1)] = task;
+    dq->tail++;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+static Task *
+_deque_pop_back(Deque *dq)
+{
+    Task *task = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail != dq->head) {
+        dq->tail--;
+        task = dq->tasks[dq->tail & (dq->alloc - 1)];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+static Task *
+_deque_pop_front(Deque *dq)
+{
+    Task *task = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail != dq->head) {
+        task = dq->tasks[dq->head & (dq->alloc - 1)];
+        dq->head++;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+/*************************************/
+/** Worker **/
+/*************************************/
+static Task *
+_threadpool_take(ThreadPool *pool, unsigned int idx)
+{
+    Task *task = _deque_pop_back(&pool->deques[idx]);
+    unsigned int i;
+    for (i = 1 ; !task && i < pool->workers ; i++) {
+        task = _deque_pop_front(&pool->deques[(idx + i) % pool->workers]);
+    }
+    return task;
+}
+
+static void
+_threadpool_complete(ThreadPool *pool, Task *task)
+{
+    pthread_mutex_lock(&pool->done_lock);
+    task->done = true;
+    nemolist_insert_tail(&pool->done_list, &task->link);
+    pthread_cond_broadcast(&pool->done_cond);
+    pthread_mutex_unlock(&pool->done_lock);
+
+    uint64_t one = 1;
+    if (write(pool->efd, &one, sizeof(one)) < 0)
+        ERR("eventfd write failed: %s", strerror(errno));
+}
+
+static void *
+_threadpool_worker(void *data)
+{
+    Worker *worker = data;
+    ThreadPool *pool = worker->pool;
+    _worker = worker;
+
+    while (1) {
+        Task *task = _threadpool_take(pool, worker->idx);
+        if (!task) {
+            pthread_mutex_lock(&pool->lock);
+            while (!pool->pending && !pool->stopping)
+                pthread_cond_wait(&pool->cond, &pool->lock);
+            bool stop = !pool->pending && pool->stopping;
+            pthread_mutex_unlock(&pool->lock);
+            if (stop) break;
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        pool->pending--;
+        pthread_mutex_unlock(&pool->lock);
+
+        task->result = task->work(task->data);
+        if (task->future) _threadpool_complete(pool, task);
+        else free(task);
+    }
+    free(worker);
+    return NULL;
+}
+
+static bool
+_threadpool_push(ThreadPool *pool, Task *task)
+{
+    unsigned int idx;
+    pthread_mutex_lock(&pool->lock);
+    if (_worker && _worker->pool == pool) idx = _worker->idx;
+    else idx = pool->next++ % pool->workers;
+    _deque_push_back(&pool->deques[idx], task);
+    pool->pending++;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return true;
+}
+
+/*************************************/
+/** Thread Pool **/
+/*************************************/
+ThreadPool *
+threadpool_create(unsigned int workers)
+{
+    if (!workers) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = (cpus > 0) ? cpus : 1;
+    }
+
+    ThreadPool *pool = calloc(sizeof(ThreadPool), 1);
+    pool->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (pool->efd < 0) {
+        ERR("eventfd failed: %s", strerror(errno));
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pthread_mutex_init(&pool->done_lock, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    nemolist_init(&pool->done_list);
+
+    pool->deques = calloc(sizeof(Deque), workers);
+    pool->threads = calloc(sizeof(pthread_t), workers);
+    unsigned int i;
+    for (i = 0 ; i < workers ; i++) {
+        _deque_init(&pool->deques[i]);
+    }
+    pool->workers = workers;
+    for (i = 0 ; i < workers ; i++) {
+        Worker *worker = calloc(sizeof(Worker), 1);
+        worker->pool = pool;
+        worker->idx = i;
+        if (pthread_create(&pool->threads[i], NULL, _threadpool_worker, worker)) {
+            ERR("pthread create failed");
+            free(worker);
+            break;
+        }
+        pool->started++;
+    }
+    if (!pool->started) {
+        threadpool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void
+threadpool_destroy(ThreadPool *pool)
+{
+    RET_IF(!pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    unsigned int i;
+    for (i = 0 ; i < pool->started ; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    threadpool_dispatch(pool);
+
+    close(pool->efd);
+    for (i = 0 ; i < pool->workers ; i++) {
+        _deque_fini(&pool->deques[i]);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->done_lock);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
+
+unsigned int
+threadpool_get_workers(ThreadPool *pool)
+{
+    RET_IF(!pool, 0);
+    return pool->started;
+}
+
+int
+threadpool_get_fd(ThreadPool *pool)
+{
+    RET_IF(!pool, -1);
+    return pool->efd;
+}
+
+static void
+_task_finish(Task *task)
+{
+    TaskThen *then, *tmp;
+    nemolist_for_each_safe(then, tmp, &task->thens, link) {
+        nemolist_remove(&then->link);
+        then->done(task->result, then->data);
+        free(then);
+    }
+    free(task);
+}
+
+void
+threadpool_dispatch(ThreadPool *pool)
+{
+    RET_IF(!pool);
+
+    uint64_t cnt;
+    if (read(pool->efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        ERR("eventfd read failed: %s", strerror(errno));
+
+    // Only the tasks completed so far: continuations may submit more
+    struct nemolist list;
+    nemolist_init(&list);
+    pthread_mutex_lock(&pool->done_lock);
+    while (!nemolist_empty(&pool->done_list)) {
+        Task *task = nemolist_node0(&pool->done_list, Task, link);
+        nemolist_remove(&task->link);
+        nemolist_insert_tail(&list, &task->link);
+    }
+    pthread_mutex_unlock(&pool->done_lock);
+
+    while (!nemolist_empty(&list)) {
+        Task *task = nemolist_node0(&list, Task, link);
+        nemolist_remove(&task->link);
+        _task_finish(task);
+    }
+}
+
+bool
+threadpool_run(ThreadPool *pool, TaskWork work, void *data)
+{
+    RET_IF(!pool, false);
+    RET_IF(!work, false);
+
+    Task *task = calloc(sizeof(Task), 1);
+    task->work = work;
+    task->data = data;
+    nemolist_init(&task->thens);
+    return _threadpool_push(pool, task);
+}
+
+Task *
+threadpool_submit(ThreadPool *pool, TaskWork work, void *data)
+{
+    RET_IF(!pool, NULL);
+    RET_IF(!work, NULL);
+
+    Task *task = calloc(sizeof(Task), 1);
+    task->work = work;
+    task->data = data;
+    task->future = true;
+    task->pool = pool;
+    nemolist_init(&task->thens);
+    _threadpool_push(pool, task);
+    return task;
+}
+
+/*************************************/
+/** Task **/
+/*************************************/
+void
+task_then(Task *task, TaskDone done, void *data)
+{
+    RET_IF(!task);
+    RET_IF(!done);
+
+    TaskThen *then = calloc(sizeof(TaskThen), 1);
+    then->done = done;
+    then->data = data;
+    nemolist_insert_tail(&task->thens, &then->link);
+}
+
+void *
+task_wait(Task *task)
+{
+    RET_IF(!task, NULL);
+
+    ThreadPool *pool = task->pool;
+    pthread_mutex_lock(&pool->done_lock);
+    while (!task->done)
+        pthread_cond_wait(&pool->done_cond, &pool->done_lock);
+    // Out of the completion queue (or the dispatch list)
+    nemolist_remove(&task->link);
+    pthread_mutex_unlock(&pool->done_lock);
+
+    void *result = task->result;
+    _task_finish(task);
+    return result;
+}
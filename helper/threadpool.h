@@ -0,0 +1,47 @@
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <stdbool.h>
+
+// Work stealing thread pool. Every worker owns a deque: it takes its own
+// work from the back and steals from the front of the others when it runs
+// out. Completed tasks are queued for the main thread, which is woken up
+// through an eventfd (threadpool_get_fd) and runs the continuations of the
+// tasks in threadpool_dispatch().
+typedef struct _ThreadPool ThreadPool;
+// Future of a submitted work
+typedef struct _Task Task;
+
+// Runs on a worker, returns the result of the task
+typedef void *(*TaskWork)(void *data);
+// Runs on the main thread with the result of the task
+typedef void (*TaskDone)(void *result, void *data);
+
+// workers: 0 means one per online CPU
+ThreadPool *threadpool_create(unsigned int workers);
+// Runs the remaining work, joins the workers and dispatches the
+// remaining completions.
+void threadpool_destroy(ThreadPool *pool);
+unsigned int threadpool_get_workers(ThreadPool *pool);
+
+// Main loop integration: watch the fd for readability (e.g. with nemotool,
+// or fd_handler_attach_threadpool() in view.h) and call
+// threadpool_dispatch().
+int threadpool_get_fd(ThreadPool *pool);
+void threadpool_dispatch(ThreadPool *pool);
+
+// Fire and forget: no future, nothing runs on the main thread.
+bool threadpool_run(ThreadPool *pool, TaskWork work, void *data);
+// Can be called from workers too: the work is then pushed to the calling
+// worker's own deque.
+Task *threadpool_submit(ThreadPool *pool, TaskWork work, void *data);
+
+// Continuations run in the order they were added. A task is freed after its
+// continuations ran, so add them from the main thread before returning to
+// the main loop.
+void task_then(Task *task, TaskDone done, void *data);
+// Main thread only: blocks until the task completes, runs its
+// continuations, frees it and returns its result.
+void *task_wait(Task *task);
+
+#endif
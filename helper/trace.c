@@ -0,0 +1,134 @@
+#ifdef HELPER_TRACE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "trace.h"
+
+typedef struct _TraceEvent TraceEvent;
+struct _TraceEvent
+{
+    uint64_t seq;           // index + 1 once the event is complete
+    const char *name;
+    uint64_t start;         // ns
+    uint64_t dur;           // ns
+    int tid;
+};
+
+// Writers claim a slot with one atomic increment and publish it by
+// storing its sequence number last.
+static TraceEvent trace_ring[TRACE_RING_SIZE];
+static uint64_t trace_idx;
+static char *trace_path;
+static volatile sig_atomic_t trace_dump_requested;
+static __thread int trace_tid;
+
+uint64_t
+trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+trace_record(const char *name, uint64_t start, uint64_t end)
+{
+    if (!trace_tid) trace_tid = syscall(SYS_gettid);
+
+    uint64_t idx = __atomic_fetch_add(&trace_idx, 1, __ATOMIC_RELAXED);
+    TraceEvent *ev = &trace_ring[idx & (TRACE_RING_SIZE - 1)];
+    __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+    ev->name = name;
+    ev->start = start;
+    ev->dur = end - start;
+    ev->tid = trace_tid;
+    __atomic_store_n(&ev->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+void
+trace_scope_end(TraceScope *scope)
+{
+    trace_record(scope->name, scope->start, trace_now());
+}
+
+bool
+trace_dump(const char *path)
+{
+    RET_IF(!path, false);
+
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        ERR("%s: %s", path, strerror(errno));
+        return false;
+    }
+
+    uint64_t end = __atomic_load_n(&trace_idx, __ATOMIC_ACQUIRE);
+    uint64_t begin = (end > TRACE_RING_SIZE) ? end - TRACE_RING_SIZE : 0;
+    int pid = getpid();
+    bool first = true;
+
+    fprintf(fp, "{\"traceEvents\":[");
+    uint64_t i;
+    for (i = begin ; i < end ; i++) {
+        TraceEvent *ev = &trace_ring[i & (TRACE_RING_SIZE - 1)];
+        // Not complete yet, or overwritten in the meantime
+        if (__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) != i + 1) continue;
+        fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                first ? "" : ",", ev->name, ev->start/1000.0, ev->dur/1000.0,
+                pid, ev->tid);
+        first = false;
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(fp);
+    LOG("trace: %s (%"PRIu64" events)", path, end - begin);
+    return true;
+}
+
+void
+trace_poll()
+{
+    if (!trace_dump_requested) return;
+    trace_dump_requested = 0;
+    trace_dump(trace_path);
+}
+
+static void
+_trace_signal(int signo)
+{
+    trace_dump_requested = 1;
+}
+
+static void
+_trace_exit()
+{
+    trace_dump(trace_path);
+}
+
+void
+trace_init(const char *path)
+{
+    if (trace_path) return;
+
+    if (!path) path = getenv("HELPER_TRACE_FILE");
+    if (!path) path = "trace.json";
+    trace_path = strdup(path);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(struct sigaction));
+    sa.sa_handler = _trace_signal;
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR2, &sa, NULL)) perror("sigaction failed: ");
+    atexit(_trace_exit);
+}
+
+#endif
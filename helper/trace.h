@@ -0,0 +1,56 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+// Low overhead tracing of durations, dumped as Chrome trace events
+// (chrome://tracing, Perfetto). Only built with -DHELPER_TRACE (cmake
+// -DHELPER_TRACE=ON), otherwise every macro below compiles to nothing.
+//
+//  TRACE_FUNC();             // the rest of the enclosing function
+//  TRACE_SCOPE("draw");      // the rest of the enclosing block
+//
+// Names must be string literals (or otherwise live until the dump).
+// Events go to a lock free ring which keeps the latest TRACE_RING_SIZE
+// of them. It is dumped at exit, or when SIGUSR2 was received and the
+// event loop calls TRACE_POLL().
+
+#ifdef HELPER_TRACE
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_RING_SIZE (1 << 16)
+
+typedef struct _TraceScope TraceScope;
+struct _TraceScope
+{
+    const char *name;
+    uint64_t start;         // ns
+};
+
+// path: NULL means $HELPER_TRACE_FILE, or "trace.json"
+void trace_init(const char *path);
+uint64_t trace_now();
+void trace_record(const char *name, uint64_t start, uint64_t end);
+void trace_scope_end(TraceScope *scope);
+void trace_poll();
+bool trace_dump(const char *path);
+
+#define _TRACE_CAT2(a, b) a##b
+#define _TRACE_CAT(a, b) _TRACE_CAT2(a, b)
+#define TRACE_INIT(path) trace_init(path)
+#define TRACE_SCOPE(name) \
+    TraceScope _TRACE_CAT(_trace_scope_, __LINE__) \
+    __attribute__((cleanup(trace_scope_end))) = { name, trace_now() }
+#define TRACE_FUNC() TRACE_SCOPE(__func__)
+#define TRACE_POLL() trace_poll()
+
+#else
+
+#define TRACE_INIT(path) do {} while (0)
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_FUNC() do {} while (0)
+#define TRACE_POLL() do {} while (0)
+
+#endif
+
+#endif
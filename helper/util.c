@@ -8,8 +8,13 @@
 #include <libgen.h>    // dirname
 #include <stdarg.h>
 
-#include <time.h>       // timer_create, timer_settime
-#include <signal.h>     // sigaction
+#include <time.h>       // clock_gettime
+#include <sys/timerfd.h> // timerfd_create, timerfd_settime
+#include <pthread.h>
+#include <stdint.h>
+#include <limits.h>     // INT_MAX
+#include <inttypes.h>
+#include <strings.h>    // strncasecmp
 #include <cairo.h>
 
 #include <nemotool.h>
@@ -17,6 +22,8 @@
 #include <nemotimer.h>
 
 #include <curl/curl.h>
+#include <json.h>
+#include <nemoattr.h>
 #include "log.h"
 #include "util.h"
 //#include <pixmanhelper.h>
@@ -195,284 +202,1972 @@ _file_load(const char *file, int *line_len)
 }
 
 /****************************************************/
-/* Timer (signal implemented */
+/* Timer (timerfd implemented) */
 /***************************************************/
-struct sigaction _sa_old;
+// All timers share one timerfd which the event loop watches
+// (sigtimer_get_fd) and hands to sigtimer_dispatch(): callbacks run there,
+// never in signal context. Timers may be created and destroyed from any
+// thread. A timer never fires early, but up to the slack late, so that
+// timers with close deadlines are handled with a single wake up.
 int timer_init_cnt = 0;
-struct nemolist timer_list;
+static struct nemolist timer_list;
+pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Signaled whenever a callback returns
+pthread_cond_t timer_cond = PTHREAD_COND_INITIALIZER;
+pthread_t timer_dispatcher;     // thread running the callbacks
+int timer_fd = -1;
+unsigned int timer_slack = 0;   // ms
+uint64_t timer_armed;           // ms, 0: disarmed
+uint64_t timer_round;           // sigtimer_dispatch() calls
 
 struct __SigTimer
 {
     struct nemolist link;
-    timer_t *timerid;
+    uint64_t deadline;      // ms
+    unsigned int interval;  // ms
+    uint64_t round;         // last dispatch round which ran it
+    bool running;
+    bool destroyed;
+    bool waited;            // freed by the sigtimer_destroy() waiting for it
     SigTimerCb callback;
     void *data;
 };
 
+static uint64_t
+_sigtimer_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec/1000000;
+}
+
+// Wakes up at the latest time which is still inside every timer's
+// [deadline, deadline + slack] window. Called with timer_mutex held.
+static void
+_sigtimer_arm()
+{
+    uint64_t wake = 0;
+    SigTimer *timer;
+    nemolist_for_each(timer, &timer_list, link) {
+        if (timer->destroyed) continue;
+        uint64_t latest = timer->deadline + timer_slack;
+        if (!wake || latest < wake) wake = latest;
+    }
+    if (wake == timer_armed) return;
+    timer_armed = wake;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = wake/1000;
+    its.it_value.tv_nsec = (wake%1000) * 1000000;
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL))
+        perror("timerfd_settime failed: ");
+}
+
+bool
+sigtimer_init()
+{
+    pthread_mutex_lock(&timer_mutex);
+    if (timer_init_cnt > 0) {
+        timer_init_cnt++;
+        pthread_mutex_unlock(&timer_mutex);
+        return true;
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timer_fd < 0) {
+        perror("timerfd_create failed: ");
+        pthread_mutex_unlock(&timer_mutex);
+        return false;
+    }
+    timer_armed = 0;
+    timer_init_cnt++;
+    nemolist_init(&timer_list);
+    pthread_mutex_unlock(&timer_mutex);
+    return true;
+}
+
+void
+sigtimer_shutdown()
+{
+    pthread_mutex_lock(&timer_mutex);
+    if (timer_init_cnt <= 0 || --timer_init_cnt > 0) {
+        pthread_mutex_unlock(&timer_mutex);
+        return;
+    }
+
+    SigTimer *timer, *tmp;
+    nemolist_for_each_safe(timer, tmp, &timer_list, link) {
+        nemolist_remove(&timer->link);
+        free(timer);
+    }
+    close(timer_fd);
+    timer_fd = -1;
+    pthread_mutex_unlock(&timer_mutex);
+}
+
+int
+sigtimer_get_fd()
+{
+    return timer_fd;
+}
+
+void
+sigtimer_set_slack(unsigned int mseconds)
+{
+    pthread_mutex_lock(&timer_mutex);
+    timer_slack = mseconds;
+    if (timer_fd >= 0) _sigtimer_arm();
+    pthread_mutex_unlock(&timer_mutex);
+}
+
+void
+sigtimer_dispatch()
+{
+    uint64_t cnt;
+    if (read(timer_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        perror("timerfd read failed: ");
+
+    pthread_mutex_lock(&timer_mutex);
+    uint64_t round = ++timer_round;
+    uint64_t now = _sigtimer_now();
+    // The slack is only in the wake up time (_sigtimer_arm()): every timer
+    // that became due meanwhile is run in this round, none before its time.
+    while (1) {
+        SigTimer *timer, *due = NULL;
+        nemolist_for_each(timer, &timer_list, link) {
+            if (!timer->destroyed && (timer->round != round) &&
+                    (timer->deadline <= now)) {
+                due = timer;
+                break;
+            }
+        }
+        if (!due) break;
+
+        due->round = round;
+        due->deadline += due->interval;
+        if (due->deadline <= now) due->deadline = now + due->interval;
+        due->running = true;
+        timer_dispatcher = pthread_self();
+
+        // The callback may create or destroy timers
+        pthread_mutex_unlock(&timer_mutex);
+        bool ret = due->callback(due->data);
+        pthread_mutex_lock(&timer_mutex);
+
+        due->running = false;
+        pthread_cond_broadcast(&timer_cond);
+        if (due->waited) continue;
+        if (!ret || due->destroyed) {
+            nemolist_remove(&due->link);
+            free(due);
+        }
+    }
+    timer_armed = 0;
+    _sigtimer_arm();
+    pthread_mutex_unlock(&timer_mutex);
+}
+
+SigTimer *
+sigtimer_create(unsigned int mseconds, SigTimerCb callback, void *data)
+{
+    RET_IF(mseconds == 0, NULL);
+    RET_IF(!callback, NULL);
+    RET_IF(timer_fd < 0, NULL);
+
+    SigTimer *timer = calloc(sizeof(SigTimer), 1);
+    timer->interval = mseconds;
+    timer->deadline = _sigtimer_now() + mseconds;
+    timer->callback = callback;
+    timer->data = data;
+
+    pthread_mutex_lock(&timer_mutex);
+    nemolist_insert(&timer_list, &timer->link);
+    _sigtimer_arm();
+    pthread_mutex_unlock(&timer_mutex);
+
+    return timer;
+}
+
+void
+sigtimer_destroy(SigTimer *timer)
+{
+    RET_IF(!timer);
+    pthread_mutex_lock(&timer_mutex);
+    if (timer->running && pthread_equal(timer_dispatcher, pthread_self())) {
+        // From its own callback: freed by sigtimer_dispatch() after it
+        timer->destroyed = true;
+    } else if (timer->running) {
+        // From another thread: the caller may free the callback data as
+        // soon as this returns, so wait until the callback is done.
+        timer->destroyed = true;
+        timer->waited = true;
+        while (timer->running)
+            pthread_cond_wait(&timer_cond, &timer_mutex);
+        nemolist_remove(&timer->link);
+        free(timer);
+    } else {
+        nemolist_remove(&timer->link);
+        free(timer);
+    }
+    pthread_mutex_unlock(&timer_mutex);
+}
+
+/****************************************************/
+/* Json */
+/***************************************************/
+// names: path of object keys separated by "/", e.g. "sys/country". Arrays
+// on the way are searched element by element.
+bool
+_json_find(struct json_object *obj, const char *names, struct nemoattr *attr)
+{
+    bool ret = false;
+    char *_names = strdup(names);
+    char *name = strtok(_names, "/");
+
+    struct json_object_iterator it;
+    struct json_object_iterator itEnd;
+    it = json_object_iter_begin(obj);
+    itEnd = json_object_iter_end(obj);
+
+    while (!json_object_iter_equal(&it, &itEnd)) {
+        json_object *cobj = json_object_iter_peek_value(&it);
+        const char *_name = json_object_iter_peek_name(&it);
+        json_type type = json_object_get_type(cobj);
+        if (!strcmp(_name, name)) {
+            if (json_type_boolean == type) {
+                json_bool val = json_object_get_boolean(cobj);
+                nemoattr_seti(attr, val);
+                ret = true;
+                break;
+            } else if (json_type_double == type) {
+                double val = json_object_get_double(cobj);
+                nemoattr_setd(attr, val);
+                ret = true;
+                break;
+            } else if (json_type_int == type) {
+                int val = json_object_get_int(cobj);
+                nemoattr_seti(attr, val);
+                ret = true;
+                break;
+            } else if (json_type_string == type) {
+                const char *val = json_object_get_string(cobj);
+                nemoattr_sets(attr, val, json_object_get_string_len(cobj));
+                ret = true;
+                break;
+            } else if ((json_type_object == type) ||
+                        json_type_array == type) {
+                name = name + strlen(name) + 1;
+                if (json_type_object == type) {
+                    if (_json_find(cobj, name, attr)) {
+                        ret = true;
+                        break;
+                    }
+                } else {
+                    int i = 0;
+                    for (i = 0; i < json_object_array_length(cobj) ; i++) {
+                        struct json_object *ccobj;
+                        ccobj = json_object_array_get_idx(cobj, i);
+                        if (_json_find(ccobj, name, attr)) {
+                            ret = true;
+                            break;
+                        }
+                    }
+                    if (ret) break;
+                }
+            } else {
+                ERR("%s have wrong json type(%d)", name, type);
+            }
+        }
+        json_object_iter_next(&it);
+    }
+    free(_names);
+    return ret;
+}
+
+// Trie of the path components: every document node on the way is looked up
+// once, whatever the number of fields below it.
+typedef struct _JsonQueryNode JsonQueryNode;
+struct _JsonQueryNode {
+    char *key;
+    int field;                  // index in fields, -1: none
+    uint64_t mask;              // fields at or below this node
+    unsigned int child_cnt;
+    JsonQueryNode *children;
+};
+
+struct _JsonQuery {
+    JsonField *fields;
+    unsigned int field_cnt;
+    JsonQueryNode root;
+};
+
+static JsonQueryNode *
+_json_query_child(JsonQueryNode *node, const char *key, size_t len)
+{
+    unsigned int i;
+    for (i = 0 ; i < node->child_cnt ; i++) {
+        JsonQueryNode *child = &node->children[i];
+        if (!strncmp(child->key, key, len) && !child->key[len]) return child;
+    }
+    node->children = realloc(node->children, sizeof(JsonQueryNode) * (node->child_cnt + 1));
+    JsonQueryNode *child = &node->children[node->child_cnt++];
+    memset(child, 0, sizeof(JsonQueryNode));
+    child->key = strndup(key, len);
+    child->field = -1;
+    return child;
+}
+
 static void
-sigtimer_callback(int signo, siginfo_t *info, void *uctx)
+_json_query_node_fini(JsonQueryNode *node)
+{
+    unsigned int i;
+    for (i = 0 ; i < node->child_cnt ; i++) {
+        _json_query_node_fini(&node->children[i]);
+    }
+    free(node->children);
+    free(node->key);
+}
+
+JsonQuery *
+json_query_compile(const JsonField *fields, unsigned int cnt)
+{
+    RET_IF(!fields, NULL);
+    RET_IF(cnt > JSON_QUERY_FIELD_MAX, NULL);
+
+    JsonQuery *q = calloc(sizeof(JsonQuery), 1);
+    q->fields = malloc(sizeof(JsonField) * cnt);
+    memcpy(q->fields, fields, sizeof(JsonField) * cnt);
+    q->field_cnt = cnt;
+    q->root.field = -1;
+
+    unsigned int i;
+    for (i = 0 ; i < cnt ; i++) {
+        uint64_t bit = 1ULL << i;
+        JsonQueryNode *node = &q->root;
+        node->mask |= bit;
+
+        const char *key = fields[i].path;
+        while (*key) {
+            size_t len = strcspn(key, "/");
+            if (len) {
+                node = _json_query_child(node, key, len);
+                node->mask |= bit;
+            }
+            key += len;
+            if (*key) key++;
+        }
+        if (node->field >= 0) {
+            ERR("duplicated json path: %s", fields[i].path);
+            json_query_destroy(q);
+            return NULL;
+        }
+        node->field = i;
+    }
+    return q;
+}
+
+void
+json_query_destroy(JsonQuery *q)
+{
+    RET_IF(!q);
+    _json_query_node_fini(&q->root);
+    free(q->fields);
+    free(q);
+}
+
+static bool
+_json_query_set(const JsonField *field, struct json_object *obj, void *st)
+{
+    void *dst = (char *)st + field->offset;
+    json_type type = json_object_get_type(obj);
+    switch (field->type) {
+    case JSON_FIELD_INT:
+        if (type != json_type_int && type != json_type_double &&
+                type != json_type_boolean) return false;
+        *(int *)dst = json_object_get_int(obj);
+        return true;
+    case JSON_FIELD_DOUBLE:
+        if (type != json_type_int && type != json_type_double) return false;
+        *(double *)dst = json_object_get_double(obj);
+        return true;
+    case JSON_FIELD_BOOL:
+        if (type != json_type_boolean && type != json_type_int) return false;
+        *(bool *)dst = json_object_get_boolean(obj);
+        return true;
+    case JSON_FIELD_STRING:
+        if (type != json_type_string) return false;
+        *(char **)dst = strndup(json_object_get_string(obj),
+                json_object_get_string_len(obj));
+        return true;
+    }
+    return false;
+}
+
+static void
+_json_query_walk(JsonQuery *q, JsonQueryNode *node, struct json_object *obj,
+        void *st, uint64_t *found)
+{
+    json_type type = json_object_get_type(obj);
+    // Arrays are searched element by element, like _json_find()
+    if (type == json_type_array) {
+        size_t i, len = json_object_array_length(obj);
+        for (i = 0 ; i < len && (*found & node->mask) != node->mask ; i++) {
+            _json_query_walk(q, node, json_object_array_get_idx(obj, i), st, found);
+        }
+        return;
+    }
+
+    if (node->field >= 0 && !(*found & (1ULL << node->field))) {
+        if (_json_query_set(&q->fields[node->field], obj, st))
+            *found |= 1ULL << node->field;
+    }
+    if (type != json_type_object) return;
+
+    unsigned int i;
+    for (i = 0 ; i < node->child_cnt ; i++) {
+        JsonQueryNode *child = &node->children[i];
+        if ((*found & child->mask) == child->mask) continue;
+        struct json_object *cobj;
+        if (json_object_object_get_ex(obj, child->key, &cobj) && cobj)
+            _json_query_walk(q, child, cobj, st, found);
+    }
+}
+
+unsigned int
+json_query_run(JsonQuery *q, struct json_object *obj, void *st)
+{
+    RET_IF(!q, 0);
+    RET_IF(!st, 0);
+    if (!obj) return 0;
+
+    uint64_t found = 0;
+    _json_query_walk(q, &q->root, obj, st, &found);
+    return __builtin_popcountll(found);
+}
+
+struct _JsonStream {
+    struct json_tokener *tok;
+    struct json_object *obj;
+    bool failed;
+};
+
+JsonStream *
+json_stream_create()
+{
+    struct json_tokener *tok = json_tokener_new();
+    RET_IF(!tok, NULL);
+    JsonStream *js = calloc(sizeof(JsonStream), 1);
+    js->tok = tok;
+    return js;
+}
+
+void
+json_stream_destroy(JsonStream *js)
+{
+    RET_IF(!js);
+    if (js->obj) json_object_put(js->obj);
+    json_tokener_free(js->tok);
+    free(js);
+}
+
+void
+json_stream_reset(JsonStream *js)
+{
+    RET_IF(!js);
+    if (js->obj) json_object_put(js->obj);
+    js->obj = NULL;
+    js->failed = false;
+    json_tokener_reset(js->tok);
+}
+
+bool
+json_stream_feed(JsonStream *js, const char *data, size_t size)
+{
+    RET_IF(!js, false);
+    if (js->failed) return false;
+    // Like json_tokener_parse(), anything after the value is ignored
+    if (js->obj) return true;
+
+    while (size > 0) {
+        int len = (size > INT_MAX) ? INT_MAX : (int)size;
+        js->obj = json_tokener_parse_ex(js->tok, data, len);
+        if (js->obj) return true;
+
+        enum json_tokener_error err = json_tokener_get_error(js->tok);
+        if (err != json_tokener_continue) {
+            ERR("json parse failed: %s", json_tokener_error_desc(err));
+            js->failed = true;
+            return false;
+        }
+        data += len;
+        size -= len;
+    }
+    return true;
+}
+
+struct json_object *
+json_stream_finish(JsonStream *js)
+{
+    RET_IF(!js, NULL);
+    struct json_object *obj = js->obj;
+    if (!obj && !js->failed) ERR("json is not complete");
+    js->obj = NULL;
+    return obj;
+}
+
+// Read-only document: nodes, strings and keys are bumped out of a chain of
+// blocks, and every distinct key is stored once.
+#define JSON_DOC_BLOCK_MIN (64 * 1024)
+#define JSON_DOC_DEPTH_MAX 64
+#define JSON_DOC_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+typedef enum {
+    JSON_NODE_NULL = 0,
+    JSON_NODE_BOOL,
+    JSON_NODE_INT,
+    JSON_NODE_DOUBLE,
+    JSON_NODE_STRING,
+    JSON_NODE_ARRAY,
+    JSON_NODE_OBJECT,
+} JsonNodeType;
+
+typedef struct _JsonMember JsonMember;
+
+struct _JsonNode {
+    JsonNodeType type;
+    unsigned int len;           // string bytes, array items, object members
+    union {
+        bool b;
+        int64_t i;
+        double d;
+        const char *s;
+        JsonNode *items;
+        JsonMember *members;
+    };
+};
+
+struct _JsonMember {
+    const char *key;            // interned
+    JsonNode value;
+};
+
+typedef struct _JsonDocBlock JsonDocBlock;
+struct _JsonDocBlock {
+    JsonDocBlock *next;
+    size_t size, used;
+    char data[];
+};
+
+typedef struct _JsonDocKey JsonDocKey;
+struct _JsonDocKey {
+    const char *key;
+    size_t len;
+    uint32_t hash;
+};
+
+struct _JsonDoc {
+    JsonDocBlock *block;        // current, the older ones follow
+    size_t block_min;
+    JsonNode root;
+
+    JsonDocKey *keys;           // open addressing, NULL key: empty
+    unsigned int key_cnt, key_alloc;
+
+    // Parser state, gone once parsed
+    const char *p, *end, *text;
+    JsonMember *stack;          // children of the containers being parsed
+    unsigned int stack_cnt, stack_alloc;
+    const char *err;
+};
+
+static void *
+_json_doc_alloc(JsonDoc *doc, size_t size)
+{
+    size = JSON_DOC_ALIGN(size);
+    JsonDocBlock *block = doc->block;
+    if (!block || block->size - block->used < size) {
+        size_t bsize = block ? block->size * 2 : doc->block_min;
+        if (bsize < size) bsize = size;
+        JsonDocBlock *nblock = malloc(sizeof(JsonDocBlock) + bsize);
+        if (!nblock) return NULL;
+        nblock->next = block;
+        nblock->size = bsize;
+        nblock->used = 0;
+        doc->block = block = nblock;
+    }
+    void *ret = block->data + block->used;
+    block->used += size;
+    return ret;
+}
+
+// Gives back the end of the last allocation
+static void
+_json_doc_shrink(JsonDoc *doc, void *ptr, size_t size)
+{
+    JsonDocBlock *block = doc->block;
+    block->used = ((char *)ptr - block->data) + JSON_DOC_ALIGN(size);
+}
+
+static uint32_t
+_json_doc_hash(const char *key, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0 ; i < len ; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// key is the last allocation: it is kept if new, given back otherwise
+static const char *
+_json_doc_intern(JsonDoc *doc, char *key, size_t len)
+{
+    if ((doc->key_cnt + 1) * 4 > doc->key_alloc * 3) {
+        unsigned int i, alloc = doc->key_alloc ? doc->key_alloc * 2 : 64;
+        JsonDocKey *keys = calloc(sizeof(JsonDocKey), alloc);
+        if (!keys) return NULL;
+        for (i = 0 ; i < doc->key_alloc ; i++) {
+            JsonDocKey *k = &doc->keys[i];
+            if (!k->key) continue;
+            unsigned int j = k->hash & (alloc - 1);
+            while (keys[j].key) j = (j + 1) & (alloc - 1);
+            keys[j] = *k;
+        }
+        free(doc->keys);
+        doc->keys = keys;
+        doc->key_alloc = alloc;
+    }
+
+    uint32_t hash = _json_doc_hash(key, len);
+    unsigned int i = hash & (doc->key_alloc - 1);
+    while (doc->keys[i].key) {
+        JsonDocKey *k = &doc->keys[i];
+        if (k->hash == hash && k->len == len && !memcmp(k->key, key, len)) {
+            _json_doc_shrink(doc, key, 0);
+            return k->key;
+        }
+        i = (i + 1) & (doc->key_alloc - 1);
+    }
+    doc->keys[i].key = key;
+    doc->keys[i].len = len;
+    doc->keys[i].hash = hash;
+    doc->key_cnt++;
+    return key;
+}
+
+static bool
+_json_doc_error(JsonDoc *doc, const char *err)
+{
+    if (!doc->err) doc->err = err;
+    return false;
+}
+
+static void
+_json_doc_skip_space(JsonDoc *doc)
+{
+    while (doc->p < doc->end &&
+            (*doc->p == ' ' || *doc->p == '\t' || *doc->p == '\n' || *doc->p == '\r'))
+        doc->p++;
+}
+
+static int
+_json_doc_hex4(const char *p)
+{
+    int i, val = 0;
+    for (i = 0 ; i < 4 ; i++) {
+        char c = p[i];
+        val <<= 4;
+        if (c >= '0' && c <= '9') val |= c - '0';
+        else if (c >= 'a' && c <= 'f') val |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') val |= c - 'A' + 10;
+        else return -1;
+    }
+    return val;
+}
+
+static char *
+_json_doc_utf8(char *dst, uint32_t cp)
+{
+    if (cp < 0x80) {
+        *dst++ = cp;
+    } else if (cp < 0x800) {
+        *dst++ = 0xc0 | (cp >> 6);
+        *dst++ = 0x80 | (cp & 0x3f);
+    } else if (cp < 0x10000) {
+        *dst++ = 0xe0 | (cp >> 12);
+        *dst++ = 0x80 | ((cp >> 6) & 0x3f);
+        *dst++ = 0x80 | (cp & 0x3f);
+    } else {
+        *dst++ = 0xf0 | (cp >> 18);
+        *dst++ = 0x80 | ((cp >> 12) & 0x3f);
+        *dst++ = 0x80 | ((cp >> 6) & 0x3f);
+        *dst++ = 0x80 | (cp & 0x3f);
+    }
+    return dst;
+}
+
+// At the opening quote. The unescaped string is never longer than the
+// text, so it is decoded in place into the arena and trimmed.
+static bool
+_json_doc_string(JsonDoc *doc, char **str, size_t *len)
+{
+    const char *p = ++doc->p;
+    while (p < doc->end && *p != '"') {
+        if (*p == '\\') p++;
+        p++;
+    }
+    if (p >= doc->end) return _json_doc_error(doc, "unterminated string");
+
+    size_t raw = p - doc->p;
+    char *s = _json_doc_alloc(doc, raw + 1);
+    if (!s) return _json_doc_error(doc, "out of memory");
+
+    char *dst = s;
+    const char *src = doc->p;
+    while (src < p) {
+        unsigned char c = *src++;
+        if (c < 0x20) return _json_doc_error(doc, "control character in string");
+        if (c != '\\') {
+            *dst++ = c;
+            continue;
+        }
+        switch (*src++) {
+        case '"': *dst++ = '"'; break;
+        case '\\': *dst++ = '\\'; break;
+        case '/': *dst++ = '/'; break;
+        case 'b': *dst++ = '\b'; break;
+        case 'f': *dst++ = '\f'; break;
+        case 'n': *dst++ = '\n'; break;
+        case 'r': *dst++ = '\r'; break;
+        case 't': *dst++ = '\t'; break;
+        case 'u': {
+            int cp = (p - src >= 4) ? _json_doc_hex4(src) : -1;
+            if (cp < 0) return _json_doc_error(doc, "invalid \\u escape");
+            src += 4;
+            // Surrogate pair, a lone one is kept as is like json-c
+            if (cp >= 0xd800 && cp < 0xdc00 && p - src >= 6 &&
+                    src[0] == '\\' && src[1] == 'u') {
+                int lo = _json_doc_hex4(src + 2);
+                if (lo >= 0xdc00 && lo < 0xe000) {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                    src += 6;
+                }
+            }
+            dst = _json_doc_utf8(dst, cp);
+            break;
+        }
+        default:
+            return _json_doc_error(doc, "invalid escape");
+        }
+    }
+    *dst = '\0';
+    *len = dst - s;
+    *str = s;
+    _json_doc_shrink(doc, s, *len + 1);
+    doc->p = p + 1;
+    return true;
+}
+
+static bool
+_json_doc_number(JsonDoc *doc, JsonNode *node)
+{
+    const char *p = doc->p;
+    bool real = false;
+    if (p < doc->end && *p == '-') p++;
+    while (p < doc->end) {
+        char c = *p;
+        if (c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-') real = true;
+        else if (c < '0' || c > '9') break;
+        p++;
+    }
+
+    // The text is not terminated: strtod() gets a copy
+    char buf[64];
+    size_t len = p - doc->p;
+    if (!len || len >= sizeof(buf)) return _json_doc_error(doc, "invalid number");
+    memcpy(buf, doc->p, len);
+    buf[len] = '\0';
+
+    char *end;
+    if (!real) {
+        errno = 0;
+        node->i = strtoll(buf, &end, 10);
+        node->type = JSON_NODE_INT;
+        // Out of the int64 range: kept as a double
+        if (errno == ERANGE) real = true;
+    }
+    if (real) {
+        node->d = strtod(buf, &end);
+        node->type = JSON_NODE_DOUBLE;
+    }
+    if (*end) return _json_doc_error(doc, "invalid number");
+    doc->p = p;
+    return true;
+}
+
+static bool
+_json_doc_literal(JsonDoc *doc, const char *lit)
+{
+    size_t len = strlen(lit);
+    if ((size_t)(doc->end - doc->p) < len || memcmp(doc->p, lit, len))
+        return _json_doc_error(doc, "invalid literal");
+    doc->p += len;
+    return true;
+}
+
+static JsonMember *
+_json_doc_push(JsonDoc *doc)
+{
+    if (doc->stack_cnt == doc->stack_alloc) {
+        unsigned int alloc = doc->stack_alloc ? doc->stack_alloc * 2 : 64;
+        JsonMember *stack = realloc(doc->stack, sizeof(JsonMember) * alloc);
+        if (!stack) return NULL;
+        doc->stack = stack;
+        doc->stack_alloc = alloc;
+    }
+    return &doc->stack[doc->stack_cnt++];
+}
+
+static bool _json_doc_value(JsonDoc *doc, JsonNode *node, int depth);
+
+// At '[' or '{': the children are gathered on the stack, then copied to
+// the arena in one piece once their number is known.
+static bool
+_json_doc_container(JsonDoc *doc, JsonNode *node, int depth)
+{
+    bool object = (*doc->p == '{');
+    char close = object ? '}' : ']';
+    unsigned int first = doc->stack_cnt;
+
+    if (depth >= JSON_DOC_DEPTH_MAX) return _json_doc_error(doc, "too deep");
+    doc->p++;
+    _json_doc_skip_space(doc);
+    if (doc->p < doc->end && *doc->p == close) {
+        doc->p++;
+    } else {
+        while (1) {
+            const char *key = NULL;
+            if (object) {
+                char *s;
+                size_t len;
+                if (doc->p >= doc->end || *doc->p != '"')
+                    return _json_doc_error(doc, "key expected");
+                if (!_json_doc_string(doc, &s, &len)) return false;
+                key = _json_doc_intern(doc, s, len);
+                if (!key) return _json_doc_error(doc, "out of memory");
+                _json_doc_skip_space(doc);
+                if (doc->p >= doc->end || *doc->p != ':')
+                    return _json_doc_error(doc, "':' expected");
+                doc->p++;
+            }
+
+            JsonNode value;
+            if (!_json_doc_value(doc, &value, depth + 1)) return false;
+            JsonMember *m = _json_doc_push(doc);
+            if (!m) return _json_doc_error(doc, "out of memory");
+            m->key = key;
+            m->value = value;
+
+            _json_doc_skip_space(doc);
+            if (doc->p >= doc->end) return _json_doc_error(doc, "unexpected end");
+            if (*doc->p == ',') {
+                doc->p++;
+                _json_doc_skip_space(doc);
+                continue;
+            }
+            if (*doc->p != close) return _json_doc_error(doc, "',' expected");
+            doc->p++;
+            break;
+        }
+    }
+
+    unsigned int i, cnt = doc->stack_cnt - first;
+    node->len = cnt;
+    if (object) {
+        node->type = JSON_NODE_OBJECT;
+        node->members = _json_doc_alloc(doc, sizeof(JsonMember) * cnt);
+        if (!node->members) return _json_doc_error(doc, "out of memory");
+        memcpy(node->members, &doc->stack[first], sizeof(JsonMember) * cnt);
+    } else {
+        node->type = JSON_NODE_ARRAY;
+        node->items = _json_doc_alloc(doc, sizeof(JsonNode) * cnt);
+        if (!node->items) return _json_doc_error(doc, "out of memory");
+        for (i = 0 ; i < cnt ; i++) {
+            node->items[i] = doc->stack[first + i].value;
+        }
+    }
+    doc->stack_cnt = first;
+    return true;
+}
+
+static bool
+_json_doc_value(JsonDoc *doc, JsonNode *node, int depth)
+{
+    memset(node, 0, sizeof(JsonNode));
+    _json_doc_skip_space(doc);
+    if (doc->p >= doc->end) return _json_doc_error(doc, "unexpected end");
+
+    switch (*doc->p) {
+    case '{':
+    case '[':
+        return _json_doc_container(doc, node, depth);
+    case '"': {
+        char *s;
+        size_t len;
+        if (!_json_doc_string(doc, &s, &len)) return false;
+        node->type = JSON_NODE_STRING;
+        node->s = s;
+        node->len = len;
+        return true;
+    }
+    case 't':
+        node->type = JSON_NODE_BOOL;
+        node->b = true;
+        return _json_doc_literal(doc, "true");
+    case 'f':
+        node->type = JSON_NODE_BOOL;
+        return _json_doc_literal(doc, "false");
+    case 'n':
+        return _json_doc_literal(doc, "null");
+    default:
+        return _json_doc_number(doc, node);
+    }
+}
+
+JsonDoc *
+json_doc_parse(const char *text, size_t len)
+{
+    RET_IF(!text, NULL);
+
+    JsonDoc *doc = calloc(sizeof(JsonDoc), 1);
+    doc->text = doc->p = text;
+    doc->end = text + len;
+
+    // Nodes take about twice the text: mostly one block
+    doc->block_min = len * 2;
+    if (doc->block_min < JSON_DOC_BLOCK_MIN) doc->block_min = JSON_DOC_BLOCK_MIN;
+
+    // Like json_tokener_parse(), anything after the value is ignored
+    bool ret = _json_doc_value(doc, &doc->root, 0);
+    free(doc->stack);
+    doc->stack = NULL;
+    if (!ret) {
+        ERR("json parse failed at %zu: %s", (size_t)(doc->p - doc->text), doc->err);
+        json_doc_destroy(doc);
+        return NULL;
+    }
+    return doc;
+}
+
+void
+json_doc_destroy(JsonDoc *doc)
+{
+    RET_IF(!doc);
+    JsonDocBlock *block = doc->block;
+    while (block) {
+        JsonDocBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(doc->keys);
+    free(doc->stack);
+    free(doc);
+}
+
+const JsonNode *
+json_doc_get_root(JsonDoc *doc)
+{
+    RET_IF(!doc, NULL);
+    return &doc->root;
+}
+
+const JsonNode *
+json_node_get(const JsonNode *node, const char *key)
+{
+    RET_IF(!key, NULL);
+    if (!node || node->type != JSON_NODE_OBJECT) return NULL;
+    unsigned int i;
+    // Like json-c, the last one wins
+    for (i = node->len ; i > 0 ; i--) {
+        if (!strcmp(node->members[i - 1].key, key)) return &node->members[i - 1].value;
+    }
+    return NULL;
+}
+
+unsigned int
+json_node_array_length(const JsonNode *node)
+{
+    if (!node || node->type != JSON_NODE_ARRAY) return 0;
+    return node->len;
+}
+
+const JsonNode *
+json_node_array_get(const JsonNode *node, unsigned int idx)
+{
+    if (idx >= json_node_array_length(node)) return NULL;
+    return &node->items[idx];
+}
+
+static bool
+_json_node_find(const JsonNode *node, const char *name, struct nemoattr *attr)
+{
+    // Arrays on the way are searched element by element
+    if (node->type == JSON_NODE_ARRAY) {
+        unsigned int i;
+        for (i = 0 ; i < node->len ; i++) {
+            if (_json_node_find(&node->items[i], name, attr)) return true;
+        }
+        return false;
+    }
+
+    if (!*name) {
+        switch (node->type) {
+        case JSON_NODE_BOOL:
+            nemoattr_seti(attr, node->b);
+            return true;
+        case JSON_NODE_INT:
+            nemoattr_seti(attr, node->i);
+            return true;
+        case JSON_NODE_DOUBLE:
+            nemoattr_setd(attr, node->d);
+            return true;
+        case JSON_NODE_STRING:
+            nemoattr_sets(attr, node->s, node->len);
+            return true;
+        default:
+            return false;
+        }
+    }
+    if (node->type != JSON_NODE_OBJECT) return false;
+
+    size_t len = strcspn(name, "/");
+    const char *next = name[len] ? name + len + 1 : name + len;
+    unsigned int i;
+    // Repeated keys: the last one first, like json-c keeps it
+    for (i = node->len ; i > 0 ; i--) {
+        const JsonMember *m = &node->members[i - 1];
+        if (strncmp(m->key, name, len) || m->key[len]) continue;
+        if (_json_node_find(&m->value, next, attr)) return true;
+    }
+    return false;
+}
+
+bool
+json_node_find(const JsonNode *node, const char *names, struct nemoattr *attr)
+{
+    RET_IF(!names, false);
+    RET_IF(!attr, false);
+    if (!node || !*names) return false;
+    return _json_node_find(node, names, attr);
+}
+
+static bool
+_json_query_set_node(const JsonField *field, const JsonNode *node, void *st)
+{
+    void *dst = (char *)st + field->offset;
+    switch (field->type) {
+    case JSON_FIELD_INT:
+        if (node->type == JSON_NODE_INT) *(int *)dst = node->i;
+        else if (node->type == JSON_NODE_DOUBLE) *(int *)dst = node->d;
+        else if (node->type == JSON_NODE_BOOL) *(int *)dst = node->b;
+        else return false;
+        return true;
+    case JSON_FIELD_DOUBLE:
+        if (node->type == JSON_NODE_INT) *(double *)dst = node->i;
+        else if (node->type == JSON_NODE_DOUBLE) *(double *)dst = node->d;
+        else return false;
+        return true;
+    case JSON_FIELD_BOOL:
+        if (node->type == JSON_NODE_BOOL) *(bool *)dst = node->b;
+        else if (node->type == JSON_NODE_INT) *(bool *)dst = !!node->i;
+        else return false;
+        return true;
+    case JSON_FIELD_STRING:
+        if (node->type != JSON_NODE_STRING) return false;
+        *(char **)dst = strndup(node->s, node->len);
+        return true;
+    }
+    return false;
+}
+
+static void
+_json_query_walk_node(JsonQuery *q, JsonQueryNode *qnode, const JsonNode *node,
+        void *st, uint64_t *found)
+{
+    unsigned int i;
+    if (node->type == JSON_NODE_ARRAY) {
+        for (i = 0 ; i < node->len && (*found & qnode->mask) != qnode->mask ; i++) {
+            _json_query_walk_node(q, qnode, &node->items[i], st, found);
+        }
+        return;
+    }
+
+    if (qnode->field >= 0 && !(*found & (1ULL << qnode->field))) {
+        if (_json_query_set_node(&q->fields[qnode->field], node, st))
+            *found |= 1ULL << qnode->field;
+    }
+    if (node->type != JSON_NODE_OBJECT) return;
+
+    for (i = 0 ; i < qnode->child_cnt ; i++) {
+        JsonQueryNode *child = &qnode->children[i];
+        if ((*found & child->mask) == child->mask) continue;
+        const JsonNode *cnode = json_node_get(node, child->key);
+        if (cnode) _json_query_walk_node(q, child, cnode, st, found);
+    }
+}
+
+unsigned int
+json_query_run_node(JsonQuery *q, const JsonNode *node, void *st)
+{
+    RET_IF(!q, 0);
+    RET_IF(!st, 0);
+    if (!node) return 0;
+
+    uint64_t found = 0;
+    _json_query_walk_node(q, &q->root, node, st, &found);
+    return __builtin_popcountll(found);
+}
+
+/*******************************************
+ * Nemo Connection *
+ * *****************************************/
+typedef enum {
+    NEMOCON_STATE_IDLE = 0,     // not run yet
+    NEMOCON_STATE_PENDING,      // waiting for a connection slot
+    NEMOCON_STATE_RUNNING,      // in the multi handle
+    NEMOCON_STATE_WAITING,      // for the same request already in flight
+    NEMOCON_STATE_DONE,         // end callback is running
+} NemoConState;
+
+struct _NemoCon {
+    struct nemolist link;       // pending queue or running list
+
+    struct nemotool *tool;
+    CURL *curl;
+
+    char *url;
+    uint64_t hash;              // of url
+    char *host;
+
+    NemoConPriority priority;
+    NemoConState state;
+    uint32_t deadline;          // ms from nemocon_run, 0: none
+    uint64_t expire;            // monotonic ms, 0: none
+    CURLcode result;
+
+    // Response cache
+    bool cache;
+    bool from_cache;
+    bool no_store, no_cache;
+    long max_age;               // -1: none
+    time_t expires;             // 0: none
+    NemoCon *leader;            // while waiting
+    struct nemolist waiters;
+
+    size_t data_size;
+    size_t data_alloc;      // one more than data_size at least, for a NUL
+    char *data;
+    size_t received;
+    bool keep_data;         // false: only while the cache or waiters need it
+    bool discard;           // decided at the first byte
+    NemoCon_Data_Callback data_callback;
+    void *data_userdata;
+    NemoCon_End_Callback end_callback;
+    void *end_userdata;
+};
+
+// One per socket curl wants watched, attached to it with curl_multi_assign()
+// so the socket callback finds it without a lookup. Removed ones are kept
+// instead of freed, as an event for it may still be pending in the current
+// epoll batch, and only reused for the same fd number: a pending event
+// then never reaches a socket of another fd.
+typedef struct _NemoConSocket NemoConSocket;
+struct _NemoConSocket {
+    struct nemotask task;
+    curl_socket_t fd;       // CURL_SOCKET_BAD once removed
+    uint32_t events;
+};
+
+static CURLM *_curlm;
+static struct nemotool *_curlm_tool;
+static struct nemotimer *_curlm_timer;
+// Indexed by fd
+static NemoConSocket **_curlm_sockets;
+static int _curlm_sockets_cnt;
+
+// Requests wait in the queue of their priority until there is a free
+// slot both globally and for their host. A higher priority request which
+// finds every slot taken sends a lower priority one back to its queue.
+static struct nemolist _nemocon_pending[NEMOCON_PRIORITY_MAX];
+static struct nemolist _nemocon_running;
+static unsigned int _nemocon_running_cnt;
+static unsigned int _nemocon_max = NEMOCON_MAX_CONNECTIONS;
+static unsigned int _nemocon_max_per_host = NEMOCON_MAX_PER_HOST;
+static struct nemotimer *_nemocon_sched_timer;
+
+// Cache hits, completed from the main loop
+static struct nemolist _nemocon_hits = { &_nemocon_hits, &_nemocon_hits };
+
+static bool _nemocon_reserve(NemoCon *con, size_t size);
+
+/** Response cache **/
+typedef struct _NemoConCache NemoConCache;
+struct _NemoConCache {
+    struct nemolist link;       // most recently used first
+    uint64_t hash;
+    char *url;
+    char *data;
+    size_t size;
+    time_t expire;
+};
+
+static struct nemolist _nemocon_cache = { &_nemocon_cache, &_nemocon_cache };
+static size_t _nemocon_cache_size;
+static size_t _nemocon_cache_max = NEMOCON_CACHE_MAX_SIZE;
+static uint32_t _nemocon_cache_min_ttl;
+static char *_nemocon_cache_dir;
+
+// FNV-1a
+static uint64_t
+_nemocon_hash(const char *str)
 {
-    SigTimer *timer, *tmp;
-    timer_t *timerid = info->si_value.sival_ptr;
-    nemolist_for_each_safe(timer, tmp, &timer_list, link) {
-        if (timer->timerid == timerid) {
-            if (!timer->callback(timer->data))
-                sigtimer_destroy(timer);
-        } else {
-            ERR("Unrecognized timerid: 0x%lx\n", (long) *timerid);
-        }
+    uint64_t hash = 14695981039346656037ULL;
+    for ( ; *str ; str++) {
+        hash ^= (unsigned char)*str;
+        hash *= 1099511628211ULL;
     }
+    return hash;
 }
 
-bool
-sigtimer_init()
+static void
+_nemocon_cache_free(NemoConCache *entry)
 {
-    if (timer_init_cnt > 0) return true;
+    nemolist_remove(&entry->link);
+    _nemocon_cache_size -= entry->size;
+    free(entry->url);
+    free(entry->data);
+    free(entry);
+}
 
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(struct sigaction));
-    sa.sa_flags = SA_SIGINFO;
-    sa.sa_sigaction = sigtimer_callback;
-    if (sigaction(SIGRTMIN, &sa, &_sa_old)) {
-        perror("sigaction failed: ");
-        return false;
+// Takes data, which is NUL terminated
+static NemoConCache *
+_nemocon_cache_insert(const char *url, uint64_t hash, char *data, size_t size, time_t expire)
+{
+    NemoConCache *entry, *tmp;
+    nemolist_for_each_safe(entry, tmp, &_nemocon_cache, link) {
+        if (entry->hash == hash && !strcmp(entry->url, url)) _nemocon_cache_free(entry);
+    }
+    if (size > _nemocon_cache_max) {
+        free(data);
+        return NULL;
     }
 
-    timer_init_cnt++;
-    nemolist_init(&timer_list);
-    return true;
+    entry = calloc(sizeof(NemoConCache), 1);
+    entry->hash = hash;
+    entry->url = strdup(url);
+    entry->data = data;
+    entry->size = size;
+    entry->expire = expire;
+    nemolist_insert(&_nemocon_cache, &entry->link);
+    _nemocon_cache_size += size;
+
+    while (_nemocon_cache_size > _nemocon_cache_max) {
+        _nemocon_cache_free(container_of(_nemocon_cache.prev, NemoConCache, link));
+    }
+    return entry;
 }
 
-void
-sigtimer_shutdown()
+static char *
+_nemocon_cache_path(uint64_t hash)
 {
-    if (timer_init_cnt <= 0) return;
-    timer_init_cnt--;
+    return _strdup_printf("%s/%016"PRIx64".cache", _nemocon_cache_dir, hash);
+}
 
-    SigTimer *timer, *tmp;
-    nemolist_for_each_safe(timer, tmp, &timer_list, link) {
-        sigtimer_destroy(timer);
+// File: "<expire> <size>\n<url>\n<body>"
+static void
+_nemocon_cache_save(NemoConCache *entry)
+{
+    char *path = _nemocon_cache_path(entry->hash);
+    char *tmp = _strdup_printf("%s.part", path);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        ERR("%s: %s", tmp, strerror(errno));
+        free(tmp);
+        free(path);
+        return;
     }
-    nemolist_empty(&timer_list);
-    if (sigaction(SIGRTMIN, &_sa_old, NULL)) {
-        perror("sigaction failed: ");
+    fprintf(fp, "%lld %zu\n%s\n", (long long)entry->expire, entry->size, entry->url);
+    bool ok = fwrite(entry->data, 1, entry->size, fp) == entry->size;
+    if (fclose(fp)) ok = false;
+    if (!ok || rename(tmp, path)) {
+        ERR("%s: %s", path, strerror(errno));
+        unlink(tmp);
     }
+    free(tmp);
+    free(path);
 }
 
-SigTimer *
-sigtimer_create(unsigned int mseconds, SigTimerCb callback, void *data)
+static NemoConCache *
+_nemocon_cache_load(const char *url, uint64_t hash)
 {
-    RET_IF(mseconds == 0, NULL);
-    RET_IF(!callback, NULL);
+    char *path = _nemocon_cache_path(hash);
+    FILE *fp = fopen(path, "r");
+    free(path);
+    if (!fp) return NULL;
+
+    NemoConCache *entry = NULL;
+    long long expire;
+    size_t size;
+    char *line = NULL;
+    size_t len = 0;
+    if (fscanf(fp, "%lld %zu\n", &expire, &size) == 2 &&
+            getline(&line, &len, fp) > 0) {
+        line[strcspn(line, "\n")] = '\0';
+        if (!strcmp(line, url) && expire > time(NULL) && size <= _nemocon_cache_max) {
+            char *data = malloc(size + 1);
+            if (data && fread(data, 1, size, fp) == size) {
+                data[size] = '\0';
+                entry = _nemocon_cache_insert(url, hash, data, size, expire);
+            } else {
+                free(data);
+            }
+        }
+    }
+    free(line);
+    fclose(fp);
+    return entry;
+}
 
-    timer_t *timerid = malloc(sizeof(timer_t));
-    struct sigevent sev;
-    sev.sigev_notify = SIGEV_SIGNAL;
-    sev.sigev_signo = SIGRTMIN;
-    sev.sigev_value.sival_ptr = timerid;
-    if (timer_create(CLOCK_MONOTONIC, &sev, timerid)) {
-        perror("timer_create failed: ");
-        return NULL;
+static NemoConCache *
+_nemocon_cache_lookup(const char *url, uint64_t hash)
+{
+    NemoConCache *entry, *tmp;
+    nemolist_for_each_safe(entry, tmp, &_nemocon_cache, link) {
+        if (entry->hash != hash || strcmp(entry->url, url)) continue;
+        if (entry->expire <= time(NULL)) {
+            _nemocon_cache_free(entry);
+            break;
+        }
+        nemolist_remove(&entry->link);
+        nemolist_insert(&_nemocon_cache, &entry->link);
+        return entry;
     }
+    if (_nemocon_cache_dir) return _nemocon_cache_load(url, hash);
+    return NULL;
+}
 
-    struct itimerspec its;
-    its.it_value.tv_sec = mseconds/1000;
-    its.it_value.tv_nsec = (mseconds%1000) * 1000000;
-    its.it_interval.tv_sec = its.it_value.tv_sec;
-    its.it_interval.tv_nsec = its.it_value.tv_nsec;
-
-    if (timer_settime(*timerid, 0, &its, NULL)) {
-        perror("timer_settime failed: ");
-        timer_delete(*timerid);
-        return NULL;
+// Seconds the response may be cached, from its headers: 0 if it may not
+static long
+_nemocon_cache_ttl(NemoCon *con, time_t now)
+{
+    if (!con->cache || con->no_store) return 0;
+
+    long code = 0;
+    curl_easy_getinfo(con->curl, CURLINFO_RESPONSE_CODE, &code);
+    if (code != 200) return 0;
+
+    long ttl = 0;
+    if (con->no_cache) ttl = 0;
+    else if (con->max_age >= 0) ttl = con->max_age;
+    else if (con->expires > now) ttl = con->expires - now;
+    if (ttl < (long)_nemocon_cache_min_ttl) ttl = _nemocon_cache_min_ttl;
+    return ttl;
+}
+
+static void
+_nemocon_cache_store(NemoCon *con)
+{
+    if (!con->data) return;
+    time_t now = time(NULL);
+    long ttl = _nemocon_cache_ttl(con, now);
+    if (ttl <= 0) return;
+
+    char *data = malloc(con->data_size + 1);
+    if (!data) return;
+    memcpy(data, con->data, con->data_size + 1);
+    NemoConCache *entry = _nemocon_cache_insert(con->url, con->hash, data,
+            con->data_size, now + ttl);
+    if (entry && _nemocon_cache_dir) _nemocon_cache_save(entry);
+}
+
+static size_t
+_nemocon_header_function(char *buf, size_t size, size_t nitems, void *userdata)
+{
+    NemoCon *con = userdata;
+    size_t len = size * nitems;
+    char *line = strndup(buf, len);
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (!strncasecmp(line, "HTTP/", 5)) {
+        // A new response: after a redirect, or a 100 Continue
+        con->no_store = con->no_cache = false;
+        con->max_age = -1;
+        con->expires = 0;
+    } else if (!strncasecmp(line, "Cache-Control:", 14)) {
+        char *save, *tok;
+        for (tok = strtok_r(line + 14, ",", &save) ; tok ;
+                tok = strtok_r(NULL, ",", &save)) {
+            while (*tok == ' ' || *tok == '\t') tok++;
+            if (!strncasecmp(tok, "no-store", 8)) con->no_store = true;
+            else if (!strncasecmp(tok, "no-cache", 8)) con->no_cache = true;
+            else if (!strncasecmp(tok, "max-age=", 8)) con->max_age = atol(tok + 8);
+        }
+    } else if (!strncasecmp(line, "Expires:", 8)) {
+        time_t expires = curl_getdate(line + 8, NULL);
+        con->expires = (expires > 0) ? expires : 0;
     }
+    free(line);
+    return len;
+}
 
-    SigTimer *timer = calloc(sizeof(SigTimer), 1);
-    timer->timerid = timerid;
-    timer->callback = callback;
-    timer->data = data;
+void
+nemocon_cache_set_min_ttl(uint32_t seconds)
+{
+    _nemocon_cache_min_ttl = seconds;
+}
 
-    nemolist_insert(&timer_list, &timer->link);
+void
+nemocon_cache_set_max_size(size_t bytes)
+{
+    _nemocon_cache_max = bytes;
+    while (_nemocon_cache_size > _nemocon_cache_max) {
+        _nemocon_cache_free(container_of(_nemocon_cache.prev, NemoConCache, link));
+    }
+}
 
-    return timer;
+bool
+nemocon_cache_set_dir(const char *dir)
+{
+    if (_nemocon_cache_dir) free(_nemocon_cache_dir);
+    _nemocon_cache_dir = NULL;
+    if (!dir) return true;
+    if (!_file_mkdir(dir, 0700)) return false;
+    _nemocon_cache_dir = strdup(dir);
+    return true;
 }
 
 void
-sigtimer_destroy(SigTimer *timer)
+nemocon_cache_clear()
 {
-    RET_IF(!timer);
-    if (timer_delete(*(timer->timerid))) {
-        perror("timer delete failed: ");
+    while (!nemolist_empty(&_nemocon_cache)) {
+        _nemocon_cache_free(nemolist_node0(&_nemocon_cache, NemoConCache, link));
     }
-    nemolist_remove(&timer->link);
-    free(timer->timerid);
-    free(timer);
 }
 
-/*******************************************
- * Nemo Connection *
- * *****************************************/
-struct _NemoCon {
-    struct nemolist link;
+/** Scheduler **/
+static void
+_nemocon_unlink(NemoCon *con)
+{
+    nemolist_remove(&con->link);
+    nemolist_init(&con->link);
+}
 
-    struct nemotool *tool;
-    CURL *curl;
+// Out of the multi handle, the slot is free again
+static void
+_nemocon_stop(NemoCon *con)
+{
+    if (con->state != NEMOCON_STATE_RUNNING) return;
+    curl_multi_remove_handle(_curlm, con->curl);
+    _nemocon_running_cnt--;
+    con->state = NEMOCON_STATE_IDLE;
+}
 
-    char *url;
+static void
+_nemocon_schedule_later(uint32_t ms)
+{
+    if (_nemocon_sched_timer) nemotimer_set_timeout(_nemocon_sched_timer, ms ? ms : 1);
+}
 
-    size_t data_size;
-    void *data;
-    struct nemotask fd_task;
-    NemoCon_Data_Callback data_callback;
-    void *data_userdata;
-    NemoCon_End_Callback end_callback;
-    void *end_userdata;
-};
+// The first one waiting for con makes the request instead. Its deadline
+// still counts from its own nemocon_run().
+static void
+_nemocon_promote(NemoCon *con)
+{
+    if (nemolist_empty(&con->waiters)) return;
 
-CURLM *_curlm;
-List *_curlm_fd_lists;
-struct nemotimer *_curlm_timer;
+    NemoCon *next = nemolist_node0(&con->waiters, NemoCon, link);
+    _nemocon_unlink(next);
+    nemolist_insert_list(&next->waiters, &con->waiters);
+    nemolist_init(&con->waiters);
 
-struct nemolist _nemocon_lists;
+    NemoCon *waiter;
+    nemolist_for_each(waiter, &next->waiters, link) {
+        waiter->leader = next;
+        if (waiter->priority > next->priority) next->priority = waiter->priority;
+    }
+    next->leader = NULL;
+    nemolist_insert_tail(&_nemocon_pending[next->priority], &next->link);
+    next->state = NEMOCON_STATE_PENDING;
+    _nemocon_schedule_later(1);
+}
 
 void
 nemocon_destroy(NemoCon *con)
 {
+    if (con->state == NEMOCON_STATE_RUNNING) {
+        _nemocon_stop(con);
+        _nemocon_schedule_later(1);
+    }
+    _nemocon_unlink(con);
+    _nemocon_promote(con);
+
     curl_easy_cleanup(con->curl);
     if (con->url) free(con->url);
-    nemolist_remove(&con->link);
+    if (con->host) free(con->host);
     if (con->data) free(con->data);
     free(con);
 }
 
-static void _nemocon_perform(NemoCon *con);
-
-static void
-_nemocon_fd_callback(struct nemotask *task, uint32_t events)
+void
+nemocon_cancel(NemoCon *con)
 {
-    NemoCon *con = container_of(task, NemoCon, fd_task);
-    _nemocon_perform(con);
+    RET_IF(!con);
+    // Destroyed right after the end callback anyway
+    if (con->state == NEMOCON_STATE_DONE) return;
+    nemocon_destroy(con);
 }
 
+// Gives a copy of the body to a request which did not receive it itself
 static void
-_nemocon_timer_callback(struct nemotimer *timer, void *userdata)
+_nemocon_deliver(NemoCon *con, const char *data, size_t size)
 {
-    NemoCon *con = userdata;
-    _nemocon_perform(con);
+    if (!data || !_nemocon_reserve(con, size)) return;
+    memcpy(con->data, data, size);
+    con->data[size] = '\0';
+    con->data_size = size;
+    if (con->data_callback)
+        con->data_callback(con, con->data, con->data_size, con->data_userdata);
 }
 
 static void
-_nemocon_set_fd(NemoCon *con)
+_nemocon_finish(NemoCon *con, CURLcode result)
 {
-    CURLMcode code;
-    int max_fd;
-    fd_set fd_read;
-    fd_set fd_write;
-    fd_set fd_err;
+    _nemocon_stop(con);
+    _nemocon_unlink(con);
+    con->state = NEMOCON_STATE_DONE;
+    con->result = result;
+    if (result != CURLE_OK)
+        ERR("%s: %s", con->url, curl_easy_strerror(result));
+    LOG("completed: url(%s)%s", con->url, con->from_cache ? " (cached)" : "");
+
+    // Failed or timed out: the ones waiting for it try on their own
+    if (result != CURLE_OK) _nemocon_promote(con);
+
+    // Before the end callback, which may steal the body
+    struct nemolist waiters;
+    nemolist_init(&waiters);
+    nemolist_insert_list(&waiters, &con->waiters);
+    nemolist_init(&con->waiters);
+    NemoCon *waiter;
+    nemolist_for_each(waiter, &waiters, link) {
+        waiter->leader = NULL;
+        _nemocon_deliver(waiter, con->data, con->data_size);
+    }
 
-    FD_ZERO(&fd_read);
-    FD_ZERO(&fd_write);
-    FD_ZERO(&fd_err);
+    if (con->end_callback)
+        con->end_callback(con, con->data, con->data_size, con->end_userdata);
+    nemocon_destroy(con);
 
-    code = curl_multi_fdset(_curlm, &fd_read, &fd_write, &fd_err, &max_fd);
-    if (code != CURLM_OK) {
-        ERR("curl multi fdset failed: %s", curl_multi_strerror(code));
-        return;
+    while (!nemolist_empty(&waiters)) {
+        waiter = nemolist_node0(&waiters, NemoCon, link);
+        _nemocon_finish(waiter, result);
     }
+}
 
-    List *l, *tmp;
-    void *fdp;
-    LIST_FOR_EACH_SAFE(_curlm_fd_lists, l, tmp, fdp) {
-        nemotool_unwatch_fd(con->tool, (int)(intptr_t)fdp);
-        _curlm_fd_lists = list_data_remove(_curlm_fd_lists, fdp);
+static unsigned int
+_nemocon_host_running(const char *host)
+{
+    unsigned int cnt = 0;
+    NemoCon *con;
+    nemolist_for_each(con, &_nemocon_running, link) {
+        if (con->host && host && !strcmp(con->host, host)) cnt++;
     }
+    return cnt;
+}
 
-    int fd = 0;
-    for (fd = 0 ; fd < max_fd ; fd++) {
-        uint32_t events = 0;
-        if (FD_ISSET(fd, &fd_read)) events |= EPOLLIN;
-        if (FD_ISSET(fd, &fd_write)) events |= EPOLLOUT;
-        if (FD_ISSET(fd, &fd_err)) events |= EPOLLERR;
-        if (!events) continue;
-        nemotool_watch_fd(con->tool, fd, events, &(con->fd_task));
-        _curlm_fd_lists = list_data_insert(_curlm_fd_lists, (void *)(intptr_t)fd);
+// Sends the newest request of a lower priority than the given one back to
+// the front of its queue. It starts over from the beginning later.
+static bool
+_nemocon_preempt(NemoConPriority priority)
+{
+    NemoCon *con;
+    nemolist_for_each_reverse(con, &_nemocon_running, link) {
+        if (con->priority >= priority) continue;
+        // Its data callback cannot take the body again from the start
+        if (con->data_callback && con->received) continue;
+        LOG("preempted: url(%s)", con->url);
+        _nemocon_stop(con);
+        _nemocon_unlink(con);
+        nemolist_insert(&_nemocon_pending[con->priority], &con->link);
+        con->state = NEMOCON_STATE_PENDING;
+        con->data_size = 0;
+        con->received = 0;
+        con->discard = false;
+        return true;
     }
+    return false;
 }
 
-#define MIN_TIMEOUT 100
-static void
-_nemocon_set_timeout(NemoCon *con)
+static bool
+_nemocon_start(NemoCon *con, uint64_t now)
 {
-    CURLMcode code;
-    long tout;
-    code = curl_multi_timeout(_curlm, &tout);
-    if (code == CURLM_OK) {
-        if (tout <= 0 || tout >= MIN_TIMEOUT) tout = MIN_TIMEOUT;
-    } else {
-        ERR("curl multi timeout failed: %s", curl_multi_strerror(code));
-        tout = MIN_TIMEOUT;
+    if (con->expire) {
+        CURLcode code = curl_easy_setopt(con->curl, CURLOPT_TIMEOUT_MS,
+                (long)(con->expire - now));
+        if (code) ERR("%s", curl_easy_strerror(code));
+    }
+    CURLMcode mcode = curl_multi_add_handle(_curlm, con->curl);
+    if (mcode != CURLM_OK) {
+        ERR("curl multi add handle failed: %s", curl_multi_strerror(mcode));
+        return false;
+    }
+    _nemocon_unlink(con);
+    nemolist_insert_tail(&_nemocon_running, &con->link);
+    con->state = NEMOCON_STATE_RUNNING;
+    _nemocon_running_cnt++;
+    return true;
+}
+
+// Waiters time out on their own deadline, their leader goes on
+static uint64_t
+_nemocon_expire_waiters(struct nemolist *leaders, uint64_t now, uint64_t next,
+        struct nemolist *failed)
+{
+    NemoCon *leader;
+    nemolist_for_each(leader, leaders, link) {
+        NemoCon *con, *tmp;
+        nemolist_for_each_safe(con, tmp, &leader->waiters, link) {
+            if (!con->expire) continue;
+            if (con->expire <= now) {
+                con->result = CURLE_OPERATION_TIMEDOUT;
+                con->leader = NULL;
+                _nemocon_unlink(con);
+                nemolist_insert_tail(failed, &con->link);
+            } else if (!next || con->expire < next) {
+                next = con->expire;
+            }
+        }
     }
-    if (_curlm_timer) nemotimer_set_timeout(_curlm_timer, tout);
+    return next;
 }
 
 static void
-_nemocon_perform(NemoCon *con)
-{
-    CURLMcode code;
-    int still_running;
-    code = curl_multi_perform(_curlm, &still_running);
-    if (code == CURLM_CALL_MULTI_PERFORM) {
-        LOG("perform again");
-    } else if (code != CURLM_OK) {
-        ERR("curl multi perform failed: %s", curl_multi_strerror(code));
-        return;
+_nemocon_schedule()
+{
+    uint64_t now = _sigtimer_now();
+    uint64_t next = 0;
+    // End callbacks may run or cancel other requests: only after the walk
+    struct nemolist failed;
+    nemolist_init(&failed);
+    struct nemolist hits;
+    nemolist_init(&hits);
+    nemolist_insert_list(&hits, &_nemocon_hits);
+    nemolist_init(&_nemocon_hits);
+
+    int prio;
+    next = _nemocon_expire_waiters(&_nemocon_running, now, next, &failed);
+    for (prio = 0 ; prio < NEMOCON_PRIORITY_MAX ; prio++)
+        next = _nemocon_expire_waiters(&_nemocon_pending[prio], now, next, &failed);
+
+    for (prio = NEMOCON_PRIORITY_MAX - 1 ; prio >= 0 ; prio--) {
+        NemoCon *con, *tmp;
+        nemolist_for_each_safe(con, tmp, &_nemocon_pending[prio], link) {
+            if (con->expire && con->expire <= now) {
+                con->result = CURLE_OPERATION_TIMEDOUT;
+                _nemocon_unlink(con);
+                nemolist_insert_tail(&failed, &con->link);
+                continue;
+            }
+            if (_nemocon_max_per_host &&
+                    _nemocon_host_running(con->host) >= _nemocon_max_per_host) {
+                if (con->expire && (!next || con->expire < next)) next = con->expire;
+                continue;
+            }
+            if (_nemocon_max && _nemocon_running_cnt >= _nemocon_max &&
+                    !_nemocon_preempt(prio)) {
+                if (con->expire && (!next || con->expire < next)) next = con->expire;
+                continue;
+            }
+            if (!_nemocon_start(con, now)) {
+                con->result = CURLE_FAILED_INIT;
+                _nemocon_unlink(con);
+                nemolist_insert_tail(&failed, &con->link);
+            }
+        }
+    }
+    // Waiting ones time out even if nothing else completes
+    if (next) _nemocon_schedule_later(next - now);
+
+    while (!nemolist_empty(&hits)) {
+        NemoCon *con = nemolist_node0(&hits, NemoCon, link);
+        _nemocon_unlink(con);
+        if (con->data_callback)
+            con->data_callback(con, con->data, con->data_size, con->data_userdata);
+        _nemocon_finish(con, CURLE_OK);
+    }
+    while (!nemolist_empty(&failed)) {
+        NemoCon *con = nemolist_node0(&failed, NemoCon, link);
+        _nemocon_finish(con, con->result);
     }
+}
+
+static void
+_nemocon_sched_timer_callback(struct nemotimer *timer, void *userdata)
+{
+    _nemocon_schedule();
+}
 
+static void
+_nemocon_check_info()
+{
+    bool done = false;
     int n_msg;
     CURLMsg *msg;
     while ((msg = curl_multi_info_read(_curlm, &n_msg))) {
-        if (msg->msg == CURLMSG_DONE) {
-            NemoCon *con, *tmp;
-            nemolist_for_each_safe(con, tmp, &_nemocon_lists, link) {
-                if (con->curl == msg->easy_handle) {
-                    LOG("completed: url(%s)", con->url);
-                    // FIXME: callback is needed!!
-                    if (con->end_callback)
-                        con->end_callback(con, con->data, con->data_size, con->end_userdata);
-                    nemocon_destroy(con);
-                }
-            }
-        }
+        if (msg->msg != CURLMSG_DONE) continue;
+
+        NemoCon *con = NULL;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&con);
+        if (!con) continue;
+        if (msg->data.result == CURLE_OK) _nemocon_cache_store(con);
+        _nemocon_finish(con, msg->data.result);
+        done = true;
+    }
+    if (done) _nemocon_schedule();
+}
+
+static void
+_nemocon_socket_action(curl_socket_t fd, int ev_bitmask)
+{
+    int running;
+    CURLMcode code = curl_multi_socket_action(_curlm, fd, ev_bitmask, &running);
+    if (code != CURLM_OK) {
+        ERR("curl multi socket action failed: %s", curl_multi_strerror(code));
     }
+    _nemocon_check_info();
+}
+
+static void
+_nemocon_socket_dispatch(struct nemotask *task, uint32_t events)
+{
+    NemoConSocket *sock = container_of(task, NemoConSocket, task);
+    if (sock->fd == CURL_SOCKET_BAD) return;
+
+    int ev_bitmask = 0;
+    if (events & EPOLLIN) ev_bitmask |= CURL_CSELECT_IN;
+    if (events & EPOLLOUT) ev_bitmask |= CURL_CSELECT_OUT;
+    if (events & (EPOLLERR | EPOLLHUP)) ev_bitmask |= CURL_CSELECT_ERR;
+    _nemocon_socket_action(sock->fd, ev_bitmask);
+}
 
-    if (!still_running) {
-        LOG("Multi perform ended");
-        if (_curlm_timer) nemotimer_destroy(_curlm_timer);
-        _curlm_timer = NULL;
+static int
+_nemocon_socket_function(CURL *easy, curl_socket_t fd, int what, void *userp, void *socketp)
+{
+    NemoConSocket *sock = socketp;
+
+    if (what == CURL_POLL_REMOVE) {
+        if (!sock) return 0;
+        nemotool_unwatch_fd(_curlm_tool, fd);
+        curl_multi_assign(_curlm, fd, NULL);
+        sock->fd = CURL_SOCKET_BAD;
+        return 0;
+    }
 
-        List *l, *tmp;
-        void *fdp;
-        LIST_FOR_EACH_SAFE(_curlm_fd_lists, l, tmp, fdp) {
-            ERR("%d", (int)(intptr_t)fdp);
-            nemotool_unwatch_fd(con->tool, (int)(intptr_t)fdp);
-            _curlm_fd_lists = list_data_remove(_curlm_fd_lists, fdp);
+    uint32_t events = 0;
+    if (what & CURL_POLL_IN) events |= EPOLLIN;
+    if (what & CURL_POLL_OUT) events |= EPOLLOUT;
+
+    if (!sock) {
+        if (fd >= _curlm_sockets_cnt) {
+            int cnt = _curlm_sockets_cnt ? _curlm_sockets_cnt : 64;
+            while (cnt <= fd) cnt *= 2;
+            NemoConSocket **socks = realloc(_curlm_sockets, sizeof(NemoConSocket *) * cnt);
+            if (!socks) return -1;
+            memset(socks + _curlm_sockets_cnt, 0,
+                    sizeof(NemoConSocket *) * (cnt - _curlm_sockets_cnt));
+            _curlm_sockets = socks;
+            _curlm_sockets_cnt = cnt;
         }
-        return;
+        sock = _curlm_sockets[fd];
+        if (!sock) {
+            sock = calloc(sizeof(NemoConSocket), 1);
+            if (!sock) return -1;
+            sock->task.dispatch = _nemocon_socket_dispatch;
+            _curlm_sockets[fd] = sock;
+        }
+        sock->fd = fd;
+        sock->events = 0;
+        curl_multi_assign(_curlm, fd, sock);
     }
 
-    _nemocon_set_fd(con);
-    _nemocon_set_timeout(con);
+    // Only sockets whose interest changed are registered again
+    if (sock->events == events) return 0;
+    if (sock->events) nemotool_unwatch_fd(_curlm_tool, fd);
+    sock->events = events;
+    nemotool_watch_fd(_curlm_tool, fd, events, &sock->task);
+    return 0;
+}
+
+static void
+_nemocon_timer_callback(struct nemotimer *timer, void *userdata)
+{
+    _nemocon_socket_action(CURL_SOCKET_TIMEOUT, 0);
+}
+
+static int
+_nemocon_timer_function(CURLM *multi, long timeout_ms, void *userp)
+{
+    // -1 deletes the timer, 0 means as soon as possible: not from here
+    // though, curl does not want to be called back from its callback.
+    if (timeout_ms < 0) nemotimer_set_timeout(_curlm_timer, 0);
+    else nemotimer_set_timeout(_curlm_timer, timeout_ms ? timeout_ms : 1);
+    return 0;
+}
+
+// Same cached request, already queued or running
+static NemoCon *
+_nemocon_inflight(NemoCon *con)
+{
+    NemoCon *other;
+    nemolist_for_each(other, &_nemocon_running, link) {
+        // Not keeping what it has received already
+        if (other->discard) continue;
+        if (other->cache && other->hash == con->hash && !strcmp(other->url, con->url))
+            return other;
+    }
+    int prio;
+    for (prio = 0 ; prio < NEMOCON_PRIORITY_MAX ; prio++) {
+        nemolist_for_each(other, &_nemocon_pending[prio], link) {
+            if (other->cache && other->hash == con->hash && !strcmp(other->url, con->url))
+                return other;
+        }
+    }
+    return NULL;
 }
 
 void
 nemocon_run(NemoCon *con)
 {
-    _nemocon_set_fd(con);
+    RET_IF(!con);
+    RET_IF(con->state != NEMOCON_STATE_IDLE);
+    RET_IF(!con->url);
+
+    if (con->deadline) con->expire = _sigtimer_now() + con->deadline;
+    // Started or answered from the main loop, end callbacks never run from here
+    _nemocon_schedule_later(1);
+
+    if (con->cache) {
+        NemoConCache *entry = _nemocon_cache_lookup(con->url, con->hash);
+        if (entry && _nemocon_reserve(con, entry->size)) {
+            memcpy(con->data, entry->data, entry->size + 1);
+            con->data_size = entry->size;
+            con->from_cache = true;
+            nemolist_insert_tail(&_nemocon_hits, &con->link);
+            con->state = NEMOCON_STATE_PENDING;
+            return;
+        }
+
+        NemoCon *leader = _nemocon_inflight(con);
+        if (leader) {
+            con->leader = leader;
+            nemolist_insert_tail(&leader->waiters, &con->link);
+            con->state = NEMOCON_STATE_WAITING;
+            if (leader->priority < con->priority)
+                nemocon_set_priority(leader, con->priority);
+            return;
+        }
+    }
+
+    nemolist_insert_tail(&_nemocon_pending[con->priority], &con->link);
+    con->state = NEMOCON_STATE_PENDING;
+}
+
+void
+nemocon_set_priority(NemoCon *con, NemoConPriority priority)
+{
+    RET_IF(!con);
+    RET_IF(priority < 0 || priority >= NEMOCON_PRIORITY_MAX);
+    con->priority = priority;
+    if (con->state == NEMOCON_STATE_PENDING && !con->from_cache) {
+        _nemocon_unlink(con);
+        nemolist_insert_tail(&_nemocon_pending[priority], &con->link);
+        _nemocon_schedule_later(1);
+    }
+}
+
+void
+nemocon_set_cache(NemoCon *con, bool enable)
+{
+    RET_IF(!con);
+    RET_IF(con->state != NEMOCON_STATE_IDLE);
+    con->cache = enable;
+}
+
+void
+nemocon_set_deadline(NemoCon *con, uint32_t ms)
+{
+    RET_IF(!con);
+    RET_IF(con->state != NEMOCON_STATE_IDLE);
+    con->deadline = ms;
+}
+
+const char *
+nemocon_get_error(NemoCon *con)
+{
+    RET_IF(!con, NULL);
+    if (con->result == CURLE_OK) return NULL;
+    return curl_easy_strerror(con->result);
+}
+
+void
+nemocon_set_max_connections(unsigned int total, unsigned int per_host)
+{
+    _nemocon_max = total;
+    _nemocon_max_per_host = per_host;
+    _nemocon_schedule_later(1);
+}
+
+// Receive buffer grows geometrically from this, or starts at the
+// Content-Length when the server sent one (up to the max).
+#define NEMOCON_BUFFER_MIN (16 * 1024)
+#define NEMOCON_BUFFER_PRESIZE_MAX (256 * 1024 * 1024)
+
+static bool
+_nemocon_reserve(NemoCon *con, size_t size)
+{
+    if (size + 1 <= con->data_alloc) return true;
 
-    if (!_curlm_timer) _curlm_timer = nemotimer_create(con->tool);
-    nemotimer_set_callback(_curlm_timer, _nemocon_timer_callback);
-    nemotimer_set_userdata(_curlm_timer, con);
-    _nemocon_set_timeout(con);
+    size_t alloc = con->data_alloc ? con->data_alloc : NEMOCON_BUFFER_MIN;
+    while (alloc < size + 1) alloc *= 2;
+    char *data = realloc(con->data, alloc);
+    if (!data) {
+        ERR("memory allocation failed: %zu", alloc);
+        return false;
+    }
+    con->data = data;
+    con->data_alloc = alloc;
+    return true;
+}
+
+static void
+_nemocon_presize(NemoCon *con)
+{
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_off_t len = -1;
+    curl_easy_getinfo(con->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &len);
+#else
+    double len = -1;
+    curl_easy_getinfo(con->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &len);
+#endif
+    if (len > 0 && len <= NEMOCON_BUFFER_PRESIZE_MAX) {
+        size_t alloc = (size_t)len + 1;
+        char *data = realloc(con->data, alloc);
+        if (!data) return;
+        con->data = data;
+        con->data_alloc = alloc;
+    }
 }
 
 static size_t
@@ -480,19 +2175,39 @@ _nemocon_write_function(char *ptr, size_t size, size_t nememb, void *userdata)
 {
     NemoCon *con = userdata;
     if (!ptr || (size == 0) || (nememb == 0)) return 0;
+    size_t len = size * nememb;
+    if (!con->received) {
+        con->discard = !con->keep_data && con->data_callback &&
+            nemolist_empty(&con->waiters) && _nemocon_cache_ttl(con, time(NULL)) <= 0;
+    }
+    con->received += len;
     if (con->data_callback)
-        con->data_callback(con, ptr, size*nememb, con->data_userdata);
+        con->data_callback(con, ptr, len, con->data_userdata);
+    if (con->discard) return len;
+
+    if (!con->data) _nemocon_presize(con);
+    if (!_nemocon_reserve(con, con->data_size + len)) return 0;
+    memcpy(con->data + con->data_size, ptr, len);
+    con->data_size += len;
+    con->data[con->data_size] = '\0';
+    return len;
+}
 
-    con->data = realloc(con->data, con->data_size + size*nememb);
-    memcpy(con->data + con->data_size, ptr, size*nememb);
-    con->data_size += (size * nememb);
-    return size * nememb;
+char *
+nemocon_steal_data(NemoCon *con, size_t *size)
+{
+    RET_IF(!con, NULL);
+    char *data = con->data;
+    if (size) *size = con->data_size;
+    con->data = NULL;
+    con->data_size = 0;
+    con->data_alloc = 0;
+    return data;
 }
 
 NemoCon *
 nemocon_create(struct nemotool *tool)
 {
-    CURLMcode mcode;
     CURLcode code;
 
     if (!_curlm) {
@@ -508,7 +2223,20 @@ nemocon_create(struct nemotool *tool)
             curl_global_cleanup();
             return NULL;
         }
-        nemolist_init(&_nemocon_lists);
+        curl_multi_setopt(_curlm, CURLMOPT_SOCKETFUNCTION, _nemocon_socket_function);
+        curl_multi_setopt(_curlm, CURLMOPT_TIMERFUNCTION, _nemocon_timer_function);
+
+        _curlm_tool = tool;
+        _curlm_timer = nemotimer_create(tool);
+        nemotimer_set_callback(_curlm_timer, _nemocon_timer_callback);
+
+        _nemocon_sched_timer = nemotimer_create(tool);
+        nemotimer_set_callback(_nemocon_sched_timer, _nemocon_sched_timer_callback);
+        int i;
+        for (i = 0 ; i < NEMOCON_PRIORITY_MAX ; i++) {
+            nemolist_init(&_nemocon_pending[i]);
+        }
+        nemolist_init(&_nemocon_running);
     }
 
     CURL *curl = curl_easy_init();
@@ -531,36 +2259,67 @@ nemocon_create(struct nemotool *tool)
     if (code) ERR("%s", curl_easy_strerror(code));
     code = curl_easy_setopt(curl, CURLOPT_WRITEDATA, con);
     if (code) ERR("%s", curl_easy_strerror(code));
+    code = curl_easy_setopt(curl, CURLOPT_PRIVATE, con);
+    if (code) ERR("%s", curl_easy_strerror(code));
+    code = curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, _nemocon_header_function);
+    if (code) ERR("%s", curl_easy_strerror(code));
+    code = curl_easy_setopt(curl, CURLOPT_HEADERDATA, con);
+    if (code) ERR("%s", curl_easy_strerror(code));
 
     code = curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30);
     if (code) ERR("%s", curl_easy_strerror(code));
     code = curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
     if (code) ERR("%s", curl_easy_strerror(code));
 
-    mcode = curl_multi_add_handle(_curlm, curl);
-    if (mcode != CURLM_OK) {
-        ERR("curl multi add handle failed: %s", curl_multi_strerror(mcode));
-        curl_easy_cleanup(curl);
-        free(con);
-        return NULL;
-    }
-
     con->curl = curl;
     con->tool = tool;
-    con->fd_task.dispatch = _nemocon_fd_callback;
-    nemolist_insert(&_nemocon_lists, &(con->link));
+    con->priority = NEMOCON_PRIORITY_BACKGROUND;
+    con->cache = true;
+    con->keep_data = true;
+    con->max_age = -1;
+    nemolist_init(&con->link);
+    nemolist_init(&con->waiters);
     return con;
 }
 
+// "scheme://user@host:port/path" -> "host"
+static char *
+_nemocon_url_host(const char *url)
+{
+    const char *begin = strstr(url, "://");
+    begin = begin ? begin + 3 : url;
+    size_t len = strcspn(begin, "/?#");
+    const char *at = memchr(begin, '@', len);
+    if (at) {
+        len -= at + 1 - begin;
+        begin = at + 1;
+    }
+    if (*begin == '[') {
+        const char *end = memchr(begin, ']', len);
+        if (end) len = end + 1 - begin;
+    } else {
+        const char *colon = memchr(begin, ':', len);
+        if (colon) len = colon - begin;
+    }
+    return strndup(begin, len);
+}
+
 void
 nemocon_set_url(NemoCon *con, const char *url)
 {
+    RET_IF(!con);
+    RET_IF(!url);
+    RET_IF(con->state != NEMOCON_STATE_IDLE);
+
     CURLcode code;
     code = curl_easy_setopt(con->curl, CURLOPT_URL, url);
     if (code) ERR("%s", curl_easy_strerror(code));
 
     if (con->url) free(con->url);
     con->url = strdup(url);
+    con->hash = _nemocon_hash(url);
+    if (con->host) free(con->host);
+    con->host = _nemocon_url_host(url);
 }
 
 void
@@ -576,6 +2335,13 @@ nemocon_set_data_callback(NemoCon *con, NemoCon_Data_Callback callback, void *us
     con->data_callback = callback;
     con->data_userdata = userdata;
 }
+
+void
+nemocon_set_keep_data(NemoCon *con, bool keep)
+{
+    RET_IF(!con);
+    con->keep_data = keep;
+}
 #if 0
 /****************************************************/
 /* Image */
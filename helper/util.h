@@ -5,6 +5,7 @@
 #include <cairo.h>
 #include <stdbool.h>   // bool
 #include <stdlib.h>     // calloc
+#include <stddef.h>     // offsetof
 #include "log.h"
 
 // String
@@ -17,15 +18,91 @@ bool _file_mkdir(const char *dir, int mode);
 bool _file_mkdir_recursive(const char *file, int mode);
 char **_file_load(const char *filename, int *line_len);
 
-// Timer (implemented by signal)
+// Timer (implemented by timerfd)
+// Watch sigtimer_get_fd() for readability in the event loop (e.g.
+// fd_handler_attach or nemotool_watch_source) and call sigtimer_dispatch():
+// callbacks run there. Create and destroy are thread safe: destroying a
+// timer from another thread while its callback runs waits for the callback
+// to return.
 typedef bool (*SigTimerCb)(void *data);
 
 typedef struct __SigTimer SigTimer;
 bool sigtimer_init();
 void sigtimer_shutdown();
+int sigtimer_get_fd();
+void sigtimer_dispatch();
+// Timers may fire up to mseconds late (never early) so close deadlines
+// share a wake up
+void sigtimer_set_slack(unsigned int mseconds);
 SigTimer *sigtimer_create(unsigned int mseconds, SigTimerCb callback, void *data);
 void sigtimer_destroy(SigTimer *timer);
 
+// Json
+struct json_object;
+struct nemoattr;
+bool _json_find(struct json_object *obj, const char *names, struct nemoattr *attr);
+
+// Compiled set of paths (same syntax as _json_find()), which fills the
+// fields of a struct in one walk of the document:
+//
+//  static const JsonField fields[] = {
+//      JSON_FIELD("main/temp", JSON_FIELD_DOUBLE, Weather, temp),
+//      JSON_FIELD("name", JSON_FIELD_STRING, Weather, city),
+//  };
+//  JsonQuery *q = json_query_compile(fields, 2);
+//  json_query_run(q, obj, &weather);
+typedef enum {
+    JSON_FIELD_INT = 0,     // int
+    JSON_FIELD_DOUBLE,      // double
+    JSON_FIELD_BOOL,        // bool
+    JSON_FIELD_STRING,      // char *, strdup'ed: the caller frees it
+} JsonFieldType;
+
+typedef struct _JsonField JsonField;
+struct _JsonField {
+    const char *path;
+    JsonFieldType type;
+    size_t offset;
+};
+#define JSON_FIELD(path, type, st, member) { path, type, offsetof(st, member) }
+#define JSON_QUERY_FIELD_MAX 64
+
+typedef struct _JsonQuery JsonQuery;
+JsonQuery *json_query_compile(const JsonField *fields, unsigned int cnt);
+void json_query_destroy(JsonQuery *q);
+// Only sets the fields found, returns how many
+unsigned int json_query_run(JsonQuery *q, struct json_object *obj, void *st);
+
+// Incremental parsing: the object is ready as soon as the last chunk is
+// fed, e.g. from a NemoCon data callback, without buffering the text.
+typedef struct _JsonStream JsonStream;
+JsonStream *json_stream_create();
+void json_stream_destroy(JsonStream *js);
+void json_stream_reset(JsonStream *js);
+// false once the data is not valid json
+bool json_stream_feed(JsonStream *js, const char *data, size_t size);
+// The parsed object (the caller puts it), NULL if it is not complete
+struct json_object *json_stream_finish(JsonStream *js);
+
+// Read-only document built in one arena instead of a json-c object per
+// node: keys are interned, and json_doc_destroy() frees the whole document
+// at once. For large responses which are only read, e.g. bulk requests.
+// Nodes and strings live as long as the document.
+typedef struct _JsonDoc JsonDoc;
+typedef struct _JsonNode JsonNode;
+JsonDoc *json_doc_parse(const char *text, size_t len);
+void json_doc_destroy(JsonDoc *doc);
+const JsonNode *json_doc_get_root(JsonDoc *doc);
+// NULL if node is not an object or has no key
+const JsonNode *json_node_get(const JsonNode *node, const char *key);
+// 0 if node is not an array
+unsigned int json_node_array_length(const JsonNode *node);
+const JsonNode *json_node_array_get(const JsonNode *node, unsigned int idx);
+// Same paths as _json_find()
+bool json_node_find(const JsonNode *node, const char *names, struct nemoattr *attr);
+// json_query_run() on a document node
+unsigned int json_query_run_node(JsonQuery *q, const JsonNode *node, void *st);
+
 // Image
 typedef struct _Image Image;
 cairo_surface_t *image_get_surface(Image *img);
@@ -171,13 +248,62 @@ list_idx_get_data(List *l, unsigned int idx)
  * *****************************************/
 typedef struct _NemoCon NemoCon;
 typedef void (*NemoCon_Data_Callback)(NemoCon *con, char *data, size_t size, void *userdata);
+// data is NUL terminated (NULL if nothing was received) and freed after the
+// callback, unless it takes the ownership with nemocon_steal_data().
 typedef void (*NemoCon_End_Callback)(NemoCon *con, char *data, size_t size, void *userdata);
 
+// Higher ones start first and take the slot of a running lower one when
+// every slot is busy; the preempted request starts over later.
+typedef enum {
+    NEMOCON_PRIORITY_BACKGROUND = 0,
+    NEMOCON_PRIORITY_INTERACTIVE,
+    NEMOCON_PRIORITY_MAX
+} NemoConPriority;
+
+// Default concurrency caps, see nemocon_set_max_connections()
+#define NEMOCON_MAX_CONNECTIONS 8
+#define NEMOCON_MAX_PER_HOST 4
+
 void nemocon_destroy(NemoCon *con);
+// Queues the request, it starts from the main loop once a slot is free
 void nemocon_run(NemoCon *con);
+// Stops the request without calling the end callback and destroys it
+void nemocon_cancel(NemoCon *con);
 NemoCon *nemocon_create(struct nemotool *tool);
+void nemocon_set_priority(NemoCon *con, NemoConPriority priority);
+// Time allowed from nemocon_run() to the end, queueing included. The end
+// callback then runs with a timeout error. 0 (default) means no deadline.
+void nemocon_set_deadline(NemoCon *con, uint32_t ms);
+// In the end callback: NULL on success
+const char *nemocon_get_error(NemoCon *con);
+// 0 means unlimited
+void nemocon_set_max_connections(unsigned int total, unsigned int per_host);
+
+// Response cache, keyed by URL. Successful responses are kept as long as
+// Cache-Control max-age or Expires allows, but at least min_ttl seconds
+// unless the server said no-store. The least recently used ones go first
+// above max size.
+#define NEMOCON_CACHE_MAX_SIZE (16 * 1024 * 1024)
+void nemocon_cache_set_min_ttl(uint32_t seconds);
+void nemocon_cache_set_max_size(size_t bytes);
+// Also keeps responses in dir, across runs. NULL: memory only (default)
+bool nemocon_cache_set_dir(const char *dir);
+// Memory only, files in the cache dir are left alone
+void nemocon_cache_clear();
 void nemocon_set_url(NemoCon *con, const char *url);
+// Per request, on by default. A cached request is answered from the cache
+// while the response is fresh, and waits for an identical request already
+// in flight instead of making its own. Its own deadline still applies
+// while waiting. If that request fails or times out, the first one waiting
+// makes the request again, the others wait for it.
+void nemocon_set_cache(NemoCon *con, bool enable);
 void nemocon_set_end_callback(NemoCon *con, NemoCon_End_Callback callback, void *userdata);
 void nemocon_set_data_callback(NemoCon *con, NemoCon_Data_Callback callback, void *userdata);
+// Takes the received body without a copy; the caller frees it.
+char *nemocon_steal_data(NemoCon *con, size_t *size);
+// true (default): the body is kept for the end callback. false: with a data
+// callback, the body is only kept while the cache or identical requests
+// need it; otherwise the end callback gets NULL.
+void nemocon_set_keep_data(NemoCon *con, bool keep);
 
 #endif
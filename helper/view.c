@@ -1,80 +1,451 @@
 #include <cairo.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "log.h"
 #include "nemolist.h"
 #include "wl_window.h"
 #include "view.h"
+#include "threadpool.h"
+#include "trace.h"
+
+// Fake clock, see view_clock_set_fake()
+bool view_clock_fake;
+uint64_t view_clock_fake_now;
 
 struct __View
 {
+    struct nemolist link;   // view_list
     cairo_surface_t *surf;
     cairo_t *cr;
     int w, h, stride;
-    Wl_Window *win;
+    Wl_Window *win;         // NULL: headless
+    int epfd;
+    int buf;                // shm buffer that surf draws into
+
+    pixman_region32_t damage;   // damaged since the last view_update()
+    // Per shm buffer: area which is older than the latest frame
+    // (buffer age), carried over when the buffer is drawn into again.
+    pixman_region32_t stale[WL_WINDOW_BUFFER_NUM];
+
+    uint64_t frames;        // presented frames
+    uint64_t copied;        // bytes copied between shm buffers
+
+    // Frame scheduler
+    ViewDrawCallback draw_callback;
+    void *draw_data;
+    bool frame_pending;     // waiting for the compositor frame callback
+    bool frame_requested;   // a frame was requested meanwhile
+    uint64_t requested;     // view_request_frame() calls
+
+    // Headless: a ring of buffers like the window's. The last presented
+    // one stays busy until the next present, like wl_buffer.release.
+    unsigned char *data[WL_WINDOW_BUFFER_NUM];
+    int presented;          // -1: none
+    Timer *frame_timer;     // emulates the compositor frame callback
+    char *dump_dir;
 };
 
-View *
-view_create(int w, int h, unsigned int br, unsigned int bg, unsigned int bb, unsigned int ba)
-{
-    cairo_surface_t *surf;
-    cairo_t *cr;
+// Live views: the timer wheel moves to another one when its view goes
+static struct nemolist view_list = { &view_list, &view_list };
 
-    surf = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, w, h);
-    cairo_status_t status = cairo_surface_status(surf);
-    if (!surf || status != CAIRO_STATUS_SUCCESS) {
-        ERR("error:%s", cairo_status_to_string(status));
-        if (surf) cairo_surface_destroy(surf);
-        return NULL;
-    }
+static void _timer_wheel_detach(View *view);
+
+static void
+_region_clear(pixman_region32_t *region)
+{
+    pixman_region32_fini(region);
+    pixman_region32_init(region);
+}
 
-    cr = cairo_create(surf);
+static void
+_view_paint_background(View *view, unsigned int br, unsigned int bg, unsigned int bb, unsigned int ba)
+{
+    cairo_t *cr = view->cr;
     cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
     cairo_set_source_rgba(cr, br / 255., bg / 255., bb / 255., ba / 255.);
     cairo_paint(cr);
     cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
     cairo_set_source_rgba(cr, 0, 0, 0, 1);
+}
+
+static unsigned char *
+_view_buffer_get(View *view, int idx)
+{
+    if (view->win) return wl_window_get_buffer(view->win, idx);
+    return view->data[idx];
+}
+
+static bool
+_view_buffer_is_busy(View *view, int idx)
+{
+    if (view->win) return wl_window_is_buffer_busy(view->win, idx);
+    return idx == view->presented;
+}
 
+static int
+_view_buffer_get_free(View *view)
+{
+    if (view->win) return wl_window_get_free_buffer(view->win);
+    int i;
+    for (i = 0 ; i < WL_WINDOW_BUFFER_NUM ; i++) {
+        if (i != view->presented) return i;
+    }
+    return -1;
+}
+
+static bool
+_view_target_create(View *view, int idx)
+{
+    unsigned char *data = _view_buffer_get(view, idx);
+    cairo_surface_t *surf;
+    surf = cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32,
+            view->w, view->h, view->stride);
+    cairo_status_t status = cairo_surface_status(surf);
+    if (status != CAIRO_STATUS_SUCCESS) {
+        ERR("error:%s", cairo_status_to_string(status));
+        cairo_surface_destroy(surf);
+        return false;
+    }
+
+    if (view->cr) cairo_destroy(view->cr);
+    if (view->surf) cairo_surface_destroy(view->surf);
+    view->surf = surf;
+    view->cr = cairo_create(surf);
+    view->buf = idx;
+    return true;
+}
+
+// Draws keep going into the current shm buffer unless the compositor still
+// holds it, which it does with the last attached buffer: then the frame is
+// carried over into a free buffer, but only the area the free buffer
+// missed since it was last drawn into (its stale region), about the damage
+// of the last frame or two. Returns false if every buffer is held.
+static bool
+_view_target_acquire(View *view)
+{
+    if (!_view_buffer_is_busy(view, view->buf)) return true;
+
+    TRACE_FUNC();
+    int idx = _view_buffer_get_free(view);
+    if (idx < 0) return false;
+    if (idx == view->buf) return true;
+
+    unsigned char *src = _view_buffer_get(view, view->buf);
+    unsigned char *dst = _view_buffer_get(view, idx);
+
+    int i, n;
+    pixman_box32_t *rects = pixman_region32_rectangles(&view->stale[idx], &n);
+    for (i = 0 ; i < n ; i++) {
+        int y;
+        size_t offset = rects[i].x1 * 4;
+        size_t len = (rects[i].x2 - rects[i].x1) * 4;
+        for (y = rects[i].y1 ; y < rects[i].y2 ; y++) {
+            memcpy(dst + y * view->stride + offset,
+                    src + y * view->stride + offset, len);
+        }
+        view->copied += len * (rects[i].y2 - rects[i].y1);
+    }
+    _region_clear(&view->stale[idx]);
+
+    return _view_target_create(view, idx);
+}
+
+static void _view_frame_done(void *data, uint32_t time);
+static void _view_buffer_released(void *data);
+
+View *
+view_create(int w, int h, unsigned int br, unsigned int bg, unsigned int bb, unsigned int ba)
+{
     int stride;
     stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, w);
 
     Wl_Window *win = wl_window_create(w, h, stride);
     if (!win){
         ERR("wl_window_create failed");
-        cairo_destroy(cr);
-        cairo_surface_destroy(surf);
         return NULL;
     }
-    unsigned char *data = cairo_image_surface_get_data(surf);
-    wl_window_set_buffer(win, data, h * stride, w, h);
 
     View *view = calloc(sizeof(View), 1);
-    view->surf = surf;
-    view->cr = cr;
     view->w = w;
     view->h = h;
     view->stride = stride;
     view->win = win;
+    view->epfd = wl_window_get_epoll_fd(win);
+    if (!_view_target_create(view, 0)) {
+        wl_window_destroy(win);
+        free(view);
+        return NULL;
+    }
+
+    wl_window_set_frame_callback(win, _view_frame_done, view);
+    wl_window_set_release_callback(win, _view_buffer_released, view);
+    nemolist_insert(&view_list, &view->link);
+
+    int i;
+    pixman_region32_init_rect(&view->damage, 0, 0, w, h);
+    pixman_region32_init(&view->stale[0]);
+    for (i = 1 ; i < WL_WINDOW_BUFFER_NUM ; i++)
+        pixman_region32_init_rect(&view->stale[i], 0, 0, w, h);
+
+    _view_paint_background(view, br, bg, bb, ba);
+    return view;
+}
+
+View *
+view_create_headless(int w, int h, unsigned int br, unsigned int bg, unsigned int bb, unsigned int ba)
+{
+    int stride;
+    stride = cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, w);
+
+    View *view = calloc(sizeof(View), 1);
+    view->w = w;
+    view->h = h;
+    view->stride = stride;
+    view->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (view->epfd < 0) {
+        perror("epoll_create1 failed: ");
+        free(view);
+        return NULL;
+    }
+    int i;
+    for (i = 0 ; i < WL_WINDOW_BUFFER_NUM ; i++)
+        view->data[i] = calloc(stride, h);
+    view->presented = -1;
+    if (!_view_target_create(view, 0)) {
+        for (i = 0 ; i < WL_WINDOW_BUFFER_NUM ; i++)
+            free(view->data[i]);
+        close(view->epfd);
+        free(view);
+        return NULL;
+    }
+
+    pixman_region32_init_rect(&view->damage, 0, 0, w, h);
+    pixman_region32_init(&view->stale[0]);
+    for (i = 1 ; i < WL_WINDOW_BUFFER_NUM ; i++)
+        pixman_region32_init_rect(&view->stale[i], 0, 0, w, h);
+    nemolist_insert(&view_list, &view->link);
+
+    _view_paint_background(view, br, bg, bb, ba);
     return view;
 }
 
+void
+view_set_dump_dir(View *view, const char *dir)
+{
+    RET_IF(!view);
+    free(view->dump_dir);
+    view->dump_dir = dir ? strdup(dir) : NULL;
+}
+
+static cairo_status_t
+_view_stdio_write(void *closure, const unsigned char *data, unsigned int size)
+{
+    FILE *fp = closure;
+    if (fwrite(data, 1, size, fp) != size) {
+        ERR("Failed to write output: %s", strerror(errno));
+        return CAIRO_STATUS_WRITE_ERROR;
+    }
+    return CAIRO_STATUS_SUCCESS;
+}
+
+static void
+_view_dump(View *view)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/frame-%05"PRIu64".png",
+            view->dump_dir, view->frames);
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        ERR("%s: %s", path, strerror(errno));
+        return;
+    }
+    cairo_status_t status;
+    status = cairo_surface_write_to_png_stream(view->surf, _view_stdio_write, fp);
+    if (status != CAIRO_STATUS_SUCCESS)
+        ERR("%s: %s", path, cairo_status_to_string(status));
+    fclose(fp);
+}
+
+static bool
+_view_headless_frame(void *data)
+{
+    View *view = data;
+    _view_frame_done(view, view_clock_now());
+    return true;
+}
+
+// Presents into memory; the next frame callback comes after
+// VIEW_HEADLESS_FRAME_MS.
+static void
+_view_headless_present(View *view)
+{
+    cairo_surface_flush(view->surf);
+    if (view->dump_dir) _view_dump(view);
+    // The previous buffer is released, this one is held
+    view->presented = view->buf;
+
+    if (view->frame_timer) timer_set(view->frame_timer, VIEW_HEADLESS_FRAME_MS);
+    else view->frame_timer = timer_attach_oneshot(view, VIEW_HEADLESS_FRAME_MS, _view_headless_frame, view);
+}
+
+static void
+_view_headless_loop(View *view)
+{
+    struct epoll_event ep[WL_WINDOW_EPOLL_EVENTS];
+    while (1) {
+        TRACE_POLL();
+        int i, ep_cnt;
+        {
+            TRACE_SCOPE("epoll_wait");
+            ep_cnt = epoll_wait(view->epfd, ep, sizeof(ep)/sizeof(ep[0]), -1);
+        }
+        if (ep_cnt < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll wait failed: ");
+            break;
+        }
+        fd_handler_dispatch_begin();
+        for (i = 0 ; i < ep_cnt ; i++) {
+            fd_handler_call(ep[i].data.ptr, ep[i].events);
+        }
+        fd_handler_dispatch_end();
+    }
+}
+
 void
 view_destroy(View *view)
 {
     RET_IF(!view);
-    wl_window_destroy(view->win);
+    int i;
+    // Before its epoll fd is closed
+    nemolist_remove(&view->link);
+    _timer_wheel_detach(view);
+    // cairo objects point into the shm mapping of the window
     cairo_destroy(view->cr);
     cairo_surface_destroy(view->surf);
+    if (view->win) {
+        wl_window_destroy(view->win);
+    } else {
+        if (view->frame_timer) timer_destroy(view->frame_timer);
+        close(view->epfd);
+        for (i = 0 ; i < WL_WINDOW_BUFFER_NUM ; i++)
+            free(view->data[i]);
+        free(view->dump_dir);
+    }
+
+    pixman_region32_fini(&view->damage);
+    for (i = 0 ; i < WL_WINDOW_BUFFER_NUM ; i++)
+        pixman_region32_fini(&view->stale[i]);
     free(view);
 }
 
+void
+view_damage(View *view, int x, int y, int w, int h)
+{
+    RET_IF(!view);
+    pixman_region32_union_rect(&view->damage, &view->damage, x, y, w, h);
+}
+
 void
 view_update(View *view)
 {
-    unsigned char *data = cairo_image_surface_get_data(view->surf);
-    wl_window_set_buffer(view->win, data, view->h * view->stride, view->w, view->h);
+    RET_IF(!view);
+    TRACE_FUNC();
+
+    // Nothing reported: the caller may have drawn anywhere
+    if (!pixman_region32_not_empty(&view->damage))
+        pixman_region32_union_rect(&view->damage, &view->damage,
+                0, 0, view->w, view->h);
+    pixman_region32_intersect_rect(&view->damage, &view->damage,
+            0, 0, view->w, view->h);
+
+    if (view->win) {
+        cairo_surface_flush(view->surf);
+        wl_window_present(view->win, view->buf, &view->damage);
+    } else {
+        _view_headless_present(view);
+    }
+    view->frame_pending = true;
+
+    int i;
+    for (i = 0 ; i < WL_WINDOW_BUFFER_NUM ; i++) {
+        if (i == view->buf) continue;
+        pixman_region32_union(&view->stale[i], &view->stale[i], &view->damage);
+    }
+    _region_clear(&view->damage);
+    view->frames++;
+}
+
+static void
+_view_frame_render(View *view)
+{
+    if (view->draw_callback) {
+        // Every buffer is held by the compositor: drawn on the next release
+        // instead of waiting for it from inside an event handler.
+        if (!_view_target_acquire(view)) {
+            view->frame_requested = true;
+            return;
+        }
+        view->frame_requested = false;
+        TRACE_SCOPE("view draw");
+        view->draw_callback(view, view->draw_data);
+    } else {
+        view->frame_requested = false;
+    }
+    view_update(view);
+}
+
+static void
+_view_frame_done(void *data, uint32_t time)
+{
+    View *view = data;
+    view->frame_pending = false;
+    if (view->frame_requested) _view_frame_render(view);
+}
+
+static void
+_view_buffer_released(void *data)
+{
+    View *view = data;
+    if (view->frame_requested && !view->frame_pending) _view_frame_render(view);
+}
+
+void
+view_set_draw_callback(View *view, ViewDrawCallback callback, void *data)
+{
+    RET_IF(!view);
+    view->draw_callback = callback;
+    view->draw_data = data;
+}
+
+void
+view_request_frame(View *view)
+{
+    RET_IF(!view);
+    view->requested++;
+    // Renders right away when idle, otherwise once the compositor asks
+    // for the next frame: requests in between are coalesced.
+    if (view->frame_pending) {
+        view->frame_requested = true;
+        return;
+    }
+    _view_frame_render(view);
+}
+
+void
+view_get_frame_stats(View *view, uint64_t *requested, uint64_t *presented)
+{
+    RET_IF(!view);
+    if (requested) *requested = view->requested;
+    if (presented) *presented = view->frames;
 }
 
 void
@@ -83,13 +454,16 @@ view_do(View *view)
     RET_IF(!view);
 
     view_update(view);
-    wl_window_loop(view->win);
+    if (view->win) wl_window_loop(view->win);
+    // With the fake clock, the caller drives it by view_clock_advance()
+    else if (!view_clock_fake) _view_headless_loop(view);
 }
 
 cairo_t *
 view_get_cairo(View *view)
 {
     RET_IF(!view, NULL);
+    _view_target_acquire(view);
     return view->cr;
 }
 
@@ -97,14 +471,29 @@ cairo_surface_t *
 view_get_surface(View *view)
 {
     RET_IF(!view, NULL);
+    _view_target_acquire(view);
     return view->surf;
 }
 
+void
+view_get_stats(View *view, uint64_t *frames, uint64_t *copied)
+{
+    RET_IF(!view);
+    if (frames) *frames = view->frames;
+    if (copied) *copied = view->copied;
+}
+
 bool
 view_init()
 {
+    TRACE_INIT(NULL);
     if (!fd_handler_init()) return false;
+    if (!timer_init()) {
+        fd_handler_shutdown();
+        return false;
+    }
     if (!wl_window_init()) {
+        timer_shutdown();
         fd_handler_shutdown();
         return false;
     }
@@ -115,6 +504,7 @@ void
 view_shutdown()
 {
     wl_window_shutdown();
+    timer_shutdown();
     fd_handler_shutdown();
 }
 
@@ -128,14 +518,40 @@ struct _FdHandler
     int fd;
     FdCallback callback;
     void *data;
+    bool dead;              // destroyed during the current batch
 };
 
 struct nemolist fd_handler_list;
+// Destroyed during a batch, freed by _fd_handler_free_dead()
+struct nemolist fd_handler_dead_list;
+bool fd_handler_dispatching;
+uint64_t fd_handler_batch_start;
+uint64_t fd_handler_histogram[FD_HANDLER_HISTOGRAM_SIZE];
+
+static uint64_t
+_fd_handler_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec/1000;
+}
+
+static void
+_fd_handler_free_dead()
+{
+    FdHandler *fdh, *tmp;
+    nemolist_for_each_safe(fdh, tmp, &fd_handler_dead_list, link) {
+        nemolist_remove(&fdh->link);
+        free(fdh);
+    }
+}
 
 bool
 fd_handler_init()
 {
     nemolist_init(&fd_handler_list);
+    nemolist_init(&fd_handler_dead_list);
+    fd_handler_reset_histogram();
     return true;
 }
 
@@ -147,32 +563,75 @@ fd_handler_shutdown()
         fd_handler_destroy(fdh);
     }
     nemolist_empty(&fd_handler_list);
+    // Not a real batch, so no histogram sample
+    fd_handler_dispatching = false;
+    _fd_handler_free_dead();
 }
 
 void
 fd_handler_destroy(FdHandler *fdh)
 {
     RET_IF(!fdh);
+    RET_IF(fdh->dead);
 
     if (epoll_ctl(fdh->epfd, EPOLL_CTL_DEL, fdh->fd, NULL) < 0)
         perror("epoll_ctl failed: ");
     nemolist_remove(&fdh->link);
+    if (fd_handler_dispatching) {
+        // Later events of this batch may still point to it
+        fdh->dead = true;
+        nemolist_insert(&fd_handler_dead_list, &fdh->link);
+        return;
+    }
     free(fdh);
 }
 
+void
+fd_handler_dispatch_begin()
+{
+    fd_handler_dispatching = true;
+    fd_handler_batch_start = _fd_handler_now_us();
+}
+
 bool
-fd_handler_call(int epfd, int fd, uint32_t events)
+fd_handler_call(FdHandler *fdh, uint32_t events)
 {
-    FdHandler *fdh, *tmp;
-    nemolist_for_each_safe(fdh, tmp, &fd_handler_list, link) {
-        if ((epfd == fdh->epfd) && (fdh->fd == fd)) {
-            if (!fdh->callback(events, fdh->data)) {
-                fd_handler_destroy(fdh);
-            }
-            return true;
-        }
+    RET_IF(!fdh, false);
+    if (fdh->dead) return false;
+    TRACE_SCOPE("fd callback");
+    if (!fdh->callback(events, fdh->data)) {
+        if (!fdh->dead) fd_handler_destroy(fdh);
+    }
+    return true;
+}
+
+void
+fd_handler_dispatch_end()
+{
+    RET_IF(!fd_handler_dispatching);
+    fd_handler_dispatching = false;
+    _fd_handler_free_dead();
+
+    uint64_t us = _fd_handler_now_us() - fd_handler_batch_start;
+    int i = 0;
+    while (us > 1 && i < FD_HANDLER_HISTOGRAM_SIZE - 1) {
+        us >>= 1;
+        i++;
     }
-    return false;
+    fd_handler_histogram[i]++;
+}
+
+void
+fd_handler_get_histogram(uint64_t histogram[FD_HANDLER_HISTOGRAM_SIZE])
+{
+    RET_IF(!histogram);
+    memcpy(histogram, fd_handler_histogram, sizeof(fd_handler_histogram));
+}
+
+void
+fd_handler_reset_histogram()
+{
+    memset(fd_handler_histogram, 0, sizeof(fd_handler_histogram));
 }
 
 FdHandler *
@@ -184,41 +643,270 @@ fd_handler_attach(View *view, unsigned int fd, uint32_t events, FdCallback callb
     int epfd;
     struct epoll_event ep;
 
-    epfd = wl_window_get_epoll_fd(view->win);
+    epfd = view->epfd;
+
+    FdHandler *fdh = calloc(sizeof(FdHandler), 1);
+    fdh->callback = callback;
+    fdh->data = data;
+    fdh->fd = fd;
+    fdh->epfd = epfd;
 
     ep.events = events;
-    ep.data.fd = fd;
+    ep.data.ptr = fdh;
     if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ep) < 0) {
         perror("epoll_ctl failed: ");
+        free(fdh);
         return NULL;
     }
 
-    FdHandler *fdh = calloc(sizeof(FdHandler), 1);
-    fdh->callback = callback;
-    fdh->data = data;
-    fdh->fd = fd;
-    fdh->epfd = epfd;
     nemolist_insert(&fd_handler_list, &fdh->link);
     return fdh;
 }
 
+static bool
+_fd_handler_threadpool(uint32_t events, void *data)
+{
+    threadpool_dispatch(data);
+    return true;
+}
+
+FdHandler *
+fd_handler_attach_threadpool(View *view, ThreadPool *pool)
+{
+    RET_IF(!pool, NULL);
+    return fd_handler_attach(view, threadpool_get_fd(pool), EPOLLIN,
+            _fd_handler_threadpool, pool);
+}
+
 /*************************************/
 /** Timer Handler **/
 /*************************************/
+// Hierarchical timer wheel on top of one timerfd. Time is counted in 1ms
+// ticks of CLOCK_MONOTONIC. Level l slot s holds the timers which expire
+// in window s of 64^l ticks: they are cascaded into lower levels when the
+// wheel reaches that window, and run from level 0.
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_RANGE (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
 struct _Timer
 {
-    struct nemolist link;
-    FdHandler *fdh;
+    struct nemolist link;   // wheel slot
+    struct nemolist all;    // timer_list
+    uint64_t expire;        // tick
+    unsigned int interval;  // 0: one-shot
+    int level, slot;        // level -1: not armed
+    bool destroyed;         // destroyed while its callback runs
     Callback callback;
     void *data;
 };
 
-struct nemolist timer_list;
+static struct nemolist timer_list;
+
+struct {
+    int fd;
+    FdHandler *fdh;
+    View *view;             // whose epoll fd watches fd
+    uint64_t now;           // last processed tick
+    uint64_t armed;         // tick the timerfd is set to, 0: disarmed
+    uint64_t bitmap[TIMER_WHEEL_LEVELS];
+    struct nemolist slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    Timer *running;
+} timer_wheel;
+
+static uint64_t
+_timer_now()
+{
+    if (view_clock_fake) return view_clock_fake_now;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec/1000000;
+}
+
+// expire may only be the current tick while cascading, before level 0 is
+// handled for that tick.
+static void
+_timer_insert(Timer *timer)
+{
+    if (timer->expire < timer_wheel.now) timer->expire = timer_wheel.now;
+
+    uint64_t delta = timer->expire - timer_wheel.now;
+    uint64_t expire = timer->expire;
+    // Too far: parked in the last window and re-inserted from there
+    if (delta >= TIMER_WHEEL_RANGE) expire = timer_wheel.now + TIMER_WHEEL_RANGE - 1;
+
+    int level = 0;
+    while ((level < TIMER_WHEEL_LEVELS - 1) &&
+            (delta >> (TIMER_WHEEL_BITS * (level + 1)))) level++;
+    int slot = (expire >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+    timer->level = level;
+    timer->slot = slot;
+    nemolist_insert_tail(&timer_wheel.slots[level][slot], &timer->link);
+    timer_wheel.bitmap[level] |= 1ULL << slot;
+}
+
+static void
+_timer_remove(Timer *timer)
+{
+    if (timer->level < 0) return;
+    nemolist_remove(&timer->link);
+    if (nemolist_empty(&timer_wheel.slots[timer->level][timer->slot]))
+        timer_wheel.bitmap[timer->level] &= ~(1ULL << timer->slot);
+    timer->level = -1;
+}
+
+// Tick at which a slot of the given level is handled next
+static uint64_t
+_timer_slot_tick(int level, int slot)
+{
+    int shift = TIMER_WHEEL_BITS * level;
+    if (!level) {
+        return timer_wheel.now + 1 +
+            ((slot - (timer_wheel.now + 1)) & TIMER_WHEEL_MASK);
+    }
+    uint64_t window = (timer_wheel.now >> shift) + 1;
+    return (window + ((slot - window) & TIMER_WHEEL_MASK)) << shift;
+}
+
+// Earliest tick at which the wheel has work (expiry or cascade), 0: none
+static uint64_t
+_timer_next_tick()
+{
+    uint64_t next = 0;
+    int level;
+    for (level = 0 ; level < TIMER_WHEEL_LEVELS ; level++) {
+        uint64_t bitmap = timer_wheel.bitmap[level];
+        if (!bitmap) continue;
+        int shift = TIMER_WHEEL_BITS * level;
+        // First non-empty slot from the next window on, wrapping around
+        int start = ((timer_wheel.now >> shift) + 1) & TIMER_WHEEL_MASK;
+        uint64_t rot = (bitmap >> start) | (start ? bitmap << (TIMER_WHEEL_SLOTS - start) : 0);
+        int slot = (start + __builtin_ctzll(rot)) & TIMER_WHEEL_MASK;
+        uint64_t tick = _timer_slot_tick(level, slot);
+        if (!next || tick < next) next = tick;
+    }
+    return next;
+}
+
+static void
+_timer_arm()
+{
+    uint64_t next = _timer_next_tick();
+    if (next == timer_wheel.armed) return;
+    timer_wheel.armed = next;
+    // Driven by view_clock_advance()
+    if (view_clock_fake) return;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = next/1000;
+    its.it_value.tv_nsec = (next%1000) * 1000000;
+    if (timerfd_settime(timer_wheel.fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        perror("timerfd_settime failed: ");
+}
+
+static void
+_timer_run(Timer *timer)
+{
+    _timer_remove(timer);
+    // Re-armed before the callback, which may still cancel or re-set it
+    if (timer->interval) {
+        timer->expire += timer->interval;
+        if (timer->expire <= timer_wheel.now) timer->expire = timer_wheel.now + 1;
+        _timer_insert(timer);
+    }
+    timer_wheel.running = timer;
+    bool ret;
+    {
+        TRACE_SCOPE("timer callback");
+        ret = timer->callback(timer->data);
+    }
+    timer_wheel.running = NULL;
+
+    if (timer->destroyed) {
+        free(timer);
+    } else if (!ret) {
+        _timer_remove(timer);
+        nemolist_remove(&timer->all);
+        free(timer);
+    }
+}
+
+// Moves the wheel up to the current time as far as it has nothing to do
+// in between, so that new timers are placed relative to the real time.
+static void
+_timer_sync()
+{
+    uint64_t target = _timer_now();
+    uint64_t next = _timer_next_tick();
+    if (next && next <= target) target = next - 1;
+    if (target > timer_wheel.now) timer_wheel.now = target;
+}
+
+static void
+_timer_advance(uint64_t target)
+{
+    while (timer_wheel.now < target) {
+        uint64_t next = _timer_next_tick();
+        if (!next || next > target) {
+            timer_wheel.now = target;
+            break;
+        }
+        timer_wheel.now = next;
+
+        int level;
+        for (level = TIMER_WHEEL_LEVELS - 1 ; level > 0 ; level--) {
+            int shift = TIMER_WHEEL_BITS * level;
+            if (timer_wheel.now & ((1ULL << shift) - 1)) continue;
+            int slot = (timer_wheel.now >> shift) & TIMER_WHEEL_MASK;
+            struct nemolist *list = &timer_wheel.slots[level][slot];
+            while (!nemolist_empty(list)) {
+                Timer *timer = nemolist_node0(list, Timer, link);
+                _timer_remove(timer);
+                _timer_insert(timer);
+            }
+        }
+
+        int slot = timer_wheel.now & TIMER_WHEEL_MASK;
+        struct nemolist *list = &timer_wheel.slots[0][slot];
+        while (!nemolist_empty(list)) {
+            _timer_run(nemolist_node0(list, Timer, link));
+        }
+    }
+}
+
+static bool
+_timer_fd_callback(uint32_t events, void *data)
+{
+    uint64_t cnt;
+    if (read(timer_wheel.fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        perror("timerfd read failed: ");
+    timer_wheel.armed = 0;
+    _timer_advance(_timer_now());
+    _timer_arm();
+    return true;
+}
 
 bool
 timer_init()
 {
     nemolist_init(&timer_list);
+    memset(&timer_wheel, 0, sizeof(timer_wheel));
+    int i, j;
+    for (i = 0 ; i < TIMER_WHEEL_LEVELS ; i++) {
+        for (j = 0 ; j < TIMER_WHEEL_SLOTS ; j++) {
+            nemolist_init(&timer_wheel.slots[i][j]);
+        }
+    }
+    timer_wheel.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timer_wheel.fd < 0) {
+        perror("timerfd_create failed: ");
+        return false;
+    }
+    timer_wheel.now = _timer_now();
     return true;
 }
 
@@ -226,29 +914,89 @@ void
 timer_shutdown()
 {
     Timer *timer, *tmp;
-    nemolist_for_each_safe(timer, tmp, &timer_list, link) {
+    nemolist_for_each_safe(timer, tmp, &timer_list, all) {
         timer_destroy(timer);
     }
-    nemolist_empty(&timer_list);
+    if (timer_wheel.fdh) fd_handler_destroy(timer_wheel.fdh);
+    timer_wheel.fdh = NULL;
+    timer_wheel.view = NULL;
+    if (timer_wheel.fd >= 0) close(timer_wheel.fd);
+    timer_wheel.fd = -1;
 }
 
 void
 timer_destroy(Timer *timer)
 {
     RET_IF(!timer);
-    fd_handler_destroy(timer->fdh);
+    RET_IF(timer->destroyed);
+    _timer_remove(timer);
+    nemolist_remove(&timer->all);
+    // Freed by _timer_run() after its callback returns
+    if (timer == timer_wheel.running) {
+        timer->destroyed = true;
+        return;
+    }
     free(timer);
 }
 
+void
+timer_set(Timer *timer, unsigned int mseconds)
+{
+    RET_IF(!timer);
+    RET_IF(timer->destroyed);
+    _timer_remove(timer);
+    if (!timer_wheel.running) _timer_sync();
+    timer->expire = _timer_now() + mseconds;
+    if (timer->expire <= timer_wheel.now) timer->expire = timer_wheel.now + 1;
+    _timer_insert(timer);
+    if (timer_wheel.running) return;  // armed after the callback
+    uint64_t tick = _timer_slot_tick(timer->level, timer->slot);
+    if (!timer_wheel.armed || tick < timer_wheel.armed) _timer_arm();
+}
+
+void
+timer_cancel(Timer *timer)
+{
+    RET_IF(!timer);
+    // The timerfd is left as it is: an early wake up is cheaper than
+    // re-arming on every cancel.
+    _timer_remove(timer);
+}
+
+// The wheel is shared by all views: its timerfd is watched by the loop of
+// one of them, and moves to another one when that view is destroyed.
 static bool
-_timer_callback(uint32_t events, void *data)
+_timer_wheel_attach(View *view)
 {
-    Timer *timer = data;
-    if (!timer->callback(timer->data)) {
-        timer_destroy(timer);
-        return false;
-    }
-    return true;
+    timer_wheel.fdh = fd_handler_attach(view, timer_wheel.fd, EPOLLIN, _timer_fd_callback, NULL);
+    timer_wheel.view = timer_wheel.fdh ? view : NULL;
+    return !!timer_wheel.fdh;
+}
+
+static void
+_timer_wheel_detach(View *view)
+{
+    if (timer_wheel.view != view) return;
+    fd_handler_destroy(timer_wheel.fdh);
+    timer_wheel.fdh = NULL;
+    timer_wheel.view = NULL;
+    if (!nemolist_empty(&view_list))
+        _timer_wheel_attach(nemolist_node0(&view_list, View, link));
+}
+
+static Timer *
+_timer_create(View *view, unsigned int mseconds, unsigned int interval, Callback callback, void *data)
+{
+    if (!timer_wheel.fdh && !_timer_wheel_attach(view)) return NULL;
+
+    Timer *timer = calloc(sizeof(Timer), 1);
+    timer->callback = callback;
+    timer->data = data;
+    timer->interval = interval;
+    timer->level = -1;
+    nemolist_insert(&timer_list, &timer->all);
+    timer_set(timer, mseconds);
+    return timer;
 }
 
 Timer *
@@ -257,31 +1005,50 @@ timer_attach(View *view, unsigned int mseconds, Callback callback, void *data)
     RET_IF(!view, NULL);
     RET_IF(!mseconds, NULL);
     RET_IF(!callback, NULL);
+    return _timer_create(view, mseconds, mseconds, callback, data);
+}
 
-    int fd;
-    fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
-    if (fd < 0) {
-        perror("timerfd_create failed: ");
-        return NULL;
-    }
+Timer *
+timer_attach_oneshot(View *view, unsigned int mseconds, Callback callback, void *data)
+{
+    RET_IF(!view, NULL);
+    RET_IF(!callback, NULL);
+    return _timer_create(view, mseconds, 0, callback, data);
+}
 
-    struct itimerspec its;
-    its.it_value.tv_sec = mseconds/1000;
-    its.it_value.tv_nsec = (mseconds%1000) * 1000000;
-    its.it_interval.tv_sec = its.it_value.tv_sec;
-    its.it_interval.tv_nsec = its.it_value.tv_nsec;
+/*************************************/
+/** Clock **/
+/*************************************/
+void
+view_clock_set_fake(bool fake)
+{
+    if (fake == view_clock_fake) return;
+    // Keeps the clock monotonic for the timers placed so far
+    if (fake) view_clock_fake_now = _timer_now();
+    view_clock_fake = fake;
+    timer_wheel.armed = 0;
+    if (!fake && timer_wheel.fdh) _timer_arm();
+}
 
-    if (timerfd_settime(fd, 0, &its, NULL) < 0) {
-        perror("timerfd_settime failed: ");
-        close(fd);
-        return NULL;
-    }
+uint64_t
+view_clock_now()
+{
+    return _timer_now();
+}
 
-    Timer *timer = calloc(sizeof(Timer), 1);
-    timer->callback = callback;
-    timer->data = data;
-    timer->fdh = fd_handler_attach(view, fd, EPOLLIN, _timer_callback, timer);
-    nemolist_insert(&timer_list, &timer->link);
+void
+view_clock_advance(unsigned int mseconds)
+{
+    RET_IF(!view_clock_fake);
 
-    return timer;
+    uint64_t target = view_clock_fake_now + mseconds;
+    // Stops at every tick with work, so callbacks see their own time
+    while (1) {
+        uint64_t next = _timer_next_tick();
+        if (!next || next > target) break;
+        view_clock_fake_now = next;
+        _timer_advance(next);
+    }
+    view_clock_fake_now = target;
+    _timer_advance(target);
 }
@@ -10,27 +10,87 @@
 // View
 typedef struct __View View;
 View *view_create(int w, int h, unsigned int br, unsigned int bg, unsigned int bb, unsigned int ba);
+// Renders into memory without a Wayland connection, e.g. for benchmarks.
+// Frame callbacks come VIEW_HEADLESS_FRAME_MS after every present.
+#define VIEW_HEADLESS_FRAME_MS 16
+View *view_create_headless(int w, int h, unsigned int br, unsigned int bg, unsigned int bb, unsigned int ba);
+// Headless only: writes every presented frame as <dir>/frame-NNNNN.png,
+// NULL stops it.
+void view_set_dump_dir(View *view, const char *dir);
+// View draws directly into the shm buffers of the window. The cairo
+// context (and surface) can change after view_update(), so get it again
+// before drawing the next frame. While the compositor holds every buffer
+// they still point to the current one: the draw callback is only called
+// once a buffer is released.
 cairo_t *view_get_cairo(View *view);
 cairo_surface_t *view_get_surface(View *view);
+// frames: presented frames, copied: bytes copied to carry frames over
+// between shm buffers
+void view_get_stats(View *view, uint64_t *frames, uint64_t *copied);
 void view_do(View *view);
 void view_destroy(View *view);
+// Reports the area changed by drawing since the last view_update().
+// Only damaged areas are presented and carried over between shm buffers.
+// If nothing is reported, view_update() presents the whole view.
+void view_damage(View *view, int x, int y, int w, int h);
 void view_update(View *view);
+
+// Frame scheduler: view_request_frame() draws through the draw callback and
+// presents at most once per compositor frame callback. Requests made while
+// a frame is pending are coalesced into the next one.
+typedef void (*ViewDrawCallback)(View *view, void *data);
+void view_set_draw_callback(View *view, ViewDrawCallback callback, void *data);
+void view_request_frame(View *view);
+void view_get_frame_stats(View *view, uint64_t *requested, uint64_t *presented);
 bool view_init();
 void view_shutdown();
 
 typedef bool (*FdCallback)(uint32_t event, void *data);
 typedef bool (*Callback)(void *data);
 // Fd Handler
+// events may include EPOLLET: the callback then has to consume the fd
+// until EAGAIN.
 typedef struct _FdHandler FdHandler;
 bool fd_handler_init();
 void fd_handler_destroy(FdHandler *fdh);
 void fd_handler_shutdown();
 FdHandler *fd_handler_attach(View *view, unsigned int fd, uint32_t events, FdCallback callback, void *data);
-bool fd_handler_call(int epfd, int fd, uint32_t events); // for window
+// for window: fdh is the epoll_event data pointer. Calls are bracketed by
+// begin/end for each batch returned by epoll_wait().
+void fd_handler_dispatch_begin();
+bool fd_handler_call(FdHandler *fdh, uint32_t events);
+void fd_handler_dispatch_end();
+// Event loop latency (from wake up until a batch is handled): bucket i
+// counts batches which took [2^i, 2^(i+1)) microseconds, bucket 0 also
+// the ones below 1 microsecond.
+#define FD_HANDLER_HISTOGRAM_SIZE 32
+void fd_handler_get_histogram(uint64_t histogram[FD_HANDLER_HISTOGRAM_SIZE]);
+void fd_handler_reset_histogram();
+// Runs threadpool_dispatch() (threadpool.h) from the loop of view. Destroy
+// the handler before the pool.
+struct _ThreadPool;
+FdHandler *fd_handler_attach_threadpool(View *view, struct _ThreadPool *pool);
 
 typedef struct _Timer Timer;
 bool timer_init();
 void timer_shutdown();
 void timer_destroy(Timer *timer);
+// Periodic: fires every mseconds until the callback returns false
 Timer *timer_attach(View *view, unsigned int mseconds, Callback callback, void *data);
+// Fires once after mseconds; stays allocated and can be re-armed with
+// timer_set() until it is destroyed or its callback returns false.
+Timer *timer_attach_oneshot(View *view, unsigned int mseconds, Callback callback, void *data);
+// Re-arms the timer to fire after mseconds (O(1)); may be called from the
+// timer's own callback.
+void timer_set(Timer *timer, unsigned int mseconds);
+void timer_cancel(Timer *timer);
+
+// Clock of the timers and headless frame callbacks, in milliseconds.
+// With the fake clock, time only moves by view_clock_advance(), which runs
+// everything due in between: view_do() then returns right away for
+// headless views, and runs are deterministic.
+void view_clock_set_fake(bool fake);
+uint64_t view_clock_now();
+void view_clock_advance(unsigned int mseconds);
+
 #endif
@@ -16,6 +16,7 @@
 #include "util.h"
 #include "view.h"
 #include "wl_window.h"
+#include "trace.h"
 
 struct _Wl_Window {
     struct wl_display *display;
@@ -25,12 +26,21 @@ struct _Wl_Window {
     struct wl_shm *shm;
 
     struct wl_shm_pool *pool;
+    unsigned char *pool_map;
+    unsigned int pool_size;
     struct wl_surface *main_surface;
-    struct wl_buffer *main_buffer;
-    unsigned char *main_map;
+    // Clients render straight into these shm buffers (see view.c)
+    Wl_Buffer buffers[WL_WINDOW_BUFFER_NUM];
+    unsigned int w, h, stride;
 
     struct wl_seat *seat;
     int epfd;
+
+    struct wl_callback *frame;
+    WlWindowFrameCallback frame_callback;
+    void *frame_data;
+    WlWindowReleaseCallback release_callback;
+    void *release_data;
 #if 0
     int32_t pointer_hotspot_x;
     int32_t pointer_hotspot_y;
@@ -113,8 +123,9 @@ _registry_listener_global(void *data, struct wl_registry *registry, uint32_t id,
 
     //LOG("id:%d interface:%s version:%d", id, interface, version);
     if (!strcmp(interface, wl_compositor_interface.name)) {
+        // version 4 has wl_surface.damage_buffer
         display->compositor = wl_registry_bind(registry, id,
-                &wl_compositor_interface, 3);
+                &wl_compositor_interface, version < 4 ? version : 4);
     } else if (!strcmp(interface, wl_shm_interface.name)) {
         display->shm = wl_registry_bind(registry, id,
                 &wl_shm_interface, 1);
@@ -263,16 +274,28 @@ _shm_pool_create(struct wl_shm *shm, unsigned int size)
     return pool;
 }
 
+static void
+_buffer_listener_release(void *data, struct wl_buffer *buffer)
+{
+    Wl_Buffer *buf = data;
+    buf->busy = false;
+    Wl_Window *win = buf->win;
+    if (win->release_callback) win->release_callback(win->release_data);
+}
+
+static const struct wl_buffer_listener _buffer_listener = {
+    _buffer_listener_release
+};
+
 static struct wl_buffer *
-_buffer_create(struct wl_shm_pool *pool, unsigned int w, unsigned int h, unsigned int stride)
+_buffer_create(struct wl_shm_pool *pool, unsigned int offset, unsigned int w, unsigned int h, unsigned int stride)
 {
     RET_IF(!pool, NULL);
     RET_IF(w <=0 || h <= 0, NULL);
 
     struct wl_buffer *buffer;
 
-    buffer = wl_shm_pool_create_buffer(pool, 0, w, h, stride, WL_SHM_FORMAT_ARGB8888);
-    //wl_buffer_add_listener(buffer, &shm_surface_buffer_listener, NULL);
+    buffer = wl_shm_pool_create_buffer(pool, offset, w, h, stride, WL_SHM_FORMAT_ARGB8888);
 
     return buffer;
 }
@@ -349,14 +372,28 @@ wl_window_create(unsigned int w, unsigned int h, unsigned int stride)
 	    free(win);
         return NULL;
     }
-    win->pool = _shm_pool_create(win->shm, h * stride);
-    win->main_map = wl_shm_pool_get_user_data(win->pool);
-
-    win->main_buffer = _buffer_create(win->pool, w, h, stride);
+    win->w = w;
+    win->h = h;
+    win->stride = stride;
+    win->pool_size = h * stride * WL_WINDOW_BUFFER_NUM;
+    win->pool = _shm_pool_create(win->shm, win->pool_size);
+    if (!win->pool) {
+        ERR("shm pool create failed");
+        wl_display_disconnect(win->display);
+        free(win);
+        return NULL;
+    }
+    win->pool_map = wl_shm_pool_get_user_data(win->pool);
+
+    int i;
+    for (i = 0 ; i < WL_WINDOW_BUFFER_NUM ; i++) {
+        Wl_Buffer *buf = &win->buffers[i];
+        buf->win = win;
+        buf->data = win->pool_map + i * h * stride;
+        buf->buffer = _buffer_create(win->pool, i * h * stride, w, h, stride);
+        wl_buffer_add_listener(buf->buffer, &_buffer_listener, buf);
+    }
     win->main_surface = _surface_main_create(win->compositor, win->shell);
-
-    wl_surface_attach(win->main_surface, win->main_buffer, 0, 0);
-    wl_surface_commit(win->main_surface);
     //_pointer_init(display, 100, 59, 10, 35);
 
     win->epfd = epoll_create1(EPOLL_CLOEXEC);
@@ -364,7 +401,7 @@ wl_window_create(unsigned int w, unsigned int h, unsigned int stride)
     win->display_fd = wl_display_get_fd(win->display);
     struct epoll_event ep;
     ep.events = EPOLLIN;
-    ep.data.fd = win->display_fd;
+    ep.data.ptr = win;
     epoll_ctl(win->epfd, EPOLL_CTL_ADD, win->display_fd, &ep);
 
     return win;
@@ -375,14 +412,18 @@ wl_window_destroy(Wl_Window *win)
 {
     RET_IF(!win);
     close(win->epfd);
+    if (win->frame) wl_callback_destroy(win->frame);
     wl_shell_destroy(win->shell);
     wl_compositor_destroy(win->compositor);
     wl_seat_destroy(win->seat);
 
     wl_surface_destroy(win->main_surface);
-    wl_buffer_destroy(win->main_buffer);
+    int i;
+    for (i = 0 ; i < WL_WINDOW_BUFFER_NUM ; i++)
+        wl_buffer_destroy(win->buffers[i].buffer);
     wl_shm_destroy(win->shm);
     wl_shm_pool_destroy(win->pool);
+    munmap(win->pool_map, win->pool_size);
 
     wl_display_disconnect(win->display);
     free(win);
@@ -391,37 +432,47 @@ wl_window_destroy(Wl_Window *win)
 void
 wl_window_loop(Wl_Window *win)
 {
-    struct epoll_event ep[16];
+    struct epoll_event ep[WL_WINDOW_EPOLL_EVENTS];
     int ret, ep_cnt;
     while (1) {
+        TRACE_POLL();
         wl_display_dispatch_pending(win->display);
         ret = wl_display_flush(win->display);
         if (ret < 0 && errno == EAGAIN) {
             LOG("flush needed again");
             // Add into epoll to wait
             ep[0].events = EPOLLIN | EPOLLOUT;
-            ep[0].data.fd = win->display_fd;
+            ep[0].data.ptr = win;
             epoll_ctl(win->epfd, EPOLL_CTL_MOD, win->display_fd, &ep[0]);
         } else if (ret < 0) {
             perror("wl display flush failed: ");
             break;
         }
 
-        ep_cnt = epoll_wait(win->epfd, ep, sizeof(ep)/sizeof(ep[0]), -1);
+        {
+            TRACE_SCOPE("epoll_wait");
+            ep_cnt = epoll_wait(win->epfd, ep, sizeof(ep)/sizeof(ep[0]), -1);
+        }
         if (ep_cnt == -1) {
             perror("epoll wait failed: ");
             continue;
         }
         //LOG("cnt: %d", ep_cnt);
+        // Handlers destroyed while the batch is processed are freed at
+        // its end, so the remaining data pointers stay valid.
+        fd_handler_dispatch_begin();
         int i = 0;
         for (i = 0 ; i < ep_cnt ; i++) {
             //LOG("%p", ep[i].data.ptr);
-            if (ep[i].data.fd == win->display_fd) {
+            // The display fd carries the window itself, every other fd
+            // its FdHandler.
+            if (ep[i].data.ptr == win) {
                 if (ep[i].events & EPOLLERR || ep[i].events & EPOLLHUP) {
                     perror("epoll wait failed: ");
                     break;
                 }
                 if (ep[i].events & EPOLLIN) {
+                    TRACE_SCOPE("wl_display_dispatch");
                     if (wl_display_dispatch(win->display) < 0) {
                         perror("wl display dispatch failed: ");
                         break;
@@ -432,7 +483,7 @@ wl_window_loop(Wl_Window *win)
                     if (ret == 0) {
                         struct epoll_event ep;
                         ep.events = EPOLLIN;
-                        ep.data.fd = win->display_fd;
+                        ep.data.ptr = win;
                         epoll_ctl(win->epfd, EPOLL_CTL_MOD, win->display_fd, &ep);
                     } else if ( ret == -1 && errno != EAGAIN) {
                         perror("wl display flush failed: ");
@@ -440,23 +491,126 @@ wl_window_loop(Wl_Window *win)
                     }
                 }
             } else {
-                if (!fd_handler_call(win->epfd, ep[i].data.fd, ep[i].events)) {
-                    ERR("invalid fd handler is added");
-                }
+                fd_handler_call(ep[i].data.ptr, ep[i].events);
             }
         }
+        fd_handler_dispatch_end();
+    }
+}
+
+unsigned char *
+wl_window_get_buffer(Wl_Window *win, unsigned int idx)
+{
+    RET_IF(!win, NULL);
+    RET_IF(idx >= WL_WINDOW_BUFFER_NUM, NULL);
+    return win->buffers[idx].data;
+}
+
+bool
+wl_window_is_buffer_busy(Wl_Window *win, unsigned int idx)
+{
+    RET_IF(!win, true);
+    RET_IF(idx >= WL_WINDOW_BUFFER_NUM, true);
+    return win->buffers[idx].busy;
+}
+
+int
+wl_window_get_free_buffer(Wl_Window *win)
+{
+    RET_IF(!win, -1);
+    int i;
+    for (i = 0 ; i < WL_WINDOW_BUFFER_NUM ; i++) {
+        if (!win->buffers[i].busy) return i;
+    }
+    return -1;
+}
+
+// Blocks in wl_display_dispatch(): never from an event handler
+static int
+_wl_window_wait_free_buffer(Wl_Window *win)
+{
+    while (1) {
+        int idx = wl_window_get_free_buffer(win);
+        if (idx >= 0) return idx;
+        // Every buffer is held by the compositor: wait for a release
+        if (wl_display_dispatch(win->display) < 0) {
+            perror("wl display dispatch failed: ");
+            return -1;
+        }
     }
 }
 
 void
-wl_window_set_buffer(Wl_Window *win, unsigned char *data, unsigned int size, unsigned int w, unsigned h)
+wl_window_set_release_callback(Wl_Window *win, WlWindowReleaseCallback callback, void *data)
+{
+    RET_IF(!win);
+    win->release_callback = callback;
+    win->release_data = data;
+}
+
+static void
+_frame_listener_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+    Wl_Window *win = data;
+    wl_callback_destroy(callback);
+    win->frame = NULL;
+    if (win->frame_callback) win->frame_callback(win->frame_data, time);
+}
+
+static const struct wl_callback_listener _frame_listener = {
+    _frame_listener_done
+};
+
+void
+wl_window_set_frame_callback(Wl_Window *win, WlWindowFrameCallback callback, void *data)
+{
+    RET_IF(!win);
+    win->frame_callback = callback;
+    win->frame_data = data;
+}
+
+void
+wl_window_present(Wl_Window *win, unsigned int idx, pixman_region32_t *damage)
 {
     RET_IF(!win);
-    memcpy(win->main_map, data, size);
-    /*
-    wl_surface_damage(win->main_surface, 0, 0, w, h);
+    RET_IF(idx >= WL_WINDOW_BUFFER_NUM);
+
+    Wl_Buffer *buf = &win->buffers[idx];
+    buf->busy = true;
+    wl_surface_attach(win->main_surface, buf->buffer, 0, 0);
+    if (!damage) {
+        wl_surface_damage(win->main_surface, 0, 0, win->w, win->h);
+    } else {
+        bool damage_buffer = wl_surface_get_version(win->main_surface) >=
+            WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION;
+        int i, n;
+        pixman_box32_t *rects = pixman_region32_rectangles(damage, &n);
+        for (i = 0 ; i < n ; i++) {
+            if (damage_buffer)
+                wl_surface_damage_buffer(win->main_surface, rects[i].x1, rects[i].y1,
+                        rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1);
+            else
+                wl_surface_damage(win->main_surface, rects[i].x1, rects[i].y1,
+                        rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1);
+        }
+    }
+    if (win->frame_callback && !win->frame) {
+        win->frame = wl_surface_frame(win->main_surface);
+        wl_callback_add_listener(win->frame, &_frame_listener, win);
+    }
     wl_surface_commit(win->main_surface);
-    */
+    wl_display_flush(win->display);
+}
+
+void
+wl_window_set_buffer(Wl_Window *win, unsigned char *data, unsigned int size, unsigned int w, unsigned h)
+{
+    RET_IF(!win);
+    TRACE_FUNC();
+    int idx = _wl_window_wait_free_buffer(win);
+    if (idx < 0) return;
+    memcpy(win->buffers[idx].data, data, size);
+    wl_window_present(win, idx, NULL);
 }
 
 int
@@ -5,15 +5,47 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <pixman.h>
+
+// Number of shm buffers a window cycles through
+#define WL_WINDOW_BUFFER_NUM 3
+// epoll events handled per loop iteration
+#define WL_WINDOW_EPOLL_EVENTS 64
 
-// Window
 typedef struct _Wl_Window Wl_Window;
+typedef struct _Wl_Buffer Wl_Buffer;
+struct _Wl_Buffer {
+    Wl_Window *win;
+    struct wl_buffer *buffer;
+    unsigned char *data;        // h * stride bytes inside the shm pool
+    bool busy;                  // attached until released by the compositor
+};
+
+// Called when the compositor is ready for the next frame
+typedef void (*WlWindowFrameCallback)(void *data, uint32_t time);
+// Called when the compositor releases a buffer
+typedef void (*WlWindowReleaseCallback)(void *data);
+
+// Window
 bool wl_window_init();
 void wl_window_shutdown();
 Wl_Window *wl_window_create(unsigned int w, unsigned int h, unsigned int stride);
 void wl_window_destroy(Wl_Window *win);
 void wl_window_loop(Wl_Window *win);
+// Copies data into a free buffer and presents it
 void wl_window_set_buffer(Wl_Window *win, unsigned char *data, unsigned int size, unsigned int w, unsigned int h);
+// Zero copy presentation: draw into wl_window_get_buffer(idx) and present it.
+// A busy buffer must not be written until the compositor releases it.
+unsigned char *wl_window_get_buffer(Wl_Window *win, unsigned int idx);
+bool wl_window_is_buffer_busy(Wl_Window *win, unsigned int idx);
+// -1 if the compositor holds every buffer: it never waits, as it may be
+// reached from an event handler. Retry after the release callback.
+int wl_window_get_free_buffer(Wl_Window *win);
+void wl_window_set_release_callback(Wl_Window *win, WlWindowReleaseCallback callback, void *data);
+// Only the damage region is redrawn by the compositor (NULL: whole window)
+void wl_window_present(Wl_Window *win, unsigned int idx, pixman_region32_t *damage);
+// Requests a wl_surface.frame callback with every present
+void wl_window_set_frame_callback(Wl_Window *win, WlWindowFrameCallback callback, void *data);
 int wl_window_get_epoll_fd(Wl_Window *win);
 
 #endif
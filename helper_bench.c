@@ -0,0 +1,705 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <json.h>
+#include <nemoattr.h>
+
+#include "log.h"
+#include "util.h"
+#include "text.h"
+#include "view.h"
+#include "projection.h"
+
+// Micro and macro benchmarks of the helper library.
+//
+//  helper_bench [-r repeat] [name ...]
+//
+// Every benchmark runs repeat times (default 5). The results are written
+// to stdout as JSON, logs go to stderr:
+//  {"benchmarks":[{"name":..., "unit":..., "ops":..., "min_ns":...,
+//   "median_ns":..., "ns_per_op":..., "ops_per_sec":...}, ...]}
+// ns_per_op and ops_per_sec are taken from the fastest run. Some add a
+// counter of their own, e.g. "copied_per_op" (bytes carried over between
+// view buffers per frame).
+//
+// HELPER_BENCH_FILE_MB sets the size of the _file_load input (100 MB).
+
+#define BENCH_REPEAT 5
+#define BENCH_REPEAT_MAX 100
+
+typedef struct _Bench Bench;
+struct _Bench {
+    const char *name;
+    const char *unit;           // what an op is
+    bool (*setup)(void);
+    // Returns the number of ops done
+    uint64_t (*run)(void);
+    void (*teardown)(void);
+    bool once;                  // only the first run measures it
+    // Extra result of the last run, written as "<counter>":value
+    const char *counter;
+    double (*count)(void);
+};
+
+static uint64_t
+_bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+_bench_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Keeps results alive so the work is not optimized away
+static volatile uint64_t bench_sink;
+
+/****************************************************/
+/* Font & Text */
+/***************************************************/
+#define BENCH_FONT_FAMILY "Sans"
+#define BENCH_FONT_STYLE "Regular"
+#define BENCH_TEXT_ITER 200
+#define BENCH_FONT_ITER 1000
+
+static const char *bench_paragraph =
+    "The quick brown fox jumps over the lazy dog. Pack my box with five "
+    "dozen liquor jugs. How vexingly quick daft zebras jump! Sphinx of "
+    "black quartz, judge my vow. The five boxing wizards jump quickly. "
+    "Jackdaws love my big sphinx of quartz. Bright vixens jump; dozy fowl "
+    "quack. Quick wafting zephyrs vex bold Jim. ";
+
+cairo_surface_t *bench_surface;
+cairo_t *bench_cr;
+Text *bench_text;
+
+static bool
+_bench_font_setup()
+{
+    return _font_init();
+}
+
+// First load: fontconfig match and FreeType face creation
+static uint64_t
+_bench_font_load_cold()
+{
+    MyFont *font = _font_load(BENCH_FONT_FAMILY, BENCH_FONT_STYLE, -1, -1, -1, -1);
+    bench_sink += (uintptr_t)font;
+    return 1;
+}
+
+// Loaded already: fontconfig match and the font list lookup
+static uint64_t
+_bench_font_load_cached()
+{
+    int i;
+    for (i = 0 ; i < BENCH_FONT_ITER ; i++) {
+        MyFont *font = _font_load(BENCH_FONT_FAMILY, BENCH_FONT_STYLE, -1, -1, -1, -1);
+        bench_sink += (uintptr_t)font;
+    }
+    return BENCH_FONT_ITER;
+}
+
+static bool
+_bench_text_setup_with(const char *utf8)
+{
+    if (!_font_init()) return false;
+    bench_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1024, 1024);
+    bench_cr = cairo_create(bench_surface);
+    bench_text = _text_create(utf8);
+    if (!bench_text) return false;
+    _text_set_font_family(bench_text, BENCH_FONT_FAMILY);
+    _text_set_font_style(bench_text, BENCH_FONT_STYLE);
+    _text_set_font_size(bench_text, 16);
+    _text_draw(bench_text, bench_cr);
+    return true;
+}
+
+static bool
+_bench_text_shape_setup()
+{
+    return _bench_text_setup_with(bench_paragraph);
+}
+
+static bool
+_bench_text_wrap_setup()
+{
+    if (!_bench_text_setup_with(bench_paragraph)) return false;
+    _text_set_wrap(bench_text, 1);
+    _text_set_hint_width(bench_text, 300);
+    return true;
+}
+
+static void
+_bench_text_teardown()
+{
+    _text_destroy(bench_text);
+    cairo_destroy(bench_cr);
+    cairo_surface_destroy(bench_surface);
+    bench_text = NULL;
+}
+
+// harfbuzz shaping of the paragraph alone
+static uint64_t
+_bench_text_shape()
+{
+    int i;
+    for (i = 0 ; i < BENCH_TEXT_ITER ; i++)
+        bench_sink += _text_shape(bench_text);
+    return (uint64_t)BENCH_TEXT_ITER * strlen(bench_paragraph);
+}
+
+// A changed font size makes _text_draw() shape and lay out again
+static uint64_t
+_bench_text_draw()
+{
+    int i;
+    for (i = 0 ; i < BENCH_TEXT_ITER ; i++) {
+        _text_set_font_size(bench_text, 16 + (i & 1));
+        _text_draw(bench_text, bench_cr);
+    }
+    return (uint64_t)BENCH_TEXT_ITER * strlen(bench_paragraph);
+}
+
+/****************************************************/
+/* File */
+/***************************************************/
+char bench_file[] = "/tmp/helper_bench.XXXXXX";
+uint64_t bench_file_size;
+
+static bool
+_bench_file_setup()
+{
+    unsigned long mb = 100;
+    const char *env = getenv("HELPER_BENCH_FILE_MB");
+    if (env) mb = strtoul(env, NULL, 10);
+
+    int fd = mkstemp(bench_file);
+    if (fd < 0) {
+        ERR("%s: %s", bench_file, strerror(errno));
+        return false;
+    }
+    FILE *fp = fdopen(fd, "w");
+    char line[81];
+    memset(line, 'x', 79);
+    line[79] = '\n';
+    line[80] = '\0';
+    uint64_t size = (uint64_t)mb * 1024 * 1024;
+    for (bench_file_size = 0 ; bench_file_size < size ; bench_file_size += 80)
+        fputs(line, fp);
+    fclose(fp);
+    return true;
+}
+
+static uint64_t
+_bench_file_load()
+{
+    int i, num = 0;
+    char **lines = _file_load(bench_file, &num);
+    for (i = 0 ; i < num ; i++) free(lines[i]);
+    free(lines);
+    bench_sink += num;
+    return bench_file_size;
+}
+
+static void
+_bench_file_teardown()
+{
+    unlink(bench_file);
+}
+
+/****************************************************/
+/* Json */
+/***************************************************/
+#define BENCH_JSON_ITER 10000
+
+static const char *bench_json =
+    "{\"coord\":{\"lon\":-122.09,\"lat\":37.39},"
+    "\"weather\":[{\"id\":500,\"main\":\"Rain\",\"description\":\"light rain\",\"icon\":\"10d\"}],"
+    "\"base\":\"stations\","
+    "\"main\":{\"temp\":280.44,\"pressure\":1010,\"humidity\":93,\"temp_min\":278.15,\"temp_max\":282.15},"
+    "\"visibility\":10000,\"wind\":{\"speed\":4.1,\"deg\":80},\"clouds\":{\"all\":90},"
+    "\"dt\":1485789600,"
+    "\"sys\":{\"type\":1,\"id\":471,\"message\":0.0032,\"country\":\"US\",\"sunrise\":1485762037,\"sunset\":1485798670},"
+    "\"id\":5375480,\"name\":\"Mountain View\",\"cod\":200}";
+
+static const char *bench_json_paths[] = {
+    "name", "dt", "coord/lat", "coord/lon", "sys/country", "sys/sunrise",
+    "sys/sunset", "weather/id", "weather/main", "weather/description",
+    "weather/icon", "main/temp", "main/pressure", "main/humidity",
+    "main/temp_min", "main/temp_max", "wind/speed", "wind/deg",
+    "clouds/all", "visibility"
+};
+#define BENCH_JSON_PATH_NUM (sizeof(bench_json_paths)/sizeof(bench_json_paths[0]))
+
+struct json_object *bench_jso;
+
+static bool
+_bench_json_setup()
+{
+    bench_jso = json_tokener_parse(bench_json);
+    return !!bench_jso;
+}
+
+static uint64_t
+_bench_json_find()
+{
+    int i;
+    unsigned int j;
+    for (i = 0 ; i < BENCH_JSON_ITER ; i++) {
+        for (j = 0 ; j < BENCH_JSON_PATH_NUM ; j++) {
+            struct nemoattr attr;
+            memset(&attr, 0, sizeof(struct nemoattr));
+            bench_sink += _json_find(bench_jso, bench_json_paths[j], &attr);
+            nemoattr_put(&attr);
+        }
+    }
+    return (uint64_t)BENCH_JSON_ITER * BENCH_JSON_PATH_NUM;
+}
+
+static uint64_t
+_bench_json_parse()
+{
+    int i;
+    for (i = 0 ; i < BENCH_JSON_ITER ; i++) {
+        struct json_object *jso = json_tokener_parse(bench_json);
+        bench_sink += (uintptr_t)jso;
+        json_object_put(jso);
+    }
+    return BENCH_JSON_ITER;
+}
+
+static void
+_bench_json_teardown()
+{
+    json_object_put(bench_jso);
+}
+
+// The same paths as bench_json_paths, compiled once
+typedef struct _BenchWeather BenchWeather;
+struct _BenchWeather {
+    char *name, *country, *main, *desc, *icon;
+    int dt, sunrise, sunset, id, humidity, visibility;
+    double lat, lon, temp, pressure, temp_min, temp_max, speed, deg, all;
+};
+
+static const JsonField bench_json_fields[] = {
+    JSON_FIELD("name", JSON_FIELD_STRING, BenchWeather, name),
+    JSON_FIELD("dt", JSON_FIELD_INT, BenchWeather, dt),
+    JSON_FIELD("coord/lat", JSON_FIELD_DOUBLE, BenchWeather, lat),
+    JSON_FIELD("coord/lon", JSON_FIELD_DOUBLE, BenchWeather, lon),
+    JSON_FIELD("sys/country", JSON_FIELD_STRING, BenchWeather, country),
+    JSON_FIELD("sys/sunrise", JSON_FIELD_INT, BenchWeather, sunrise),
+    JSON_FIELD("sys/sunset", JSON_FIELD_INT, BenchWeather, sunset),
+    JSON_FIELD("weather/id", JSON_FIELD_INT, BenchWeather, id),
+    JSON_FIELD("weather/main", JSON_FIELD_STRING, BenchWeather, main),
+    JSON_FIELD("weather/description", JSON_FIELD_STRING, BenchWeather, desc),
+    JSON_FIELD("weather/icon", JSON_FIELD_STRING, BenchWeather, icon),
+    JSON_FIELD("main/temp", JSON_FIELD_DOUBLE, BenchWeather, temp),
+    JSON_FIELD("main/pressure", JSON_FIELD_DOUBLE, BenchWeather, pressure),
+    JSON_FIELD("main/humidity", JSON_FIELD_INT, BenchWeather, humidity),
+    JSON_FIELD("main/temp_min", JSON_FIELD_DOUBLE, BenchWeather, temp_min),
+    JSON_FIELD("main/temp_max", JSON_FIELD_DOUBLE, BenchWeather, temp_max),
+    JSON_FIELD("wind/speed", JSON_FIELD_DOUBLE, BenchWeather, speed),
+    JSON_FIELD("wind/deg", JSON_FIELD_DOUBLE, BenchWeather, deg),
+    JSON_FIELD("clouds/all", JSON_FIELD_DOUBLE, BenchWeather, all),
+    JSON_FIELD("visibility", JSON_FIELD_INT, BenchWeather, visibility),
+};
+
+JsonQuery *bench_query;
+
+static void
+_bench_weather_fini(BenchWeather *w)
+{
+    free(w->name);
+    free(w->country);
+    free(w->main);
+    free(w->desc);
+    free(w->icon);
+}
+
+static uint64_t
+_bench_json_query_one(struct json_object *jso)
+{
+    BenchWeather w;
+    memset(&w, 0, sizeof(BenchWeather));
+    uint64_t found = json_query_run(bench_query, jso, &w);
+    _bench_weather_fini(&w);
+    return found;
+}
+
+static bool
+_bench_json_query_setup()
+{
+    if (!_bench_json_setup()) return false;
+    bench_query = json_query_compile(bench_json_fields,
+            sizeof(bench_json_fields)/sizeof(bench_json_fields[0]));
+    return !!bench_query;
+}
+
+static void
+_bench_json_query_teardown()
+{
+    json_query_destroy(bench_query);
+    _bench_json_teardown();
+}
+
+static uint64_t
+_bench_json_query()
+{
+    int i;
+    for (i = 0 ; i < BENCH_JSON_ITER ; i++) {
+        bench_sink += _bench_json_query_one(bench_jso);
+    }
+    return (uint64_t)BENCH_JSON_ITER * BENCH_JSON_PATH_NUM;
+}
+
+// A bulk response, like the OpenWeather group endpoint's: every city of
+// the list is the sample above.
+#define BENCH_JSON_BULK 10000
+
+char *bench_bulk;
+size_t bench_bulk_len;
+struct json_object *bench_bulk_jso, *bench_bulk_list;
+
+static bool
+_bench_json_bulk_setup()
+{
+    size_t len = strlen(bench_json);
+    bench_bulk = malloc((len + 1) * BENCH_JSON_BULK + 64);
+    char *p = bench_bulk + sprintf(bench_bulk, "{\"cnt\":%d,\"list\":[", BENCH_JSON_BULK);
+    int i;
+    for (i = 0 ; i < BENCH_JSON_BULK ; i++) {
+        if (i) *p++ = ',';
+        memcpy(p, bench_json, len);
+        p += len;
+    }
+    strcpy(p, "]}");
+    bench_bulk_len = p + 2 - bench_bulk;
+
+    bench_bulk_jso = json_tokener_parse(bench_bulk);
+    if (!bench_bulk_jso ||
+            !json_object_object_get_ex(bench_bulk_jso, "list", &bench_bulk_list))
+        return false;
+    bench_query = json_query_compile(bench_json_fields,
+            sizeof(bench_json_fields)/sizeof(bench_json_fields[0]));
+    return !!bench_query;
+}
+
+static void
+_bench_json_bulk_teardown()
+{
+    json_query_destroy(bench_query);
+    json_object_put(bench_bulk_jso);
+    free(bench_bulk);
+}
+
+static uint64_t
+_bench_json_bulk_parse()
+{
+    struct json_object *jso = json_tokener_parse(bench_bulk);
+    bench_sink += (uintptr_t)jso;
+    json_object_put(jso);
+    return BENCH_JSON_BULK;
+}
+
+static uint64_t
+_bench_json_bulk_find()
+{
+    int i;
+    unsigned int j;
+    for (i = 0 ; i < BENCH_JSON_BULK ; i++) {
+        struct json_object *city = json_object_array_get_idx(bench_bulk_list, i);
+        for (j = 0 ; j < BENCH_JSON_PATH_NUM ; j++) {
+            struct nemoattr attr;
+            memset(&attr, 0, sizeof(struct nemoattr));
+            bench_sink += _json_find(city, bench_json_paths[j], &attr);
+            nemoattr_put(&attr);
+        }
+    }
+    return BENCH_JSON_BULK;
+}
+
+static uint64_t
+_bench_json_bulk_query()
+{
+    int i;
+    for (i = 0 ; i < BENCH_JSON_BULK ; i++) {
+        bench_sink += _bench_json_query_one(json_object_array_get_idx(bench_bulk_list, i));
+    }
+    return BENCH_JSON_BULK;
+}
+
+// The same response into an arena document, freed at once
+static uint64_t
+_bench_json_bulk_doc_parse()
+{
+    JsonDoc *doc = json_doc_parse(bench_bulk, bench_bulk_len);
+    bench_sink += (uintptr_t)doc;
+    json_doc_destroy(doc);
+    return BENCH_JSON_BULK;
+}
+
+// Parse, query every city and free: what a group refresh does
+static uint64_t
+_bench_json_bulk_doc_query()
+{
+    JsonDoc *doc = json_doc_parse(bench_bulk, bench_bulk_len);
+    const JsonNode *list = json_node_get(json_doc_get_root(doc), "list");
+    unsigned int i, len = json_node_array_length(list);
+    for (i = 0 ; i < len ; i++) {
+        BenchWeather w;
+        memset(&w, 0, sizeof(BenchWeather));
+        bench_sink += json_query_run_node(bench_query, json_node_array_get(list, i), &w);
+        _bench_weather_fini(&w);
+    }
+    json_doc_destroy(doc);
+    return len;
+}
+
+/****************************************************/
+/* List */
+/***************************************************/
+#define BENCH_LIST_NUM 100000
+
+// Insert, iterate and remove (from the back) 100k elements
+static uint64_t
+_bench_list()
+{
+    List *l = NULL, *ll, *tmp;
+    uintptr_t i;
+    for (i = 1 ; i <= BENCH_LIST_NUM ; i++) {
+        l = list_data_insert(l, (void *)i);
+    }
+    void *data;
+    LIST_FOR_EACH(l, ll, data) {
+        bench_sink += (uintptr_t)data;
+    }
+    LIST_FOR_EACH_REVERSE_SAFE(l, ll, tmp, data) {
+        l = list_data_remove(l, data);
+    }
+    return BENCH_LIST_NUM;
+}
+
+/****************************************************/
+/* View */
+/***************************************************/
+#define BENCH_VIEW_W 1024
+#define BENCH_VIEW_H 768
+#define BENCH_VIEW_FRAMES 500
+
+View *bench_view;
+double bench_view_copied;       // bytes per frame in the last run
+
+static bool
+_bench_view_setup()
+{
+    view_clock_set_fake(true);
+    if (!view_init()) return false;
+    bench_view = view_create_headless(BENCH_VIEW_W, BENCH_VIEW_H, 255, 255, 255, 255);
+    return !!bench_view;
+}
+
+static void
+_bench_view_teardown()
+{
+    view_destroy(bench_view);
+    view_shutdown();
+    view_clock_set_fake(false);
+    bench_view = NULL;
+}
+
+static uint64_t
+_bench_view_frames(int size)
+{
+    uint64_t copied0, copied;
+    view_get_stats(bench_view, NULL, &copied0);
+
+    int i;
+    for (i = 0 ; i < BENCH_VIEW_FRAMES ; i++) {
+        cairo_t *cr = view_get_cairo(bench_view);
+        int x = (i * 37) % (BENCH_VIEW_W - size + 1);
+        int y = (i * 53) % (BENCH_VIEW_H - size + 1);
+        cairo_set_source_rgba(cr, (i & 7) / 7.0, 0.5, 0.5, 1);
+        cairo_rectangle(cr, x, y, size, size);
+        cairo_fill(cr);
+        view_damage(bench_view, x, y, size, size);
+        view_update(bench_view);
+        view_clock_advance(VIEW_HEADLESS_FRAME_MS);
+    }
+    view_get_stats(bench_view, NULL, &copied);
+    bench_view_copied = (double)(copied - copied0) / BENCH_VIEW_FRAMES;
+    return BENCH_VIEW_FRAMES;
+}
+
+// The headless view keeps the last presented buffer busy, like a
+// compositor: every frame goes to another buffer and carries the previous
+// damage over.
+static double
+_bench_view_copied()
+{
+    return bench_view_copied;
+}
+
+static uint64_t
+_bench_view_present_small()
+{
+    return _bench_view_frames(32);
+}
+
+static uint64_t
+_bench_view_present_full()
+{
+    return _bench_view_frames(BENCH_VIEW_H);
+}
+
+/****************************************************/
+/* Projection */
+/***************************************************/
+#define BENCH_PROJ_NUM (1024 * 1024)
+
+double *bench_lon, *bench_lat, *bench_x, *bench_y;
+
+static bool
+_bench_proj_setup()
+{
+    bench_lon = malloc(sizeof(double) * BENCH_PROJ_NUM);
+    bench_lat = malloc(sizeof(double) * BENCH_PROJ_NUM);
+    bench_x = malloc(sizeof(double) * BENCH_PROJ_NUM);
+    bench_y = malloc(sizeof(double) * BENCH_PROJ_NUM);
+    unsigned int i;
+    srand(1);
+    for (i = 0 ; i < BENCH_PROJ_NUM ; i++) {
+        bench_lon[i] = rand() / (double)RAND_MAX * 360 - 180;
+        bench_lat[i] = rand() / (double)RAND_MAX * 170 - 85;
+    }
+    return true;
+}
+
+static void
+_bench_proj_teardown()
+{
+    free(bench_lon);
+    free(bench_lat);
+    free(bench_x);
+    free(bench_y);
+}
+
+static uint64_t
+_bench_proj_scalar()
+{
+    unsigned int i;
+    for (i = 0 ; i < BENCH_PROJ_NUM ; i++) {
+        projection_lonlat_to_pixel(16, 256, bench_lon[i], bench_lat[i],
+                &bench_x[i], &bench_y[i]);
+    }
+    bench_sink += bench_x[BENCH_PROJ_NUM - 1];
+    return BENCH_PROJ_NUM;
+}
+
+static uint64_t
+_bench_proj_batch()
+{
+    projection_lonlat_to_pixel_batch(16, 256, bench_lon, bench_lat,
+            bench_x, bench_y, BENCH_PROJ_NUM);
+    bench_sink += bench_x[BENCH_PROJ_NUM - 1];
+    return BENCH_PROJ_NUM;
+}
+
+/****************************************************/
+/* Main */
+/***************************************************/
+static Bench benches[] = {
+    {"font_load_cold", "load", _bench_font_setup, _bench_font_load_cold, NULL, true},
+    {"font_load_cached", "load", _bench_font_setup, _bench_font_load_cached, NULL},
+    {"text_shape", "byte", _bench_text_shape_setup, _bench_text_shape, _bench_text_teardown},
+    {"text_wrap", "byte", _bench_text_wrap_setup, _bench_text_draw, _bench_text_teardown},
+    {"file_load", "byte", _bench_file_setup, _bench_file_load, _bench_file_teardown},
+    {"json_parse", "document", _bench_json_setup, _bench_json_parse, _bench_json_teardown},
+    {"json_find", "lookup", _bench_json_setup, _bench_json_find, _bench_json_teardown},
+    {"json_query", "lookup", _bench_json_query_setup, _bench_json_query, _bench_json_query_teardown},
+    {"json_bulk_parse", "city", _bench_json_bulk_setup, _bench_json_bulk_parse, _bench_json_bulk_teardown},
+    {"json_bulk_find", "city", _bench_json_bulk_setup, _bench_json_bulk_find, _bench_json_bulk_teardown},
+    {"json_bulk_query", "city", _bench_json_bulk_setup, _bench_json_bulk_query, _bench_json_bulk_teardown},
+    {"json_bulk_doc_parse", "city", _bench_json_bulk_setup, _bench_json_bulk_doc_parse, _bench_json_bulk_teardown},
+    {"json_bulk_doc_query", "city", _bench_json_bulk_setup, _bench_json_bulk_doc_query, _bench_json_bulk_teardown},
+    {"list_100k", "element", NULL, _bench_list, NULL},
+    {"view_present_small", "frame", _bench_view_setup, _bench_view_present_small, _bench_view_teardown,
+        false, "copied_per_op", _bench_view_copied},
+    {"view_present_full", "frame", _bench_view_setup, _bench_view_present_full, _bench_view_teardown,
+        false, "copied_per_op", _bench_view_copied},
+    {"projection_scalar", "point", _bench_proj_setup, _bench_proj_scalar, _bench_proj_teardown},
+    {"projection_batch", "point", _bench_proj_setup, _bench_proj_batch, _bench_proj_teardown},
+};
+
+static bool
+_bench_selected(const char *name, int argc, char **argv, int first)
+{
+    int i;
+    if (first >= argc) return true;
+    for (i = first ; i < argc ; i++) {
+        if (!strcmp(argv[i], name)) return true;
+    }
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    int repeat = BENCH_REPEAT;
+    int first = 1;
+    if (argc > 2 && !strcmp(argv[1], "-r")) {
+        repeat = atoi(argv[2]);
+        if (repeat < 1) repeat = 1;
+        if (repeat > BENCH_REPEAT_MAX) repeat = BENCH_REPEAT_MAX;
+        first = 3;
+    }
+
+    printf("{\"benchmarks\":[");
+    bool sep = false;
+    unsigned int i;
+    for (i = 0 ; i < sizeof(benches)/sizeof(benches[0]) ; i++) {
+        Bench *b = &benches[i];
+        if (!_bench_selected(b->name, argc, argv, first)) continue;
+
+        if (b->setup && !b->setup()) {
+            ERR("%s: setup failed", b->name);
+            if (b->teardown) b->teardown();
+            continue;
+        }
+        uint64_t ns[BENCH_REPEAT_MAX];
+        uint64_t ops = 0;
+        int r, n = b->once ? 1 : repeat;
+        for (r = 0 ; r < n ; r++) {
+            uint64_t start = _bench_now();
+            ops = b->run();
+            ns[r] = _bench_now() - start;
+        }
+        double count = b->count ? b->count() : 0;
+        if (b->teardown) b->teardown();
+
+        qsort(ns, n, sizeof(uint64_t), _bench_cmp);
+        double per_op = (double)ns[0] / ops;
+        printf("%s\n{\"name\":\"%s\",\"unit\":\"%s\",\"ops\":%"PRIu64","
+                "\"repeat\":%d,\"min_ns\":%"PRIu64",\"median_ns\":%"PRIu64","
+                "\"ns_per_op\":%.3f,\"ops_per_sec\":%.1f",
+                sep ? "," : "", b->name, b->unit, ops, n, ns[0],
+                ns[n/2], per_op, 1e9 / per_op);
+        if (b->counter) printf(",\"%s\":%.1f", b->counter, count);
+        printf("}");
+        fflush(stdout);
+        sep = true;
+        LOG("%s: %.3f ns/%s", b->name, per_op, b->unit);
+        if (b->counter) LOG("%s: %s %.1f", b->name, b->counter, count);
+    }
+    printf("\n]}\n");
+    return 0;
+}
@@ -7,109 +7,93 @@
 
 #include "util.h"
 
-#define BUF_SIZE 100
+#define BUF_SIZE 4096
 
-static bool
-_json_find(struct json_object *obj, const char *names, struct nemoattr *attr)
-{
-    bool ret = false;
-    char *_names = strdup(names);
-    char *name = strtok(_names, ":");
+static const char *json_paths[] = {
+    "weather/id", "weather/main", "sys/sunrise", "clouds/id"
+};
 
-    struct json_object_iterator it;
-    struct json_object_iterator itEnd;
-    it = json_object_iter_begin(obj);
-    itEnd = json_object_iter_end(obj);
+static void
+_json_print(const char *path, bool ret, struct nemoattr *attr)
+{
+    if (!strcmp(path, "weather/main")) {
+        ERR("ret: %d, %s", ret, nemoattr_gets(attr));
+    } else {
+        ERR("ret: %d, %d", ret, nemoattr_geti(attr));
+    }
+}
 
-    while (!json_object_iter_equal(&it, &itEnd)) {
-        json_object *cobj = json_object_iter_peek_value(&it);
-        const char *_name = json_object_iter_peek_name(&it);
-        json_type type = json_object_get_type(cobj);
-        if (!strcmp(_name, name)) {
-            if (json_type_boolean == type) {
-                json_bool val = json_object_get_boolean(cobj);
-                nemoattr_seti(attr, val);
-            } else if (json_type_double == type) {
-                double val = json_object_get_double(cobj);
-                nemoattr_setd(attr, val);
-                break;
-            } else if (json_type_int == type) {
-                int val = json_object_get_int(cobj);
-                nemoattr_seti(attr, val);
-                break;
-            } else if (json_type_string == type) {
-                const char *val = json_object_get_string(cobj);
-                nemoattr_sets(attr, val, json_object_get_string_len(cobj));
-                break;
-            } else if ((json_type_object == type) ||
-                        json_type_array == type) {
-                name = name + strlen(name) + 1;
-                if (json_type_object == type) {
-                    if (_json_find(cobj, name, attr)) {
-                        break;
-                    }
-                } else {
-                    int i = 0;
-                    for (i = 0; i < json_object_array_length(cobj) ; i++) {
-                        struct json_object *ccobj;
-                        ccobj = json_object_array_get_idx(cobj, i);
-                        if (_json_find(ccobj, name, attr)) {
-                            break;
-                        }
-                    }
-                }
-            } else {
-                ERR("%s have wrong json type(%d)", name, type);
-            }
+// The document copies what it keeps: the text is freed once parsed
+static char *
+_json_read(FILE *fp, size_t *size)
+{
+    char *data = NULL;
+    size_t len = 0, alloc = 0, cnt;
+    do {
+        if (alloc - len < BUF_SIZE) {
+            alloc = alloc ? alloc * 2 : BUF_SIZE;
+            data = realloc(data, alloc);
         }
-        json_object_iter_next(&it);
-    }
-    free(_names);
-    return ret;
+        cnt = fread(data + len, 1, alloc - len, fp);
+        len += cnt;
+    } while (cnt > 0);
+    *size = len;
+    return data;
 }
 
-int main()
+// json [-a]: -a parses into an arena document instead of json-c objects
+int main(int argc, char *argv[])
 {
-#if 1
-    size_t json_str_size = 0;
-    char *json_str = NULL;
-    char buf[BUF_SIZE];
+    bool arena = (argc > 1 && !strcmp(argv[1], "-a"));
+    unsigned int i;
+
     FILE *fp = fopen("./json.json", "r");
+    if (!fp) {
+        ERR("fopen failed: ./json.json");
+        return -1;
+    }
+
+    if (arena) {
+        size_t size;
+        char *data = _json_read(fp, &size);
+        fclose(fp);
+        JsonDoc *doc = json_doc_parse(data, size);
+        free(data);
+        if (!doc) {
+            return -1;
+        }
+
+        for (i = 0 ; i < sizeof(json_paths)/sizeof(json_paths[0]) ; i++) {
+            struct nemoattr attr;
+            memset(&attr, 0, sizeof(struct nemoattr));
+            bool ret = json_node_find(json_doc_get_root(doc), json_paths[i], &attr);
+            _json_print(json_paths[i], ret, &attr);
+        }
+        json_doc_destroy(doc);
+        return 0;
+    }
 
-    while (fgets(buf, BUF_SIZE - 1, fp)) {
-        json_str_size += strlen(buf);
-        json_str = realloc(json_str, json_str_size + 1);
-        strncat(json_str, buf, strlen(buf));
+    // Parsed while reading, the text is never held as a whole
+    JsonStream *js = json_stream_create();
+    char buf[BUF_SIZE];
+    size_t len;
+    while ((len = fread(buf, 1, BUF_SIZE, fp)) > 0) {
+        if (!json_stream_feed(js, buf, len)) break;
     }
     fclose(fp);
 
-    if (!json_str) {
+    struct json_object *obj = json_stream_finish(js);
+    json_stream_destroy(js);
+    if (!obj) {
         return -1;
     }
-#endif
-    struct json_object *obj;
-    obj = json_object_from_file("./json.json");
-    //obj = json_tokener_parse(json_str);
-    struct nemoattr attr;
-    memset(&attr, 0, sizeof(struct nemoattr));
-
-    bool ret;
-    ret = _json_find(obj, "weather:id", &attr);
-    ERR("ret: %d, %d", ret, nemoattr_geti(&attr));
 
-    memset(&attr, 0, sizeof(struct nemoattr));
-    ret = _json_find(obj, "weather:main", &attr);
-    ERR("ret: %d, %s", ret, nemoattr_gets(&attr));
-
-    memset(&attr, 0, sizeof(struct nemoattr));
-    ret = _json_find(obj, "sys:sunrise", &attr);
-    ERR("ret: %d, %d", ret, nemoattr_geti(&attr));
-
-    memset(&attr, 0, sizeof(struct nemoattr));
-    ret = _json_find(obj, "clouds:id", &attr);
-    ERR("ret: %d, %d", ret, nemoattr_geti(&attr));
-    free(json_str);
+    for (i = 0 ; i < sizeof(json_paths)/sizeof(json_paths[0]) ; i++) {
+        struct nemoattr attr;
+        memset(&attr, 0, sizeof(struct nemoattr));
+        bool ret = _json_find(obj, json_paths[i], &attr);
+        _json_print(json_paths[i], ret, &attr);
+    }
+    json_object_put(obj);
     return 0;
 }
-
-
@@ -11,11 +11,18 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <strings.h> // strncasecmp
+#include <time.h>
+#include <inttypes.h> // PRIu64
+#include <pthread.h>
 
 #include "view.h"
 #include "log.h"
 #include "util.h"
 #include "nemolist.h"
+#include "projection.h"
+#include "threadpool.h"
+#include "trace.h"
 
 #if 0
 // Refer : http://wiki.openstreetmap.org/wiki/FAQ
@@ -95,6 +102,13 @@ static char *
 _map_url_get_mapquest(unsigned int zoom, unsigned int x, unsigned int y)
 {
    char buf[PATH_MAX];
+   // MAP_TILE_SERVER (e.g. http://127.0.0.1:8000) redirects every tile
+   // request to one local stand-in server for testing.
+   const char *server = getenv("MAP_TILE_SERVER");
+   if (server) {
+       snprintf(buf, sizeof(buf), "%s/%d/%d/%d.png", server, zoom, x, y);
+       return strdup(buf);
+   }
    snprintf(buf, sizeof(buf),
             "http://otile%d.mqcdn.com/tiles/1.0.0/osm/%d/%d/%d.png",
             ((x + y + zoom) % 4) + 1, zoom, x, y);
@@ -128,11 +142,377 @@ _curl_write_func(void *data, size_t item_size, size_t num_items, void *userdata)
 }
 #endif
 
+// Maximum connections opened to one tile server. Requests above this
+// limit wait in the multi handle (or are multiplexed over HTTP/2).
+#define FILE_DOWNLOAD_MAX_HOST_CONNECTIONS 4
+// Finished easy handles are kept for reuse up to this number.
+#define FILE_DOWNLOAD_POOL_MAX 32
+// Poll interval while curl has no timeout of its own (milliseconds)
+#define FILE_DOWNLOAD_POLL_MS 100
+
 CURLM *curlm;
+CURLSH *curlsh;
 List *curlm_fd_lists;
 struct nemolist file_download_lists;
 Timer *curlm_timer;
 
+CURL *curl_pool[FILE_DOWNLOAD_POOL_MAX];
+int curl_pool_cnt;
+
+typedef struct _FileDownloadStats FileDownloadStats;
+struct _FileDownloadStats {
+    unsigned int connection_opened;     // new TCP/TLS connections
+    unsigned int connection_reused;     // transfers done on a cached connection
+};
+
+FileDownloadStats file_download_stats;
+
+/*************************************/
+/** Tile Cache **/
+/*************************************/
+// Decoded tiles kept in memory, looked up on every tile draw: a hash
+// table keyed by the tile coordinate.
+#define TILE_CACHE_BUCKETS_BITS 8
+#define TILE_CACHE_BUCKETS (1 << TILE_CACHE_BUCKETS_BITS)
+
+typedef struct _TileKey TileKey;
+struct _TileKey {
+    unsigned int zoom;
+    int x, y;
+};
+
+typedef struct _TileCache TileCache;
+struct _TileCache {
+    TileCache *next;        // same bucket
+    TileKey key;
+    cairo_surface_t *surface;
+};
+
+TileCache *tile_cache_buckets[TILE_CACHE_BUCKETS];
+
+static void
+_tile_cache_init()
+{
+    memset(tile_cache_buckets, 0, sizeof(tile_cache_buckets));
+}
+
+static unsigned int
+_tile_cache_hash(const TileKey *key)
+{
+    uint64_t h = ((uint64_t)key->zoom << 56) ^
+        ((uint64_t)(uint32_t)key->x << 28) ^ (uint32_t)key->y;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return h >> (64 - TILE_CACHE_BUCKETS_BITS);
+}
+
+static TileCache *
+_tile_cache_find(const TileKey *key, unsigned int hash)
+{
+    TileCache *tc;
+    for (tc = tile_cache_buckets[hash] ; tc ; tc = tc->next) {
+        if (tc->key.zoom == key->zoom && tc->key.x == key->x &&
+                tc->key.y == key->y)
+            return tc;
+    }
+    return NULL;
+}
+
+static cairo_surface_t *
+_tile_cache_get(const TileKey *key)
+{
+    TileCache *tc = _tile_cache_find(key, _tile_cache_hash(key));
+    return tc ? tc->surface : NULL;
+}
+
+static void
+_tile_cache_put(const TileKey *key, cairo_surface_t *surface)
+{
+    unsigned int hash = _tile_cache_hash(key);
+    TileCache *tc = _tile_cache_find(key, hash);
+    if (tc) {
+        cairo_surface_destroy(tc->surface);
+        tc->surface = surface;
+        return;
+    }
+    tc = calloc(sizeof(TileCache), 1);
+    tc->key = *key;
+    tc->surface = surface;
+    tc->next = tile_cache_buckets[hash];
+    tile_cache_buckets[hash] = tc;
+}
+
+static void
+_tile_cache_shutdown()
+{
+    int i;
+    for (i = 0 ; i < TILE_CACHE_BUCKETS ; i++) {
+        TileCache *tc = tile_cache_buckets[i];
+        while (tc) {
+            TileCache *next = tc->next;
+            cairo_surface_destroy(tc->surface);
+            free(tc);
+            tc = next;
+        }
+        tile_cache_buckets[i] = NULL;
+    }
+}
+
+typedef struct _TileStream TileStream;
+struct _TileStream {
+    const unsigned char *data;
+    size_t size;
+    size_t offset;
+};
+
+static cairo_status_t
+_tile_stream_read(void *closure, unsigned char *data, unsigned int length)
+{
+    TileStream *ts = closure;
+    if (ts->offset + length > ts->size) return CAIRO_STATUS_READ_ERROR;
+    memcpy(data, ts->data + ts->offset, length);
+    ts->offset += length;
+    return CAIRO_STATUS_SUCCESS;
+}
+
+// Decode a downloaded tile straight from memory (no file round trip)
+static cairo_surface_t *
+_tile_decode(const unsigned char *data, size_t size)
+{
+    RET_IF(!data || !size, NULL);
+    TRACE_FUNC();
+
+    TileStream ts = {data, size, 0};
+    cairo_surface_t *surface;
+    surface = cairo_image_surface_create_from_png_stream(_tile_stream_read, &ts);
+    cairo_status_t status = cairo_surface_status(surface);
+    if (status != CAIRO_STATUS_SUCCESS) {
+        ERR("tile decode failed: %s", cairo_status_to_string(status));
+        cairo_surface_destroy(surface);
+        return NULL;
+    }
+    return surface;
+}
+
+/*************************************/
+/** Tile Writer **/
+/*************************************/
+// Downloaded tiles are written to ~/.map on a thread pool so that the
+// disk I/O stays off the rendering path. Writes of the same tile are
+// queued in push order and run one at a time by a single task, as the
+// workers would otherwise run them concurrently or in any order.
+#define TILE_WRITER_WORKERS 2
+
+typedef struct _TileWrite TileWrite;
+struct _TileWrite {
+    struct nemolist link;   // TileWriteQueue.writes
+    unsigned char *data;    // NULL: only the metadata is written
+    size_t size;
+    char *meta;             // "<tile>.meta", written after the tile
+};
+
+typedef struct _TileWriteQueue TileWriteQueue;
+struct _TileWriteQueue {
+    struct nemolist link;   // tile_write_queues
+    char *filename;
+    struct nemolist writes; // oldest first
+};
+
+ThreadPool *tile_writer;
+// Tiles with a queued or running write, protected by tile_write_lock
+struct nemolist tile_write_queues;
+pthread_mutex_t tile_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool
+_tile_write_file(const char *filename, const void *data, size_t size)
+{
+    // Write to a temporary name and rename it, so _file_exist() never
+    // sees a partially written file.
+    char *tmpname = _strdup_printf("%s.part", filename);
+    FILE *fp = fopen(tmpname, "w");
+    if (!fp) {
+        ERR("%s: %s", tmpname, strerror(errno));
+        free(tmpname);
+        return false;
+    }
+    if (fwrite(data, 1, size, fp) != size) {
+        ERR("%s: %s", tmpname, strerror(errno));
+        fclose(fp);
+        unlink(tmpname);
+        free(tmpname);
+        return false;
+    }
+    fclose(fp);
+    if (rename(tmpname, filename)) {
+        ERR("%s: %s", filename, strerror(errno));
+        unlink(tmpname);
+        free(tmpname);
+        return false;
+    }
+    free(tmpname);
+    return true;
+}
+
+static void
+_tile_write_do(const char *filename, TileWrite *tw)
+{
+    if (tw->data && !_tile_write_file(filename, tw->data, tw->size)) return;
+    if (tw->meta) {
+        char *metaname = _strdup_printf("%s.meta", filename);
+        _tile_write_file(metaname, tw->meta, strlen(tw->meta));
+        free(metaname);
+    }
+}
+
+static void *
+_tile_write_work(void *data)
+{
+    TileWriteQueue *q = data;
+    while (1) {
+        pthread_mutex_lock(&tile_write_lock);
+        if (nemolist_empty(&q->writes)) {
+            nemolist_remove(&q->link);
+            pthread_mutex_unlock(&tile_write_lock);
+            break;
+        }
+        TileWrite *tw = nemolist_node0(&q->writes, TileWrite, link);
+        nemolist_remove(&tw->link);
+        pthread_mutex_unlock(&tile_write_lock);
+
+        _tile_write_do(q->filename, tw);
+        free(tw->data);
+        free(tw->meta);
+        free(tw);
+    }
+    free(q->filename);
+    free(q);
+    return NULL;
+}
+
+static bool
+_tile_writer_init()
+{
+    nemolist_init(&tile_write_queues);
+    tile_writer = threadpool_create(TILE_WRITER_WORKERS);
+    return !!tile_writer;
+}
+
+// Takes the ownership of data and meta
+static void
+_tile_writer_push(const char *filename, unsigned char *data, size_t size, char *meta)
+{
+    TileWrite *tw = calloc(sizeof(TileWrite), 1);
+    tw->data = data;
+    tw->size = size;
+    tw->meta = meta;
+
+    pthread_mutex_lock(&tile_write_lock);
+    TileWriteQueue *q;
+    nemolist_for_each(q, &tile_write_queues, link) {
+        if (!strcmp(q->filename, filename)) {
+            // Its task is still running and picks this one up next
+            nemolist_insert_tail(&q->writes, &tw->link);
+            pthread_mutex_unlock(&tile_write_lock);
+            return;
+        }
+    }
+    q = calloc(sizeof(TileWriteQueue), 1);
+    q->filename = strdup(filename);
+    nemolist_init(&q->writes);
+    nemolist_insert_tail(&q->writes, &tw->link);
+    nemolist_insert(&tile_write_queues, &q->link);
+    pthread_mutex_unlock(&tile_write_lock);
+
+    if (!tile_writer || !threadpool_run(tile_writer, _tile_write_work, q))
+        _tile_write_work(q);
+}
+
+// Pending writes are flushed before the workers exit
+static void
+_tile_writer_shutdown()
+{
+    if (tile_writer) threadpool_destroy(tile_writer);
+    tile_writer = NULL;
+}
+
+/*************************************/
+/** Tile Meta **/
+/*************************************/
+// Validators and expiry of a cached tile, stored next to it as
+// "<tile>.meta". Tiles without metadata expire FILE_DOWNLOAD_DEFAULT_TTL
+// after their modification time.
+#define FILE_DOWNLOAD_DEFAULT_TTL (7 * 24 * 60 * 60)
+
+typedef struct _TileMeta TileMeta;
+struct _TileMeta {
+    char *etag;
+    char *last_modified;
+    time_t expires;
+};
+
+static void
+_tile_meta_clear(TileMeta *meta)
+{
+    free(meta->etag);
+    free(meta->last_modified);
+    memset(meta, 0, sizeof(TileMeta));
+}
+
+static bool
+_tile_meta_load(const char *filename, TileMeta *meta)
+{
+    memset(meta, 0, sizeof(TileMeta));
+
+    char *metaname = _strdup_printf("%s.meta", filename);
+    if (!_file_exist(metaname)) {
+        free(metaname);
+        struct stat st;
+        if (stat(filename, &st)) return false;
+        meta->expires = st.st_mtime + FILE_DOWNLOAD_DEFAULT_TTL;
+        return true;
+    }
+
+    int i, line_len = 0;
+    char **line = _file_load(metaname, &line_len);
+    free(metaname);
+    for (i = 0 ; i < line_len ; i++) {
+        char *val = strchr(line[i], ' ');
+        if (val) {
+            *val = '\0';
+            val++;
+            val[strcspn(val, "\r\n")] = '\0';
+            if (!strcmp(line[i], "etag")) {
+                meta->etag = strdup(val);
+            } else if (!strcmp(line[i], "last-modified")) {
+                meta->last_modified = strdup(val);
+            } else if (!strcmp(line[i], "expires")) {
+                meta->expires = strtol(val, NULL, 10);
+            }
+        }
+        free(line[i]);
+    }
+    free(line);
+    return true;
+}
+
+static char *
+_tile_meta_to_str(TileMeta *meta)
+{
+    return _strdup_printf("etag %s\nlast-modified %s\nexpires %ld\n",
+            meta->etag ? meta->etag : "",
+            meta->last_modified ? meta->last_modified : "",
+            (long)meta->expires);
+}
+
+// The metadata is written behind any queued write of the tile
+static void
+_tile_meta_save(const char *filename, TileMeta *meta)
+{
+    _tile_writer_push(filename, NULL, 0, _tile_meta_to_str(meta));
+}
+
+/*************************************/
+/** File Downloader **/
+/*************************************/
 typedef struct _FileDownloader FileDownloader;
 typedef void (*FileDownloaderEnd)(FileDownloader *fd, const char *filename, void *data);
 
@@ -142,10 +522,33 @@ struct _FileDownloader {
     char *url;
     FILE *fp;
     char *filename;
+    TileKey key;            // of the tile cache entry
     FileDownloaderEnd callback_end;
     void *data_end;
+
+    // Memory mode: body is received into buf instead of fp
+    bool memory;
+    unsigned char *buf;
+    size_t buf_size;
+    size_t buf_alloc;
+
+    // Revalidation of a stale cached tile
+    struct curl_slist *headers;
+    TileMeta meta;          // validators received from the server
+    bool max_age;           // expiry came from Cache-Control
 };
 
+// curlm_timer is a one-shot timer, so it has to be set again for every
+// timeout curl asks for, or the transfers stall after its first expiry.
+static void
+_file_download_timer_update(long tout)
+{
+    // Not driven by curlm_timer: _file_download_do() polls by itself
+    if (!curlm_timer) return;
+    if (tout < 0) tout = FILE_DOWNLOAD_POLL_MS;
+    timer_set(curlm_timer, tout);
+}
+
 static bool
 _file_download_init()
 {
@@ -159,10 +562,74 @@ _file_download_init()
     curlm = curl_multi_init();
     if (!curlm) return false;
 
+    CURLMcode mcode;
+    mcode = curl_multi_setopt(curlm, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    if (mcode) ERR("%s", curl_multi_strerror(mcode));
+    mcode = curl_multi_setopt(curlm, CURLMOPT_MAX_HOST_CONNECTIONS,
+            (long)FILE_DOWNLOAD_MAX_HOST_CONNECTIONS);
+    if (mcode) ERR("%s", curl_multi_strerror(mcode));
+
+    // DNS results and TLS sessions are shared by all easy handles
+    curlsh = curl_share_init();
+    if (curlsh) {
+        CURLSHcode shcode;
+        shcode = curl_share_setopt(curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        if (shcode) ERR("%s", curl_share_strerror(shcode));
+        shcode = curl_share_setopt(curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        if (shcode) ERR("%s", curl_share_strerror(shcode));
+    } else {
+        ERR("curl share init failed");
+    }
+
+    memset(&file_download_stats, 0, sizeof(FileDownloadStats));
     nemolist_init(&file_download_lists);
     return true;
 }
 
+static CURL *
+_file_download_easy_get()
+{
+    if (curl_pool_cnt > 0) {
+        curl_pool_cnt--;
+        return curl_pool[curl_pool_cnt];
+    }
+    return curl_easy_init();
+}
+
+static void
+_file_download_easy_put(CURL *easy)
+{
+    if (curl_pool_cnt >= FILE_DOWNLOAD_POOL_MAX) {
+        curl_easy_cleanup(easy);
+        return;
+    }
+    // reset keeps live connections, DNS and session caches of the handle
+    curl_easy_reset(easy);
+    curl_pool[curl_pool_cnt] = easy;
+    curl_pool_cnt++;
+}
+
+static void
+_file_download_stats_update(CURL *easy)
+{
+    CURLcode ret;
+    long num;
+    ret = curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &num);
+    if (ret) {
+        ERR("%s", curl_easy_strerror(ret));
+        return;
+    }
+    if (num > 0) file_download_stats.connection_opened += num;
+    else file_download_stats.connection_reused++;
+}
+
+static void
+_file_download_stats_get(unsigned int *opened, unsigned int *reused)
+{
+    if (opened) *opened = file_download_stats.connection_opened;
+    if (reused) *reused = file_download_stats.connection_reused;
+}
+
 static void _file_download_destroy(FileDownloader *fd);
 
 static void
@@ -177,8 +644,49 @@ _file_download_read_info()
             nemolist_for_each_safe(fd, tmp, &file_download_lists, link) {
                 if (fd->curl == msg->easy_handle) {
                     LOG("completed %s", fd->filename);
-                    fclose(fd->fp);
-                    fd->fp = NULL;
+                    if (fd->fp) {
+                        fclose(fd->fp);
+                        fd->fp = NULL;
+                    }
+                    long status = 0;
+                    curl_easy_getinfo(fd->curl, CURLINFO_RESPONSE_CODE, &status);
+                    if (!fd->meta.expires)
+                        fd->meta.expires = time(NULL) + FILE_DOWNLOAD_DEFAULT_TTL;
+                    if (msg->data.result != CURLE_OK) {
+                        ERR("%s: %s", fd->url, curl_easy_strerror(msg->data.result));
+                    } else if (status == 304) {
+                        // Not modified: only the expiry is refreshed, the
+                        // stale tile in the cache is valid again.
+                        LOG("not modified: %s", fd->filename);
+                        _tile_meta_save(fd->filename, &fd->meta);
+                    } else if (fd->memory && (status == 200)) {
+                        cairo_surface_t *surface;
+                        surface = _tile_decode(fd->buf, fd->buf_size);
+                        if (surface) {
+                            _tile_cache_put(&fd->key, surface);
+                            // The tile and then its metadata
+                            _tile_writer_push(fd->filename, fd->buf, fd->buf_size,
+                                    _tile_meta_to_str(&fd->meta));
+                            fd->buf = NULL;
+                        }
+                    } else if (status == 200) {
+                        _tile_meta_save(fd->filename, &fd->meta);
+                    }
+                    free(fd->buf);
+                    fd->buf = NULL;
+                    fd->buf_size = 0;
+                    fd->buf_alloc = 0;
+
+                    CURLMcode code;
+                    code = curl_multi_remove_handle(curlm, fd->curl);
+                    if (code != CURLM_OK)
+                        ERR("curl multi remove handle failed: %s",
+                                curl_multi_strerror(code));
+                    _file_download_stats_update(fd->curl);
+                    _file_download_easy_put(fd->curl);
+                    fd->curl = NULL;
+                    if (fd->headers) curl_slist_free_all(fd->headers);
+                    fd->headers = NULL;
                     // FIXME: callback is needed!!
                     if (fd->callback_end) fd->callback_end(fd, fd->filename, fd->data_end);
                     //_file_download_destroy(fd);
@@ -196,13 +704,16 @@ _file_download_perform()
     code = curl_multi_perform(curlm, &still_running);
     if (code == CURLM_CALL_MULTI_PERFORM) {
         LOG("perform again");
+        _file_download_timer_update(0);
         return true;
     } else if (code != CURLM_OK) {
         ERR("curl multi perform failed: %s", curl_multi_strerror(code));
+        _file_download_timer_update(FILE_DOWNLOAD_POLL_MS);
         return true;
         // END
         //break;
     }
+    _file_download_read_info();
     if (!still_running) {
         LOG("Multi perform ended");
         if (curlm_timer) timer_destroy(curlm_timer);
@@ -217,7 +728,14 @@ _file_download_perform()
         // END
         //break;
     }
-    _file_download_read_info();
+
+    long tout;
+    code = curl_multi_timeout(curlm, &tout);
+    if (code != CURLM_OK) {
+        ERR("curl multi timeout failed: %s", curl_multi_strerror(code));
+        tout = FILE_DOWNLOAD_POLL_MS;
+    }
+    _file_download_timer_update(tout);
 
     return true;
 }
@@ -278,74 +796,215 @@ _file_download_set_timeout(View *view)
     CURLMcode code;
     long tout;
     code = curl_multi_timeout(curlm, &tout);
-    if (code == CURLM_OK) {
-        if (tout < 0) tout = 0;
-    } else {
+    if (code != CURLM_OK) {
         ERR("curl multi timeout failed: %s", curl_multi_strerror(code));
-        tout = 100;
+        tout = FILE_DOWNLOAD_POLL_MS;
     }
-    if (curlm_timer) timer_destroy(curlm_timer);
-    curlm_timer = timer_attach(view, tout, _file_download_timer, NULL);
+    if (!curlm_timer)
+        curlm_timer = timer_attach_oneshot(view, 0, _file_download_timer, NULL);
+    _file_download_timer_update(tout);
 }
 
+static size_t
+_file_download_write_mem(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    FileDownloader *fd = userdata;
+    size_t len = size * nmemb;
+    if (!len) return 0;
+
+    if (fd->buf_size + len > fd->buf_alloc) {
+        size_t alloc = fd->buf_alloc ? fd->buf_alloc : 16 * 1024;
+        while (alloc < fd->buf_size + len) alloc *= 2;
+        unsigned char *buf = realloc(fd->buf, alloc);
+        if (!buf) {
+            ERR("memory allocation failed: %zu", alloc);
+            return 0;
+        }
+        fd->buf = buf;
+        fd->buf_alloc = alloc;
+    }
+    memcpy(fd->buf + fd->buf_size, ptr, len);
+    fd->buf_size += len;
+    return len;
+}
+
+static size_t
+_file_download_header(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    FileDownloader *fd = userdata;
+    size_t len = size * nmemb;
+
+    char *line = strndup(ptr, len);
+    line[strcspn(line, "\r\n")] = '\0';
+
+    int status;
+    char *val = strchr(line, ':');
+    if (sscanf(line, "HTTP/%*s %d", &status) == 1) {
+        // New content: validators of the stale tile do not apply anymore
+        if (status == 200) {
+            _tile_meta_clear(&fd->meta);
+            fd->max_age = false;
+        }
+    } else if (val) {
+        *val = '\0';
+        val++;
+        while (*val == ' ') val++;
+        if (!strcasecmp(line, "etag")) {
+            free(fd->meta.etag);
+            fd->meta.etag = strdup(val);
+        } else if (!strcasecmp(line, "last-modified")) {
+            free(fd->meta.last_modified);
+            fd->meta.last_modified = strdup(val);
+        } else if (!strcasecmp(line, "expires")) {
+            time_t t = curl_getdate(val, NULL);
+            // Cache-Control max-age takes precedence over Expires
+            if (t > 0 && !fd->max_age) fd->meta.expires = t;
+        } else if (!strcasecmp(line, "cache-control")) {
+            char *age = strstr(val, "max-age=");
+            if (age) {
+                fd->meta.expires = time(NULL) + strtol(age + strlen("max-age="), NULL, 10);
+                fd->max_age = true;
+            } else if (strstr(val, "no-cache") || strstr(val, "no-store")) {
+                fd->meta.expires = time(NULL);
+                fd->max_age = true;
+            }
+        }
+    }
+    free(line);
+    return len;
+}
+
+// If memory is true, the tile is downloaded into memory, decoded into the
+// tile cache under key and written to dst asynchronously after completion.
+//
+// A cached tile is used as it is until its expiry. After that it is
+// loaded into the tile cache (so it stays visible) and revalidated in the
+// background with If-None-Match/If-Modified-Since.
 static FileDownloader *
-_file_download_create(View *view, const char *src, const char *dst, unsigned int timeout, FileDownloaderEnd callback_end, void *data_end)
+_file_download_create(View *view, const char *src, const char *dst, const TileKey *key, unsigned int timeout, bool memory, FileDownloaderEnd callback_end, void *data_end)
 {
     RET_IF(!src, false);
     RET_IF(!dst, false);
+    RET_IF(!key, false);
 
     FILE *fp;
     CURLMcode code;
     CURLcode ret;
     CURL *easy;
-#if 1
+    struct curl_slist *headers = NULL;
+    TileMeta meta;
+    memset(&meta, 0, sizeof(TileMeta));
     if (_file_exist(dst)) {
-        LOG("file already downloaded: %s", dst);
-        if (callback_end) callback_end(NULL, dst, data_end);
-        return NULL;
+        if (_tile_meta_load(dst, &meta) && (meta.expires > time(NULL))) {
+            LOG("file already downloaded: %s", dst);
+            _tile_meta_clear(&meta);
+            if (callback_end) callback_end(NULL, dst, data_end);
+            return NULL;
+        }
+
+        LOG("revalidate stale file: %s", dst);
+        if (!_tile_cache_get(key)) {
+            cairo_surface_t *surface = cairo_image_surface_create_from_png(dst);
+            if (cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS)
+                _tile_cache_put(key, surface);
+            else
+                cairo_surface_destroy(surface);
+        }
+        if (meta.etag && meta.etag[0]) {
+            char *str = _strdup_printf("If-None-Match: %s", meta.etag);
+            headers = curl_slist_append(headers, str);
+            free(str);
+        }
+        if (meta.last_modified && meta.last_modified[0]) {
+            char *str = _strdup_printf("If-Modified-Since: %s", meta.last_modified);
+            headers = curl_slist_append(headers, str);
+            free(str);
+        }
+        // A 304 may omit the validators, so the old ones are kept
+        meta.expires = 0;
+        // The stale file must stay intact until the fresh one lands
+        memory = true;
     }
-#endif
-    fp = fopen(dst, "w+");
-    if (!fp) {
-        ERR("%s", strerror(errno));
-        return NULL;
+
+    FileDownloader *fd = calloc(sizeof(FileDownloader), 1);
+    fd->headers = headers;
+    fd->meta = meta;
+    fp = NULL;
+    if (!memory) {
+        fp = fopen(dst, "w+");
+        if (!fp) {
+            ERR("%s", strerror(errno));
+            free(fd);
+            return NULL;
+        }
     }
 
-    easy = curl_easy_init();
+    easy = _file_download_easy_get();
     if (!easy) {
+        if (fp) fclose(fp);
+        if (headers) curl_slist_free_all(headers);
+        _tile_meta_clear(&fd->meta);
+        free(fd);
         return NULL;
     }
     // if (ret = curl_easy_setopt(easy, CURLOPT_VERBOSE, 1)) // debugging
     //    ERR("%s", curl_easy_strerror(ret));
     ret = curl_easy_setopt(easy, CURLOPT_URL, src);
     if (ret) ERR("%s", curl_easy_strerror(ret));
-    ret = curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, NULL);
-    if (ret) ERR("%s", curl_easy_strerror(ret));
-    ret = curl_easy_setopt(easy, CURLOPT_WRITEDATA, fp);
-    if (ret) ERR("%s", curl_easy_strerror(ret));
+    if (memory) {
+        ret = curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, _file_download_write_mem);
+        if (ret) ERR("%s", curl_easy_strerror(ret));
+        ret = curl_easy_setopt(easy, CURLOPT_WRITEDATA, fd);
+        if (ret) ERR("%s", curl_easy_strerror(ret));
+    } else {
+        ret = curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, NULL);
+        if (ret) ERR("%s", curl_easy_strerror(ret));
+        ret = curl_easy_setopt(easy, CURLOPT_WRITEDATA, fp);
+        if (ret) ERR("%s", curl_easy_strerror(ret));
+    }
     //ret = curl_easy_setopt(easy, CURLOPT_PROGRESSFUNCTION, _curl_progress_func);
     ret = curl_easy_setopt(easy, CURLOPT_PROGRESSDATA, NULL);
     if (ret) ERR("%s", curl_easy_strerror(ret));
-    //ret = curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, _curl_header_func);
-    ret = curl_easy_setopt(easy, CURLOPT_HEADERDATA, NULL);
+    ret = curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, _file_download_header);
+    if (ret) ERR("%s", curl_easy_strerror(ret));
+    ret = curl_easy_setopt(easy, CURLOPT_HEADERDATA, fd);
     if (ret) ERR("%s", curl_easy_strerror(ret));
+    if (headers) {
+        ret = curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+        if (ret) ERR("%s", curl_easy_strerror(ret));
+    }
     ret = curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, timeout);
     if (ret) ERR("%s", curl_easy_strerror(ret));
     ret = curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1);
     if (ret) ERR("%s", curl_easy_strerror(ret));
+    // Wait for an existing connection to multiplex on instead of
+    // opening a new one for every tile.
+    ret = curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+    if (ret) ERR("%s", curl_easy_strerror(ret));
+    ret = curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    if (ret) ERR("%s", curl_easy_strerror(ret));
+    if (curlsh) {
+        ret = curl_easy_setopt(easy, CURLOPT_SHARE, curlsh);
+        if (ret) ERR("%s", curl_easy_strerror(ret));
+    }
 
     code = curl_multi_add_handle(curlm, easy);
     if (code != CURLM_OK) {
         ERR("curl multi add handle failed: %s", curl_multi_strerror(code));
-        curl_easy_cleanup(easy);
+        _file_download_easy_put(easy);
+        if (fp) fclose(fp);
+        if (headers) curl_slist_free_all(headers);
+        _tile_meta_clear(&fd->meta);
+        free(fd);
         return NULL;
     }
 
-    FileDownloader *fd = malloc(sizeof(FileDownloader));
     fd->curl = easy;
+    fd->memory = memory;
     fd->fp = fp;
     fd->url = strdup(src);
     fd->filename = strdup(dst);
+    fd->key = *key;
     fd->callback_end = callback_end;
     fd->data_end = data_end;
     LOG("%s", fd->url);
@@ -369,12 +1028,16 @@ _file_download_destroy(FileDownloader *fd)
         if (code != CURLM_OK)
             ERR("curl multi remove handle failed: %s",
                     curl_multi_strerror(code));
-        curl_easy_cleanup(fd->curl);
+        _file_download_easy_put(fd->curl);
     }
     if (fd->fp)fclose(fd->fp);
+    if (fd->headers) curl_slist_free_all(fd->headers);
+    _tile_meta_clear(&fd->meta);
+    free(fd->buf);
     free(fd->filename);
     free(fd->url);
     nemolist_remove(&fd->link);
+    free(fd);
 }
 
 static void
@@ -386,7 +1049,16 @@ _file_download_cleanup()
     }
     nemolist_empty(&file_download_lists);
 
+    unsigned int opened, reused;
+    _file_download_stats_get(&opened, &reused);
+    LOG("connections opened: %u, reused: %u", opened, reused);
+
+    while (curl_pool_cnt > 0) {
+        curl_pool_cnt--;
+        curl_easy_cleanup(curl_pool[curl_pool_cnt]);
+    }
     if (curlm) curl_multi_cleanup(curlm);
+    if (curlsh) curl_share_cleanup(curlsh);
     curl_global_cleanup();
 }
 
@@ -450,11 +1122,11 @@ _file_download_do()
             ERR("curl multi perform failed: %s", curl_multi_strerror(code));
             break;
         }
+        _file_download_read_info();
         if (!still_running) {
             LOG("Multi perform ended");
             break;
         }
-        _file_download_read_info();
     }
 }
 
@@ -478,15 +1150,7 @@ _map_tilecoord_to_region(unsigned int zoom,
                          int x, int y,
                          double *lon, double *lat)
 {
-    double size = pow(2, zoom) * tileitem_size;
-
-    LOG("%lf", size);
-    // Referece: http://wiki.openstreetmap.org/wiki/Slippy_map_tilenames
-    if (lon) *lon = (x / size * 360.0) - 180;
-    if (lat) {
-        double n = M_PI - (2.0 * M_PI * y / size);
-        *lat = 180.0 / M_PI *atan(0.5 * (exp(n) - exp(-n)));
-    }
+    projection_pixel_to_lonlat(zoom, tileitem_size, x, y, lon, lat);
 }
 
 static void
@@ -494,37 +1158,368 @@ _map_region_to_tilecoord(double zoom,
                          double lon, double lat,
                          int *x, int *y)
 {
+    double px, py;
+    projection_lonlat_to_pixel(zoom, tileitem_size, lon, lat, &px, &py);
+    if (x) *x = floor(px);
+    if (y) *y = floor(py);
+}
+
+/*************************************/
+/** Overlay **/
+/*************************************/
+// Points (vehicle positions, GPS tracks) drawn on top of the tiles.
+// They are kept in normalized world coordinates ([0, 1) at zoom 0), sorted
+// by their Z-order (Morton) key at OVERLAY_LEVEL_MAX. The points of a
+// tile-aligned cell at any zoom level up to that are then one range of
+// the array, so a frame only visits the cells inside the viewport at the
+// current zoom and the points they hold.
+#define OVERLAY_LEVEL_MAX 16
+#define OVERLAY_STYLE_MAX 8
+// Level of detail: a cell never draws more points than this many per
+// screen pixel it covers.
+#define OVERLAY_LOD_DENSITY 1.0
+#define OVERLAY_BATCH 4096
+
+typedef struct _OverlayStyle OverlayStyle;
+struct _OverlayStyle {
+    double r, g, b, a;
+    double size;            // square marker width in pixels
+};
+
+typedef struct _OverlayPoint OverlayPoint;
+struct _OverlayPoint {
+    uint32_t key;           // Morton code of the cell at OVERLAY_LEVEL_MAX
+    unsigned char style;
+    double x, y;
+};
+
+typedef struct _Overlay Overlay;
+struct _Overlay {
+    OverlayPoint *pts;
+    unsigned int cnt, alloc;
+    bool sorted;
+    OverlayStyle styles[OVERLAY_STYLE_MAX];
+    unsigned int style_cnt;
+
+    // Per frame scratch: screen positions grouped by style
+    double *px[OVERLAY_STYLE_MAX], *py[OVERLAY_STYLE_MAX];
+    unsigned int pcnt[OVERLAY_STYLE_MAX];
+    unsigned int palloc;
+    // Occupied screen pixels, to skip points hidden by a previous one
+    unsigned char *occupied;
+    int ow, oh;
+};
+
+static Overlay *
+_overlay_create()
+{
+    Overlay *ov = calloc(sizeof(Overlay), 1);
+    ov->sorted = true;
+    return ov;
+}
+
+static void
+_overlay_destroy(Overlay *ov)
+{
+    RET_IF(!ov);
+    unsigned int i;
+    for (i = 0 ; i < OVERLAY_STYLE_MAX ; i++) {
+        free(ov->px[i]);
+        free(ov->py[i]);
+    }
+    free(ov->occupied);
+    free(ov->pts);
+    free(ov);
+}
+
+// Returns the style index or -1
+static int
+_overlay_add_style(Overlay *ov, double r, double g, double b, double a, double size)
+{
+    RET_IF(!ov, -1);
+    RET_IF(ov->style_cnt >= OVERLAY_STYLE_MAX, -1);
+    OverlayStyle *st = &ov->styles[ov->style_cnt];
+    st->r = r;
+    st->g = g;
+    st->b = b;
+    st->a = a;
+    st->size = size;
+    return ov->style_cnt++;
+}
+
+// Interleaves the bits of x (even) and y (odd)
+static uint32_t
+_overlay_morton(uint32_t x, uint32_t y)
+{
+    x &= 0xffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    y &= 0xffff;
+    y = (y | (y << 8)) & 0x00ff00ff;
+    y = (y | (y << 4)) & 0x0f0f0f0f;
+    y = (y | (y << 2)) & 0x33333333;
+    y = (y | (y << 1)) & 0x55555555;
+    return x | (y << 1);
+}
+
+static int
+_overlay_point_cmp(const void *a, const void *b)
+{
+    uint32_t ka = ((const OverlayPoint *)a)->key;
+    uint32_t kb = ((const OverlayPoint *)b)->key;
+    return (ka > kb) - (ka < kb);
+}
+
+// First point whose key is not below key
+static unsigned int
+_overlay_lower_bound(Overlay *ov, uint64_t key)
+{
+    unsigned int lo = 0, hi = ov->cnt;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (ov->pts[mid].key < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void
+_overlay_add_points(Overlay *ov, const double *lon, const double *lat, unsigned int num, int style)
+{
+    RET_IF(!ov);
+    RET_IF(style < 0 || style >= ov->style_cnt);
+
+    int cells = 1 << OVERLAY_LEVEL_MAX;
+    double x[OVERLAY_BATCH], y[OVERLAY_BATCH];
+    unsigned int i, j, n;
+    for (i = 0 ; i < num ; i += n) {
+        n = num - i < OVERLAY_BATCH ? num - i : OVERLAY_BATCH;
+        projection_lonlat_to_pixel_batch(0, 1, lon + i, lat + i, x, y, n);
+        for (j = 0 ; j < n ; j++) {
+            int cx = x[j] * cells;
+            int cy = y[j] * cells;
+            if (cx < 0 || cx >= cells) continue;
+            if (cy < 0 || cy >= cells) continue;
+            if (ov->cnt >= ov->alloc) {
+                ov->alloc = ov->alloc ? ov->alloc * 2 : 1024;
+                ov->pts = realloc(ov->pts, sizeof(OverlayPoint) * ov->alloc);
+            }
+            OverlayPoint *pt = &ov->pts[ov->cnt++];
+            pt->key = _overlay_morton(cx, cy);
+            pt->style = style;
+            pt->x = x[j];
+            pt->y = y[j];
+        }
+    }
+    ov->sorted = false;
+}
+
+// Draws the points inside the w x h viewport whose left top is (ox, oy)
+// in world pixels at zoom. Returns the number of points drawn.
+static unsigned int
+_overlay_draw(Overlay *ov, cairo_t *cr, double zoom, double ox, double oy, int w, int h)
+{
+    RET_IF(!ov, 0);
+    RET_IF(!cr, 0);
+    TRACE_FUNC();
+
+    if (!ov->sorted) {
+        qsort(ov->pts, ov->cnt, sizeof(OverlayPoint), _overlay_point_cmp);
+        ov->sorted = true;
+    }
+
+    // Cells of the current zoom level: about a tile on screen each
+    int level = floor(zoom);
+    if (level < 0) level = 0;
+    if (level > OVERLAY_LEVEL_MAX) level = OVERLAY_LEVEL_MAX;
+    int cells = 1 << level;
+    int shift = 2 * (OVERLAY_LEVEL_MAX - level);
     double size = pow(2, zoom) * tileitem_size;
+    double cell_px = size / cells;
+    unsigned int i, j;
+
+    if (ov->ow != w || ov->oh != h) {
+        free(ov->occupied);
+        ov->occupied = malloc(w * h);
+        ov->ow = w;
+        ov->oh = h;
+    }
+    memset(ov->occupied, 0, w * h);
+    memset(ov->pcnt, 0, sizeof(ov->pcnt));
+
+    int cx0 = floor(ox / cell_px);
+    int cy0 = floor(oy / cell_px);
+    int cx1 = floor((ox + w) / cell_px);
+    int cy1 = floor((oy + h) / cell_px);
+    if (cx0 < 0) cx0 = 0;
+    if (cy0 < 0) cy0 = 0;
+    if (cx1 >= cells) cx1 = cells - 1;
+    if (cy1 >= cells) cy1 = cells - 1;
+
+    // Level of detail: at low zoom a cell covers few pixels, so only a
+    // stride of its points is visited.
+    double limit = cell_px * cell_px * OVERLAY_LOD_DENSITY;
+    if (limit < 1) limit = 1;
+
+    int cx, cy;
+    for (cy = cy0 ; cy <= cy1 ; cy++) {
+        for (cx = cx0 ; cx <= cx1 ; cx++) {
+            uint64_t key = (uint64_t)_overlay_morton(cx, cy) << shift;
+            unsigned int first = _overlay_lower_bound(ov, key);
+            unsigned int last = _overlay_lower_bound(ov, key + (1ULL << shift));
+            unsigned int cnt = last - first;
+            if (!cnt) continue;
+
+            unsigned int step = 1;
+            if (cnt > limit) step = cnt / limit;
+
+            for (i = first ; i < last ; i += step) {
+                OverlayPoint *pt = &ov->pts[i];
+                double x = pt->x * size - ox;
+                double y = pt->y * size - oy;
+                if (x < 0 || x >= w || y < 0 || y >= h) continue;
+
+                int off = (int)y * w + (int)x;
+                if (ov->occupied[off]) continue;
+                ov->occupied[off] = 1;
+
+                unsigned char st = pt->style;
+                if (ov->pcnt[st] >= ov->palloc) {
+                    ov->palloc = ov->palloc ? ov->palloc * 2 : 1024;
+                    for (j = 0 ; j < OVERLAY_STYLE_MAX ; j++) {
+                        ov->px[j] = realloc(ov->px[j], sizeof(double) * ov->palloc);
+                        ov->py[j] = realloc(ov->py[j], sizeof(double) * ov->palloc);
+                    }
+                }
+                ov->px[st][ov->pcnt[st]] = x;
+                ov->py[st][ov->pcnt[st]] = y;
+                ov->pcnt[st]++;
+            }
+        }
+    }
 
-    if (x) *x = floor((lon + 180.0) / 360.0 * size);
-    if (y) {
-        *y = floor((1.0 - log(tan(lat * M_PI / 180.0)
-                              + (1.0 / cos(lat * M_PI / 180.0)))
-                           / M_PI) / 2.0 * size);
+    // One path and one fill per style
+    unsigned int drawn = 0;
+    cairo_save(cr);
+    for (j = 0 ; j < ov->style_cnt ; j++) {
+        if (!ov->pcnt[j]) continue;
+        OverlayStyle *st = &ov->styles[j];
+        double half = st->size / 2;
+        cairo_new_path(cr);
+        for (i = 0 ; i < ov->pcnt[j] ; i++) {
+            cairo_rectangle(cr, ov->px[j][i] - half, ov->py[j][i] - half,
+                    st->size, st->size);
+        }
+        cairo_set_source_rgba(cr, st->r, st->g, st->b, st->a);
+        cairo_fill(cr);
+        drawn += ov->pcnt[j];
+    }
+    cairo_restore(cr);
+    return drawn;
+}
+
+// Loads "lat,lon" lines (e.g. a GPS log) into the overlay
+static bool
+_overlay_load(Overlay *ov, const char *file, int style)
+{
+    RET_IF(!ov, false);
+    RET_IF(!file, false);
+
+    int i, line_len = 0;
+    char **line = _file_load(file, &line_len);
+    if (!line) return false;
+
+    double *lon = malloc(sizeof(double) * line_len);
+    double *lat = malloc(sizeof(double) * line_len);
+    unsigned int num = 0;
+    for (i = 0 ; i < line_len ; i++) {
+        if (sscanf(line[i], "%lf,%lf", &lat[num], &lon[num]) == 2) num++;
+        free(line[i]);
     }
+    free(line);
+
+    _overlay_add_points(ov, lon, lat, num, style);
+    LOG("%u points loaded from %s", num, file);
+    free(lon);
+    free(lat);
+    return true;
 }
 
+typedef struct _MapView MapView;
+struct _MapView {
+    View *view;
+    int w, h;
+    double zoom;
+    double ox, oy;          // left, top of the window in the world pixel
+    Overlay *ov;
+    struct nemolist tiles;  // ImageData
+};
+
 typedef struct _ImageData {
     View *view;
-    cairo_t *cr;
+    char *filename;
+    TileKey key;
     int ux, uy;
+    bool dirty;             // available but not drawn yet
+    struct nemolist link;
 } ImageData;
 
 static void
 _img_downloaded(FileDownloader *fd, const char *filename, void *data)
 {
-    //ImageData *id = data;
-    //Image *img = image_create(filename);
-    //LOG("Image downloaded: %s, %p", filename, img);
-    //cairo_set_source_surface(id->cr, image_get_surface(img), id->ux, id->uy);
-    //view_update(id->view);
-    //free(id);
+    ImageData *id = data;
+    id->dirty = true;
+    // Coalesced by the view into one redraw per compositor frame
+    view_request_frame(id->view);
 }
 
-int main()
+// Draws only the tiles which became available since the last frame, and
+// the overlay clipped to them.
+static void
+_map_draw(View *view, void *data)
 {
-    cairo_t *cr;
+    TRACE_FUNC();
+    MapView *map = data;
+    cairo_t *cr = view_get_cairo(view);
+    bool drawn = false;
+
+    cairo_new_path(cr);
+    ImageData *id;
+    nemolist_for_each(id, &map->tiles, link) {
+        if (!id->dirty) continue;
+        cairo_surface_t *surface = _tile_cache_get(&id->key);
+        if (!surface && _file_exist(id->filename)) {
+            surface = cairo_image_surface_create_from_png(id->filename);
+            if (cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS) {
+                _tile_cache_put(&id->key, surface);
+            } else {
+                cairo_surface_destroy(surface);
+                surface = NULL;
+            }
+        }
+        if (!surface) continue;
+        id->dirty = false;
+
+        cairo_set_source_surface(cr, surface, id->ux, id->uy);
+        cairo_paint(cr);
+        view_damage(view, id->ux, id->uy, tileitem_size, tileitem_size);
+        cairo_rectangle(cr, id->ux, id->uy, tileitem_size, tileitem_size);
+        drawn = true;
+    }
 
+    if (map->ov && drawn) {
+        cairo_save(cr);
+        cairo_clip(cr);
+        _overlay_draw(map->ov, cr, map->zoom, map->ox, map->oy, map->w, map->h);
+        cairo_restore(cr);
+    }
+    cairo_new_path(cr);
+}
+
+int main()
+{
     int w = 600, h = 600;
 
     // Set default download path
@@ -537,6 +1532,8 @@ int main()
         return -1;
     }
     _file_download_init();
+    _tile_cache_init();
+    _tile_writer_init();
 
     double zoom = 16;
     double lat = 37.3691131, lon = -122.0241857;
@@ -553,6 +1550,12 @@ int main()
     // Tile Index
     int tix, tiy;
     tix = tx/tileitem_size;
+    tiy = ty/tileitem_size;
+
+    // left, top of the window in the world pixel coordinate
+    double ox, oy;
+    ox = tix * tileitem_size - (w - tileitem_size)/2;
+    oy = tiy * tileitem_size - (h - tileitem_size)/2;
 
     // left, top position in the user coordinate (inside window)
     int ux, uy;
@@ -569,8 +1572,35 @@ int main()
     }
 
     view_init();
-    View *v = view_create(w, h, 255, 255, 255, 255);
-    cr = view_get_cairo(v);
+    // MAP_HEADLESS=<dir>: renders without a display on the fake clock and
+    // writes the frames into dir (if not empty).
+    const char *headless = getenv("MAP_HEADLESS");
+    View *v;
+    if (headless) {
+        view_clock_set_fake(true);
+        v = view_create_headless(w, h, 255, 255, 255, 255);
+        if (headless[0]) view_set_dump_dir(v, headless);
+    } else {
+        v = view_create(w, h, 255, 255, 255, 255);
+    }
+
+    MapView map;
+    memset(&map, 0, sizeof(MapView));
+    map.view = v;
+    map.w = w;
+    map.h = h;
+    map.zoom = zoom;
+    map.ox = ox;
+    map.oy = oy;
+    nemolist_init(&map.tiles);
+
+    const char *overlay_file = getenv("MAP_OVERLAY");
+    if (overlay_file) {
+        map.ov = _overlay_create();
+        int style = _overlay_add_style(map.ov, 1, 0, 0, 0.8, 3);
+        _overlay_load(map.ov, overlay_file, style);
+    }
+    view_set_draw_callback(v, _map_draw, &map);
 
     // Create download list
     for ( ; (ux < w) && (tix <= (pow(2, zoom) - 1)) ; ux += tileitem_size, tix++) {
@@ -592,9 +1622,16 @@ int main()
             ImageData *id = calloc(sizeof(ImageData), 1);
             id->ux = ux;
             id->uy = uy;
-            id->cr = cr;
             id->view = v;
-            FileDownloader *fd = _file_download_create(v, url, file, 0, _img_downloaded, id);
+            id->filename = strdup(file);
+            id->key.zoom = zoom;
+            id->key.x = tix;
+            id->key.y = tiy;
+            // A stale tile is already in the cache: draw it until it is
+            // revalidated.
+            id->dirty = _file_exist(file);
+            nemolist_insert_tail(&map.tiles, &id->link);
+            FileDownloader *fd = _file_download_create(v, url, file, &id->key, 0, true, _img_downloaded, id);
 
             if (!fd) {
                 ERR("file download create failed: %s -> %s", url, file);
@@ -603,26 +1640,32 @@ int main()
             free(file);
         }
     }
+    view_request_frame(v);
 
     _file_download_do();
-#if 1
-    // Load downloaded files
-    FileDownloader *fd;
-    nemolist_for_each(fd, &file_download_lists, link) {
-         Image *img = image_create(fd->filename);
-         ImageData *id = fd->data_end;
-         LOG("%d %d", id->ux, id->uy);
-         cairo_set_source_surface(cr, image_get_surface(img), id->ux, id->uy);
-         cairo_paint(cr);
-    }
-    view_update(v);
-#endif
+    view_request_frame(v);
 
     view_do(v);
+    // Lets the pending frame callbacks run
+    if (headless) view_clock_advance(VIEW_HEADLESS_FRAME_MS * 2);
+
+    uint64_t requested, presented;
+    view_get_frame_stats(v, &requested, &presented);
+    LOG("frames: %"PRIu64" requested, %"PRIu64" presented", requested, presented);
+
     view_destroy(v);
     view_shutdown();
 
+    ImageData *id, *tmp;
+    nemolist_for_each_safe(id, tmp, &map.tiles, link) {
+        nemolist_remove(&id->link);
+        free(id->filename);
+        free(id);
+    }
+    if (map.ov) _overlay_destroy(map.ov);
     _file_download_cleanup();
+    _tile_writer_shutdown();
+    _tile_cache_shutdown();
     free(path);
 
     return 0;
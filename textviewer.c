@@ -12,6 +12,7 @@
 #include "text.h"
 #include "log.h"
 #include "util.h"
+#include "trace.h"
 
 typedef struct _Color Color;
 struct _Color
@@ -367,6 +368,7 @@ _textarea_render(TextArea *ta)
     RET_IF(!ta);
     RET_IF(!ta->surf);
     RET_IF(cairo_surface_status(ta->surf));
+    TRACE_FUNC();
 
     int i = 0;
     for (i = 0 ; i < ta->len ; i++) {
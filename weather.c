@@ -1,4 +1,8 @@
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <time.h>
 #include <json.h>
 #include <nemoattr.h>
 
@@ -15,6 +19,7 @@
 #include "talehelper.h"
 
 #include "util.h"
+#include "threadpool.h"
 #include "nemohelper.h"
 
 typedef struct _Weather_Table Weather_Table;
@@ -25,95 +30,107 @@ struct _Weather_Table {
     const char *str;
 };
 
-Weather_Table weather_table[]=
+// Dense by OpenWeather id: a lookup is one index. Ids outside of the range
+// and path ids outside of weather_path[] fail to compile, and a repeated id
+// fails too, built with -Werror=override-init (see CMakeLists.txt). Holes
+// have id 0.
+#define WEATHER_ID_MIN 200
+#define WEATHER_ID_MAX 962
+#define WEATHER_PATH_MAX 47
+#define WEATHER_PATH_ID(id) \
+    ((id) + 0 * sizeof(char[((id) >= 1 && (id) <= WEATHER_PATH_MAX) ? 1 : -1]))
+#define WEATHER_ENTRY(id, day, night, str) \
+    [(id) - WEATHER_ID_MIN] = {id, WEATHER_PATH_ID(day), WEATHER_PATH_ID(night), str}
+
+static const Weather_Table weather_table[WEATHER_ID_MAX - WEATHER_ID_MIN + 1] =
 {
     // FIXME: thunderstorm rain image needeed
     // Thunderstorm (Rain)
-    {200, 15, 15, "thunderstorm with light rain"},
-    {201, 16, 16, "thunderstorm with rain"},
-    {202, 27, 27, "thunderstorm with heavy rain"},
+    WEATHER_ENTRY(200, 15, 15, "thunderstorm with light rain"),
+    WEATHER_ENTRY(201, 16, 16, "thunderstorm with rain"),
+    WEATHER_ENTRY(202, 27, 27, "thunderstorm with heavy rain"),
     // Thunderstorm
-    {210, 15, 15, "light thunderstorm"},
-    {211, 16, 16, "thunderstorm"},
-    {212, 27, 27, "heay thunderstorm"},
-    {221, 27, 27, "ragged thunderstorm"},
+    WEATHER_ENTRY(210, 15, 15, "light thunderstorm"),
+    WEATHER_ENTRY(211, 16, 16, "thunderstorm"),
+    WEATHER_ENTRY(212, 27, 27, "heay thunderstorm"),
+    WEATHER_ENTRY(221, 27, 27, "ragged thunderstorm"),
     // FIXME: thunderstorm rain image needeed
     // Thunderstorm (drizzle)
-    {230, 15, 15, "thuderstorm with light drizzle"},
-    {231, 16, 16, "thuderstorm with drizzle"},
-    {232, 27, 27, "thuderstorm with heavy drizzle"},
-    {300, 17, 17, "light intensity drizzle"},
+    WEATHER_ENTRY(230, 15, 15, "thuderstorm with light drizzle"),
+    WEATHER_ENTRY(231, 16, 16, "thuderstorm with drizzle"),
+    WEATHER_ENTRY(232, 27, 27, "thuderstorm with heavy drizzle"),
+    WEATHER_ENTRY(300, 17, 17, "light intensity drizzle"),
     // Rain (drizzle)
-    {301, 17, 17, "drizzle"},
-    {302, 18, 18, "heavy intensity drizzle"},
-    {310, 17, 17, "light intensity drizzle rain"},
-    {311, 17, 17, "drizzle rain"},
-    {312, 18, 18, "heavy intensity drizzle rain"},
-    {313, 17, 17, "shower rain and drizzle"},
-    {314, 18, 18, "heavy shower rain and drizzle"},
-    {321, 17, 17, "shower drizzle"},
+    WEATHER_ENTRY(301, 17, 17, "drizzle"),
+    WEATHER_ENTRY(302, 18, 18, "heavy intensity drizzle"),
+    WEATHER_ENTRY(310, 17, 17, "light intensity drizzle rain"),
+    WEATHER_ENTRY(311, 17, 17, "drizzle rain"),
+    WEATHER_ENTRY(312, 18, 18, "heavy intensity drizzle rain"),
+    WEATHER_ENTRY(313, 17, 17, "shower rain and drizzle"),
+    WEATHER_ENTRY(314, 18, 18, "heavy shower rain and drizzle"),
+    WEATHER_ENTRY(321, 17, 17, "shower drizzle"),
     // Rain
-    {500, 17, 17, "light rain"},
-    {501, 17, 17, "moderate rain"},
-    {502, 18, 18, "heavy intensity rain"},
-    {503, 18, 18, "very heavy rain"},
-    {504, 18, 18, "extreme rain"},
-    {511, 17, 17, "freezing rain"},
-    {520, 17, 17, "light intensity shower rain"},
-    {521, 17, 17, "shower rain"},
-    {522, 18, 18, "heavy intensity shower rain"},
-    {531, 18, 18, "ragged shower rain"},
+    WEATHER_ENTRY(500, 17, 17, "light rain"),
+    WEATHER_ENTRY(501, 17, 17, "moderate rain"),
+    WEATHER_ENTRY(502, 18, 18, "heavy intensity rain"),
+    WEATHER_ENTRY(503, 18, 18, "very heavy rain"),
+    WEATHER_ENTRY(504, 18, 18, "extreme rain"),
+    WEATHER_ENTRY(511, 17, 17, "freezing rain"),
+    WEATHER_ENTRY(520, 17, 17, "light intensity shower rain"),
+    WEATHER_ENTRY(521, 17, 17, "shower rain"),
+    WEATHER_ENTRY(522, 18, 18, "heavy intensity shower rain"),
+    WEATHER_ENTRY(531, 18, 18, "ragged shower rain"),
     // snow
     // FIXME: rain and show
-    {600, 21, 21, "light snow"},
-    {601, 22, 22, "snow"},
-    {602, 23, 23, "heavy snow"},
-    {611, 21, 21, "sleet"},
-    {612, 21, 21, "shower sleet"},
-    {615, 21, 21, "light rain and snow"},
-    {616, 21, 21, "rain and snow"},
-    {620, 21, 21, "light shower snow"},
-    {621, 22, 22, "shower snow"},
-    {622, 23, 23, "heavy shower snow"},
+    WEATHER_ENTRY(600, 21, 21, "light snow"),
+    WEATHER_ENTRY(601, 22, 22, "snow"),
+    WEATHER_ENTRY(602, 23, 23, "heavy snow"),
+    WEATHER_ENTRY(611, 21, 21, "sleet"),
+    WEATHER_ENTRY(612, 21, 21, "shower sleet"),
+    WEATHER_ENTRY(615, 21, 21, "light rain and snow"),
+    WEATHER_ENTRY(616, 21, 21, "rain and snow"),
+    WEATHER_ENTRY(620, 21, 21, "light shower snow"),
+    WEATHER_ENTRY(621, 22, 22, "shower snow"),
+    WEATHER_ENTRY(622, 23, 23, "heavy shower snow"),
     // Atmosphere
     // FIXME: sand, dust, whilrs, ash, squalls, tornado
-    {701, 10, 11, "mist"},  // visibility 1 ~ 2KM (warter droplets)
-    {711, 13, 13, "smoke"}, // ? (air pollutants)
-    {721, 10, 11, "haze"},  // 2 ~ 5KM  (air pollutants)
-    {731, 13, 13, "sand,dust whirls"},
-    {741, 13, 13, "fog"},   // < 1KM (water droplets)
-    {751, 13, 13, "sand"},
-    {761, 13, 13, "dust"},
-    {762, 13, 13, "volcanic ash"},
-    {771, 13, 13, "squalls"},
-    {781, 13, 13, "tornado"},
+    WEATHER_ENTRY(701, 10, 11, "mist"),  // visibility 1 ~ 2KM (warter droplets)
+    WEATHER_ENTRY(711, 13, 13, "smoke"), // ? (air pollutants)
+    WEATHER_ENTRY(721, 10, 11, "haze"),  // 2 ~ 5KM  (air pollutants)
+    WEATHER_ENTRY(731, 13, 13, "sand,dust whirls"),
+    WEATHER_ENTRY(741, 13, 13, "fog"),   // < 1KM (water droplets)
+    WEATHER_ENTRY(751, 13, 13, "sand"),
+    WEATHER_ENTRY(761, 13, 13, "dust"),
+    WEATHER_ENTRY(762, 13, 13, "volcanic ash"),
+    WEATHER_ENTRY(771, 13, 13, "squalls"),
+    WEATHER_ENTRY(781, 13, 13, "tornado"),
     // Clouds
-    {800, 2, 3,   "clear sky"},
-    {801, 8, 9,   "few cloud"},        // (1/8)
-    {802, 14, 14, "scattered clouds"}, // (4/8)
-    {803, 25, 25, "broken clouds"},    // (cover between 5/8th ~ 7/8th clouds of the sky.)
-    {804, 25, 25, "overcast clouds"},  // (8/8)
+    WEATHER_ENTRY(800, 2, 3, "clear sky"),
+    WEATHER_ENTRY(801, 8, 9, "few cloud"),        // (1/8)
+    WEATHER_ENTRY(802, 14, 14, "scattered clouds"), // (4/8)
+    WEATHER_ENTRY(803, 25, 25, "broken clouds"),    // (cover between 5/8th ~ 7/8th clouds of the sky.)
+    WEATHER_ENTRY(804, 25, 25, "overcast clouds"),  // (8/8)
     // Extreme // FIXME
-    {900, 6, 6, "tornado"},
-    {901, 6, 6, "tropical storm"},
-    {902, 6, 6, "hurricane"},
-    {903, 45, 45, "cold"},
-    {904, 45, 45, "hot"},
-    {905, 6, 6, "windy"},
-    {906, 24, 24, "hail"},
+    WEATHER_ENTRY(900, 6, 6, "tornado"),
+    WEATHER_ENTRY(901, 6, 6, "tropical storm"),
+    WEATHER_ENTRY(902, 6, 6, "hurricane"),
+    WEATHER_ENTRY(903, 45, 45, "cold"),
+    WEATHER_ENTRY(904, 45, 45, "hot"),
+    WEATHER_ENTRY(905, 6, 6, "windy"),
+    WEATHER_ENTRY(906, 24, 24, "hail"),
     // Additional
-    {951, 45, 45, "calm"},
-    {952, 45, 45, "light breeze"},
-    {953, 45, 45, "gentle breeze"},
-    {954, 45, 45, "moderate breeze"},
-    {955, 45, 45, "fresh breeze"},
-    {956, 45, 45, "strong breeze"},
-    {957, 45, 45, "high wind,near gale"},
-    {958, 45, 45, "gale"},
-    {959, 45, 45, "severe storm"},
-    {960, 45, 45, "storm"},
-    {961, 45, 45, "violent storm"},
-    {962, 45, 45, "hurricane"}
+    WEATHER_ENTRY(951, 45, 45, "calm"),
+    WEATHER_ENTRY(952, 45, 45, "light breeze"),
+    WEATHER_ENTRY(953, 45, 45, "gentle breeze"),
+    WEATHER_ENTRY(954, 45, 45, "moderate breeze"),
+    WEATHER_ENTRY(955, 45, 45, "fresh breeze"),
+    WEATHER_ENTRY(956, 45, 45, "strong breeze"),
+    WEATHER_ENTRY(957, 45, 45, "high wind,near gale"),
+    WEATHER_ENTRY(958, 45, 45, "gale"),
+    WEATHER_ENTRY(959, 45, 45, "severe storm"),
+    WEATHER_ENTRY(960, 45, 45, "storm"),
+    WEATHER_ENTRY(961, 45, 45, "violent storm"),
+    WEATHER_ENTRY(962, 45, 45, "hurricane")
 };
 
 typedef struct _Weather_Path Weather_Path;
@@ -774,95 +791,273 @@ Weather_Path weather_path[]=
 };
 
 /****************************
- * Json Parser
+ * Weather Icon
  * **************************/
+// weather_path[] is parsed once, on first use, into absolute move/line/curve
+// commands: showing or swapping an icon only replays them into a nemopath.
+// Relative, horizontal, vertical and smooth commands are resolved while
+// parsing.
+
+typedef enum {
+    WEATHER_ICON_MOVE,      // x y
+    WEATHER_ICON_LINE,      // x y
+    WEATHER_ICON_CURVE,     // x1 y1 x2 y2 x y
+    WEATHER_ICON_CLOSE,
+} WeatherIconOp;
+
+typedef struct _WeatherIcon WeatherIcon;
+struct _WeatherIcon {
+    bool parsed;
+    unsigned int op_cnt, coord_cnt;
+    uint8_t *ops;
+    float *coords;
+    double x, y, w, h;      // bounds, control points included
+};
+
+#define WEATHER_PATH_CNT (sizeof(weather_path)/sizeof(weather_path[0]))
+_Static_assert(WEATHER_PATH_CNT == WEATHER_PATH_MAX, "weather_table needs WEATHER_PATH_MAX");
+
+static WeatherIcon weather_icons[WEATHER_PATH_CNT];
+
+static void
+_weather_icon_add(WeatherIcon *icon, WeatherIconOp op, const double *coords, int cnt)
+{
+    icon->ops = realloc(icon->ops, sizeof(uint8_t) * (icon->op_cnt + 1));
+    icon->ops[icon->op_cnt++] = op;
+    if (!cnt) return;
+
+    icon->coords = realloc(icon->coords, sizeof(float) * (icon->coord_cnt + cnt));
+    int i;
+    for (i = 0 ; i < cnt ; i++) {
+        icon->coords[icon->coord_cnt++] = coords[i];
+    }
+}
+
 static bool
-_json_find(struct json_object *obj, const char *names, struct nemoattr *attr)
+_weather_icon_parse(WeatherIcon *icon, const char *cmd)
 {
-    bool ret = false;
-    char *_names = strdup(names);
-    char *name = strtok(_names, "/");
-
-    struct json_object_iterator it;
-    struct json_object_iterator itEnd;
-    it = json_object_iter_begin(obj);
-    itEnd = json_object_iter_end(obj);
-
-    while (!json_object_iter_equal(&it, &itEnd)) {
-        json_object *cobj = json_object_iter_peek_value(&it);
-        const char *_name = json_object_iter_peek_name(&it);
-        json_type type = json_object_get_type(cobj);
-        if (!strcmp(_name, name)) {
-            if (json_type_boolean == type) {
-                json_bool val = json_object_get_boolean(cobj);
-                nemoattr_seti(attr, val);
-                ret = true;
+    const char *p = cmd;
+    char op = 0;
+    double cx = 0, cy = 0;      // current point
+    double sx = 0, sy = 0;      // subpath start
+    double rx = 0, ry = 0;      // last control point, for smooth curves
+    bool curve = false;
+
+    while (*p) {
+        if (isspace(*p) || *p == ',') {
+            p++;
+            continue;
+        }
+        if (isalpha(*p)) {
+            op = *p++;
+            if (op == 'z' || op == 'Z') {
+                _weather_icon_add(icon, WEATHER_ICON_CLOSE, NULL, 0);
+                cx = sx;
+                cy = sy;
+                curve = false;
+            }
+            continue;
+        }
+
+        int i, cnt;
+        switch (op) {
+            case 'M': case 'm': case 'L': case 'l': cnt = 2; break;
+            case 'H': case 'h': case 'V': case 'v': cnt = 1; break;
+            case 'S': case 's': cnt = 4; break;
+            case 'C': case 'c': cnt = 6; break;
+            default:
+                ERR("unsupported path command: '%c'", op ? op : ' ');
+                return false;
+        }
+        double v[6];
+        for (i = 0 ; i < cnt ; i++) {
+            while (isspace(*p) || *p == ',') p++;
+            char *end;
+            v[i] = strtod(p, &end);
+            if (end == p) {
+                ERR("invalid path number: %.16s", p);
+                return false;
+            }
+            p = end;
+        }
+
+        bool rel = islower(op);
+        double c[6];
+        switch (op) {
+            case 'M': case 'm':
+                cx = c[0] = v[0] + (rel ? cx : 0);
+                cy = c[1] = v[1] + (rel ? cy : 0);
+                sx = cx;
+                sy = cy;
+                _weather_icon_add(icon, WEATHER_ICON_MOVE, c, 2);
+                // Further pairs are implicit line-to
+                op = rel ? 'l' : 'L';
+                curve = false;
                 break;
-            } else if (json_type_double == type) {
-                double val = json_object_get_double(cobj);
-                nemoattr_setd(attr, val);
-                ret = true;
+            case 'L': case 'l': case 'H': case 'h': case 'V': case 'v':
+                if (op == 'H' || op == 'h') {
+                    c[0] = v[0] + (rel ? cx : 0);
+                    c[1] = cy;
+                } else if (op == 'V' || op == 'v') {
+                    c[0] = cx;
+                    c[1] = v[0] + (rel ? cy : 0);
+                } else {
+                    c[0] = v[0] + (rel ? cx : 0);
+                    c[1] = v[1] + (rel ? cy : 0);
+                }
+                cx = c[0];
+                cy = c[1];
+                _weather_icon_add(icon, WEATHER_ICON_LINE, c, 2);
+                curve = false;
                 break;
-            } else if (json_type_int == type) {
-                int val = json_object_get_int(cobj);
-                nemoattr_seti(attr, val);
-                ret = true;
+            case 'S': case 's':
+                // First control point mirrors the previous curve's second one
+                c[0] = curve ? 2 * cx - rx : cx;
+                c[1] = curve ? 2 * cy - ry : cy;
+                for (i = 0 ; i < 4 ; i += 2) {
+                    c[i + 2] = v[i] + (rel ? cx : 0);
+                    c[i + 3] = v[i + 1] + (rel ? cy : 0);
+                }
+                goto curve_to;
+            case 'C': case 'c':
+                for (i = 0 ; i < 6 ; i += 2) {
+                    c[i] = v[i] + (rel ? cx : 0);
+                    c[i + 1] = v[i + 1] + (rel ? cy : 0);
+                }
+curve_to:
+                rx = c[2];
+                ry = c[3];
+                cx = c[4];
+                cy = c[5];
+                _weather_icon_add(icon, WEATHER_ICON_CURVE, c, 6);
+                curve = true;
                 break;
-            } else if (json_type_string == type) {
-                const char *val = json_object_get_string(cobj);
-                nemoattr_sets(attr, val, json_object_get_string_len(cobj));
-                ret = true;
+        }
+    }
+
+    unsigned int i;
+    double x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+    for (i = 0 ; i < icon->coord_cnt ; i += 2) {
+        double x = icon->coords[i];
+        double y = icon->coords[i + 1];
+        if (!i || x < x0) x0 = x;
+        if (!i || y < y0) y0 = y;
+        if (!i || x > x1) x1 = x;
+        if (!i || y > y1) y1 = y;
+    }
+    icon->x = x0;
+    icon->y = y0;
+    icon->w = x1 - x0;
+    icon->h = y1 - y0;
+    return true;
+}
+
+// id: weather_path id, parsed on first use and kept until exit
+static WeatherIcon *
+_weather_icon_get(int id)
+{
+    RET_IF(id < 1 || id > (int)WEATHER_PATH_CNT, NULL);
+
+    WeatherIcon *icon = &weather_icons[id - 1];
+    if (!icon->parsed) {
+        icon->parsed = true;
+        if (!_weather_icon_parse(icon, weather_path[id - 1].cmd)) {
+            ERR("weather path %d is broken", id);
+            icon->op_cnt = 0;
+        }
+    }
+    return icon;
+}
+
+// (x, y) of the icon maps to (x * scale + tx, y * scale + ty)
+static struct nemopath *
+_weather_icon_path(WeatherIcon *icon, double scale, double tx, double ty)
+{
+    struct nemopath *path = nemopath_create();
+    const float *c = icon->coords;
+    unsigned int i;
+    for (i = 0 ; i < icon->op_cnt ; i++) {
+        switch (icon->ops[i]) {
+            case WEATHER_ICON_MOVE:
+                nemopath_move_to(path, c[0] * scale + tx, c[1] * scale + ty);
+                c += 2;
+                break;
+            case WEATHER_ICON_LINE:
+                nemopath_line_to(path, c[0] * scale + tx, c[1] * scale + ty);
+                c += 2;
+                break;
+            case WEATHER_ICON_CURVE:
+                nemopath_curve_to(path,
+                        c[0] * scale + tx, c[1] * scale + ty,
+                        c[2] * scale + tx, c[3] * scale + ty,
+                        c[4] * scale + tx, c[5] * scale + ty);
+                c += 6;
+                break;
+            case WEATHER_ICON_CLOSE:
+                nemopath_close_path(path);
                 break;
-            } else if ((json_type_object == type) ||
-                        json_type_array == type) {
-                name = name + strlen(name) + 1;
-                if (json_type_object == type) {
-                    if (_json_find(cobj, name, attr)) {
-                        ret = true;
-                        break;
-                    }
-                } else {
-                    int i = 0;
-                    for (i = 0; i < json_object_array_length(cobj) ; i++) {
-                        struct json_object *ccobj;
-                        ccobj = json_object_array_get_idx(cobj, i);
-                        if (_json_find(ccobj, name, attr)) {
-                            ret = true;
-                            break;
-                        }
-                    }
-                    if (ret) break;
-                }
-            } else {
-                ERR("%s have wrong json type(%d)", name, type);
-            }
         }
-        json_object_iter_next(&it);
     }
-    free(_names);
-    return ret;
+    return path;
+}
+
+static bool
+_weather_icon_load(struct pathone *one, int id, double scale, double tx, double ty)
+{
+    WeatherIcon *icon = _weather_icon_get(id);
+    if (!icon) return false;
+    nemotale_path_use_path(one, _weather_icon_path(icon, scale, tx, ty));
+    return true;
+}
+
+static void
+_weather_icon_fini()
+{
+    unsigned int i;
+    for (i = 0 ; i < WEATHER_PATH_CNT ; i++) {
+        free(weather_icons[i].ops);
+        free(weather_icons[i].coords);
+    }
+    memset(weather_icons, 0, sizeof(weather_icons));
+}
+
+static const Weather_Table *
+_weather_table_find(int id)
+{
+    if (id < WEATHER_ID_MIN || id > WEATHER_ID_MAX) return NULL;
+    const Weather_Table *wt = &weather_table[id - WEATHER_ID_MIN];
+    return wt->id ? wt : NULL;
 }
 
 /****************************
  * Open Weather
  * **************************/
 
-const char *openweather_url_prefix = "api.openweathermap.org/data/2.5/weather?";
+#define WEATHER_CACHE_MIN_TTL (10 * 60)
+
+const char *openweather_server = "api.openweathermap.org";
+const char *openweather_url_path = "/data/2.5/weather?";
+const char *openweather_group_path = "/data/2.5/group?id=";
 
 static char *
 _openweather_url_get(const char *city, const char *country, int cityid, double lat, double lon)
 {
+    // OPENWEATHER_SERVER (e.g. http://127.0.0.1:8000) redirects every
+    // request to one local stand-in server for testing.
+    const char *server = getenv("OPENWEATHER_SERVER");
+    if (!server) server = openweather_server;
+
     char *ret;
     if (city) {
         if (country) {
-            ret = _strdup_printf("%sq=%s,%s", openweather_url_prefix, city, country);
+            ret = _strdup_printf("%s%sq=%s,%s", server, openweather_url_path, city, country);
         } else {
-            ret = _strdup_printf("%sq=%s", openweather_url_prefix, city);
+            ret = _strdup_printf("%s%sq=%s", server, openweather_url_path, city);
         }
     } else if (cityid >= 0) {
-        ret = _strdup_printf("%sid=%d", openweather_url_prefix, cityid);
+        ret = _strdup_printf("%s%sid=%d", server, openweather_url_path, cityid);
     } else {
-        ret = _strdup_printf("%slat=%lf&lon=%lf", openweather_url_prefix, lat, lon);
+        ret = _strdup_printf("%s%slat=%lf&lon=%lf", server, openweather_url_path, lat, lon);
     }
     return ret;
 }
@@ -920,9 +1115,9 @@ _tale_event(struct nemotale *tale, struct talenode *node, uint32_t type, struct
 typedef struct _OpenWeather OpenWeather;
 struct _OpenWeather {
     Context *ctx;
-    size_t json_size;
-    char *json;
+    JsonStream *stream;     // fed while the response arrives
 
+    int cityid;             // id
     int datetime;           // UNIX UTC
     char *city;             // name:             City name
     double lat, lon;        // coord/lat, coord/lon
@@ -945,129 +1140,467 @@ struct _OpenWeather {
     double snow;            // snow/3h:         mm for last 3 hours
 };
 
-static void
-_parse_openweather(OpenWeather *ow)
+static const JsonField openweather_fields[] = {
+    JSON_FIELD("id", JSON_FIELD_INT, OpenWeather, cityid),
+    JSON_FIELD("name", JSON_FIELD_STRING, OpenWeather, city),
+    JSON_FIELD("dt", JSON_FIELD_INT, OpenWeather, datetime),
+    JSON_FIELD("coord/lat", JSON_FIELD_DOUBLE, OpenWeather, lat),
+    JSON_FIELD("coord/lon", JSON_FIELD_DOUBLE, OpenWeather, lon),
+    JSON_FIELD("sys/country", JSON_FIELD_STRING, OpenWeather, country),
+    JSON_FIELD("sys/sunrise", JSON_FIELD_INT, OpenWeather, sunrise),
+    JSON_FIELD("sys/sunset", JSON_FIELD_INT, OpenWeather, sunset),
+    JSON_FIELD("weather/id", JSON_FIELD_INT, OpenWeather, weather_id),
+    JSON_FIELD("weather/main", JSON_FIELD_STRING, OpenWeather, weather_main),
+    JSON_FIELD("weather/description", JSON_FIELD_STRING, OpenWeather, weather_desc),
+    JSON_FIELD("main/temp", JSON_FIELD_DOUBLE, OpenWeather, temp),
+    JSON_FIELD("main/humidity", JSON_FIELD_INT, OpenWeather, humidity),
+    JSON_FIELD("main/pressure", JSON_FIELD_DOUBLE, OpenWeather, pressure),
+    JSON_FIELD("main/grnd_level", JSON_FIELD_DOUBLE, OpenWeather, pressure_ground),
+    JSON_FIELD("main/sea_level", JSON_FIELD_DOUBLE, OpenWeather, pressure_sea),
+    JSON_FIELD("wind/speed", JSON_FIELD_DOUBLE, OpenWeather, wind_speed),
+    JSON_FIELD("wind/deg", JSON_FIELD_DOUBLE, OpenWeather, wind_degree),
+    JSON_FIELD("clouds/all", JSON_FIELD_DOUBLE, OpenWeather, cloud),
+    JSON_FIELD("rain/3h", JSON_FIELD_DOUBLE, OpenWeather, rain),
+    JSON_FIELD("snow/3h", JSON_FIELD_DOUBLE, OpenWeather, snow),
+};
+
+// Compiled on the main thread before any worker runs it
+static JsonQuery *
+_openweather_query()
 {
-    struct json_object *jso = json_tokener_parse(ow->json);
-    struct nemoattr attr;
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "name", &attr)) {
-        ow->city = strdup(nemoattr_gets(&attr));
-    }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "dt", &attr)) {
-        ow->datetime = nemoattr_geti(&attr);
+    static JsonQuery *query;
+    if (!query) {
+        query = json_query_compile(openweather_fields,
+                sizeof(openweather_fields)/sizeof(openweather_fields[0]));
     }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "coord/lat", &attr)) {
-        ow->lat = nemoattr_getd(&attr);
-    }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "coord/lon", &attr)) {
-        ow->lon = nemoattr_getd(&attr);
-    }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "sys/country", &attr)) {
-        ow->country = strdup(nemoattr_gets(&attr));
-    }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "sys/sunrise", &attr)) {
-        ow->sunrise = nemoattr_geti(&attr);
-    }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "sys/sunset", &attr)) {
-        ow->sunset = nemoattr_geti(&attr);
-    }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "weather/id", &attr)) {
-        ow->weather_id = nemoattr_geti(&attr);
-    }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "weather/main", &attr)) {
-        ow->weather_main = strdup(nemoattr_gets(&attr));
+    return query;
+}
+
+static void
+_parse_openweather(OpenWeather *ow, struct json_object *jso)
+{
+    json_query_run(_openweather_query(), jso, ow);
+    json_object_put(jso);
+}
+
+static void
+_openweather_fini(OpenWeather *ow)
+{
+    free(ow->city);
+    free(ow->country);
+    free(ow->weather_main);
+    free(ow->weather_desc);
+}
+
+static void
+_load_weather_text(struct pathone *one, const char *str)
+{
+    if (!one || !str) return;
+    nemotale_path_load_text(one, str, strlen(str));
+}
+
+static void
+_load_weather_view(OpenWeather *ow)
+{
+    Context *ctx = ow->ctx;
+    char buf[32];
+
+    _load_weather_text(ctx->city, ow->city);
+    snprintf(buf, sizeof(buf), "%.0f", ow->temp - 273.15);
+    _load_weather_text(ctx->temp, buf);
+    snprintf(buf, sizeof(buf), "%d%%", ow->humidity);
+    _load_weather_text(ctx->humidity, buf);
+    _load_weather_text(ctx->desc, ow->weather_desc);
+
+    const Weather_Table *wt = _weather_table_find(ow->weather_id);
+    if (wt) {
+        bool day = ow->datetime >= ow->sunrise && ow->datetime < ow->sunset;
+        _weather_icon_load(ctx->weather,
+                day ? wt->match_path_day : wt->match_path_night, 1, 0, 0);
     }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "weather/description", &attr)) {
-        ow->weather_desc = strdup(nemoattr_gets(&attr));
+    nemowin_dirty(ctx->win);
+}
+
+static void
+_data_cb(NemoCon *con, char *data, size_t size, void *userdata)
+{
+    OpenWeather *ow = userdata;
+    json_stream_feed(ow->stream, data, size);
+}
+
+static void
+_end_cb(NemoCon *con, char *data, size_t size, void *userdata)
+{
+    OpenWeather *ow = userdata;
+    struct json_object *jso = json_stream_finish(ow->stream);
+    json_stream_destroy(ow->stream);
+    ow->stream = NULL;
+    if (!jso) {
+        const char *err = nemocon_get_error(con);
+        ERR("no weather received: %s", err ? err : "invalid json");
+        free(ow);
+        return;
     }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "main/temp", &attr)) {
-        ow->temp = nemoattr_getd(&attr);
+
+    _parse_openweather(ow, jso);
+    _load_weather_view(ow);
+    _openweather_fini(ow);
+    free(ow);
+}
+
+/****************************
+ * Weather Wall
+ * **************************/
+// Many cities refreshed together: group requests are fetched concurrently,
+// parsed on worker threads and compared with the previous snapshot, so that
+// only the fields which changed load their text again.
+//
+//  WEATHER_CITIES=1835848,1835847,... weather
+//
+// Every refresh logs its throughput in cities/s; OPENWEATHER_SERVER points
+// it at a local mock server answering /data/2.5/group?id=... with
+// {"cnt":N,"list":[<weather of each city>]}.
+
+#define OPENWEATHER_GROUP_MAX 20            // cities per group request
+#define WEATHER_REFRESH_MS (5 * 60 * 1000)
+#define WEATHER_PANEL_W 200
+#define WEATHER_PANEL_H 40
+#define WEATHER_ICON_SIZE 32                // weather_path is 512x512
+
+typedef struct _WeatherPanel WeatherPanel;
+struct _WeatherPanel {
+    int cityid;
+    bool valid;
+    OpenWeather cur;        // last snapshot
+    int icon_id;            // weather_path id shown
+    double x, y;
+    struct pathone *city, *temp, *desc, *icon;
+};
+
+typedef struct _WeatherWall WeatherWall;
+struct _WeatherWall {
+    struct nemotool *tool;
+    NemoWin *win;
+    ThreadPool *pool;
+    struct nemotask pool_task;
+    struct nemotimer *timer;
+
+    unsigned int panel_cnt;
+    WeatherPanel *panels;
+
+    // Refresh in progress
+    unsigned int pending;   // group requests
+    unsigned int updated;   // cities
+    unsigned int changed;   // fields
+    uint64_t start;         // ms
+};
+
+typedef struct _WeatherGroup WeatherGroup;
+struct _WeatherGroup {
+    WeatherWall *wall;
+    unsigned int first, cnt;    // panels
+    char *data;                 // response, freed by the worker
+    size_t size;
+    OpenWeather *snap;          // parsed by the worker
+    unsigned int snap_cnt;
+};
+
+static uint64_t
+_weather_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec/1000000;
+}
+
+static char *
+_openweather_group_url_get(WeatherPanel *panels, unsigned int cnt)
+{
+    const char *server = getenv("OPENWEATHER_SERVER");
+    if (!server) server = openweather_server;
+
+    char *ret = _strdup_printf("%s%s", server, openweather_group_path);
+    unsigned int i;
+    for (i = 0 ; i < cnt ; i++) {
+        char *tmp = _strdup_printf("%s%s%d", ret, i ? "," : "", panels[i].cityid);
+        free(ret);
+        ret = tmp;
     }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "main/humidity", &attr)) {
-        ow->humidity = nemoattr_geti(&attr);
+    return ret;
+}
+
+static bool
+_weather_str_changed(const char *a, const char *b)
+{
+    if (!a || !b) return a != b;
+    return !!strcmp(a, b);
+}
+
+// Takes the strings of ow, returns the number of changed fields
+static unsigned int
+_weather_panel_update(WeatherPanel *panel, OpenWeather *ow)
+{
+    OpenWeather *old = &panel->cur;
+    unsigned int changed = 0;
+    char buf[32];
+
+    if (!panel->valid || _weather_str_changed(old->city, ow->city)) {
+        _load_weather_text(panel->city, ow->city);
+        changed++;
     }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "main/pressure", &attr)) {
-        ow->pressure = nemoattr_getd(&attr);
+    if (!panel->valid || old->temp != ow->temp) {
+        snprintf(buf, sizeof(buf), "%.0f", ow->temp - 273.15);
+        _load_weather_text(panel->temp, buf);
+        changed++;
     }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "main/grnd_level", &attr)) {
-        ow->pressure_ground = nemoattr_getd(&attr);
+    if (!panel->valid || _weather_str_changed(old->weather_desc, ow->weather_desc)) {
+        _load_weather_text(panel->desc, ow->weather_desc);
+        changed++;
     }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "main/sea_level", &attr)) {
-        ow->pressure_sea = nemoattr_getd(&attr);
+
+    const Weather_Table *wt = _weather_table_find(ow->weather_id);
+    if (wt) {
+        bool day = ow->datetime >= ow->sunrise && ow->datetime < ow->sunset;
+        int id = day ? wt->match_path_day : wt->match_path_night;
+        if (id != panel->icon_id) {
+            // Centered in the icon box, on the same scale for every icon
+            WeatherIcon *icon = _weather_icon_get(id);
+            double scale = WEATHER_ICON_SIZE / 512.0;
+            double tx = panel->x + WEATHER_PANEL_W - WEATHER_ICON_SIZE;
+            double ty = panel->y;
+            if (icon && icon->op_cnt) {
+                tx += WEATHER_ICON_SIZE/2.0 - (icon->x + icon->w/2) * scale;
+                ty += WEATHER_ICON_SIZE/2.0 - (icon->y + icon->h/2) * scale;
+            }
+            if (_weather_icon_load(panel->icon, id, scale, tx, ty)) {
+                panel->icon_id = id;
+                changed++;
+            }
+        }
     }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "wind/speed", &attr)) {
-        ow->wind_speed = nemoattr_getd(&attr);
+
+    _openweather_fini(old);
+    *old = *ow;
+    panel->valid = true;
+    return changed;
+}
+
+static void *
+_weather_group_parse(void *data)
+{
+    WeatherGroup *g = data;
+    // Only read once: one arena instead of a json-c object per node
+    JsonDoc *doc = json_doc_parse(g->data, g->size);
+    free(g->data);
+    g->data = NULL;
+    if (!doc) return g;
+
+    const JsonNode *list = json_node_get(json_doc_get_root(doc), "list");
+    unsigned int i, len = json_node_array_length(list);
+    if (len) {
+        g->snap = calloc(sizeof(OpenWeather), len);
+        for (i = 0 ; i < len ; i++) {
+            json_query_run_node(_openweather_query(),
+                    json_node_array_get(list, i), &g->snap[i]);
+        }
+        g->snap_cnt = len;
     }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "wind/deg", &attr)) {
-        ow->wind_degree = nemoattr_getd(&attr);
+    json_doc_destroy(doc);
+    return g;
+}
+
+static void
+_weather_wall_group_end(WeatherWall *wall)
+{
+    if (--wall->pending) return;
+
+    uint64_t ms = _weather_now() - wall->start;
+    LOG("refresh: %u/%u cities, %u fields changed, %"PRIu64" ms, %.1f cities/s",
+            wall->updated, wall->panel_cnt, wall->changed, ms,
+            ms ? wall->updated * 1000.0 / ms : 0.0);
+}
+
+static void
+_weather_group_done(void *result, void *data)
+{
+    WeatherGroup *g = result;
+    WeatherWall *wall = g->wall;
+
+    unsigned int i, j, changed = 0;
+    for (i = 0 ; i < g->snap_cnt ; i++) {
+        OpenWeather *ow = &g->snap[i];
+        WeatherPanel *panel = NULL;
+        for (j = g->first ; j < g->first + g->cnt ; j++) {
+            if (wall->panels[j].cityid == ow->cityid) {
+                panel = &wall->panels[j];
+                break;
+            }
+        }
+        if (!panel) {
+            ERR("unexpected city: %d", ow->cityid);
+            _openweather_fini(ow);
+            continue;
+        }
+        changed += _weather_panel_update(panel, ow);
+        wall->updated++;
     }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "clouds/all", &attr)) {
-        ow->cloud = nemoattr_getd(&attr);
+    wall->changed += changed;
+    if (changed) nemowin_dirty(wall->win);
+
+    free(g->snap);
+    free(g);
+    _weather_wall_group_end(wall);
+}
+
+static void
+_weather_group_fetched(NemoCon *con, char *data, size_t size, void *userdata)
+{
+    WeatherGroup *g = userdata;
+    WeatherWall *wall = g->wall;
+
+    g->data = nemocon_steal_data(con, &g->size);
+    if (!g->data) {
+        const char *err = nemocon_get_error(con);
+        ERR("group %u-%u: %s", g->first, g->first + g->cnt - 1, err ? err : "no data");
+        free(g);
+        _weather_wall_group_end(wall);
+        return;
     }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "rain/3h", &attr)) {
-        ow->rain = nemoattr_getd(&attr);
+    Task *task = threadpool_submit(wall->pool, _weather_group_parse, g);
+    task_then(task, _weather_group_done, NULL);
+}
+
+static void
+_weather_wall_refresh(WeatherWall *wall)
+{
+    if (wall->pending) {
+        LOG("previous refresh is still running");
+        return;
     }
-    nemoattr_put(&attr);
-    memset(&attr, 0, sizeof(struct nemoattr));
-    if (_json_find(jso, "snow/3h", &attr)) {
-        ow->snow = nemoattr_getd(&attr);
+    wall->start = _weather_now();
+    wall->updated = wall->changed = 0;
+
+    unsigned int first;
+    for (first = 0 ; first < wall->panel_cnt ; first += OPENWEATHER_GROUP_MAX) {
+        WeatherGroup *g = calloc(sizeof(WeatherGroup), 1);
+        g->wall = wall;
+        g->first = first;
+        g->cnt = wall->panel_cnt - first;
+        if (g->cnt > OPENWEATHER_GROUP_MAX) g->cnt = OPENWEATHER_GROUP_MAX;
+
+        char *url = _openweather_group_url_get(&wall->panels[first], g->cnt);
+        NemoCon *con = nemocon_create(wall->tool);
+        nemocon_set_url(con, url);
+        nemocon_set_end_callback(con, _weather_group_fetched, g);
+        nemocon_set_deadline(con, WEATHER_REFRESH_MS);
+        nemocon_run(con);
+        free(url);
+        wall->pending++;
     }
-    json_object_put(jso);
 }
 
 static void
-_load_weather_view(OpenWeather *ow)
+_weather_wall_timeout(struct nemotimer *timer, void *userdata)
 {
+    WeatherWall *wall = userdata;
+    _weather_wall_refresh(wall);
+    nemotimer_set_timeout(timer, WEATHER_REFRESH_MS);
 }
 
 static void
-_end_cb(NemoCon *con, char *data, size_t size, void *userdata)
+_weather_wall_pool_dispatch(struct nemotask *task, uint32_t events)
 {
-    OpenWeather *ow = userdata;
-    ow->json = malloc(size + 1);
-    memcpy(ow->json, data, size);
-    ow->json[size] = '\0';
-    ERR("%s", ow->json);
+    WeatherWall *wall = container_of(task, WeatherWall, pool_task);
+    threadpool_dispatch(wall->pool);
+}
 
-    _parse_openweather(ow);
-    _load_weather_view(ow);
+static struct pathone *
+_weather_wall_text_create(struct pathone *group, int size, double x, double y)
+{
+    struct pathone *one = nemotale_path_create_text();
+    nemotale_path_attach_style(one, NULL);
+    nemotale_path_set_font_family(NTPATH_STYLE(one), "Sans");
+    nemotale_path_set_font_size(NTPATH_STYLE(one), size);
+    nemotale_path_set_fill_color(NTPATH_STYLE(one), 1, 1, 1, 1.0);
+    nemotale_path_attach_one(group, one);
+    nemotale_path_translate(one, x, y);
+    return one;
+}
+
+// cities: comma separated OpenWeather city ids
+static WeatherWall *
+_weather_wall_create(struct nemotool *tool, NemoWin *win, struct pathone *group,
+        int w, const char *cities)
+{
+    WeatherWall *wall = calloc(sizeof(WeatherWall), 1);
+    wall->tool = tool;
+    wall->win = win;
+
+    const char *p = cities;
+    while (*p) {
+        char *end;
+        long id = strtol(p, &end, 10);
+        if (end == p) {
+            p++;
+            continue;
+        }
+        wall->panels = realloc(wall->panels, sizeof(WeatherPanel) * (wall->panel_cnt + 1));
+        WeatherPanel *panel = &wall->panels[wall->panel_cnt];
+        memset(panel, 0, sizeof(WeatherPanel));
+        panel->cityid = id;
+        wall->panel_cnt++;
+        p = end;
+    }
+    if (!wall->panel_cnt) {
+        ERR("no city id: %s", cities);
+        free(wall);
+        return NULL;
+    }
+
+    int cols = w / WEATHER_PANEL_W;
+    if (cols < 1) cols = 1;
+    unsigned int i;
+    for (i = 0 ; i < wall->panel_cnt ; i++) {
+        WeatherPanel *panel = &wall->panels[i];
+        double x = (i % cols) * WEATHER_PANEL_W;
+        double y = (i / cols) * WEATHER_PANEL_H;
+        panel->city = _weather_wall_text_create(group, 14, x, y);
+        panel->temp = _weather_wall_text_create(group, 14, x + 130, y);
+        panel->desc = _weather_wall_text_create(group, 10, x, y + 18);
+        panel->x = x;
+        panel->y = y;
+        panel->icon = nemotale_path_create_path(NULL);
+        nemotale_path_attach_style(panel->icon, NULL);
+        nemotale_path_set_fill_color(NTPATH_STYLE(panel->icon), 1, 1, 0.5, 1);
+        nemotale_path_attach_one(group, panel->icon);
+    }
+
+    _openweather_query();
+    wall->pool = threadpool_create(0);
+    wall->pool_task.dispatch = _weather_wall_pool_dispatch;
+    nemotool_watch_fd(tool, threadpool_get_fd(wall->pool), EPOLLIN, &wall->pool_task);
+
+    wall->timer = nemotimer_create(tool);
+    nemotimer_set_callback(wall->timer, _weather_wall_timeout);
+    nemotimer_set_userdata(wall->timer, wall);
+    nemotimer_set_timeout(wall->timer, WEATHER_REFRESH_MS);
+
+    _weather_wall_refresh(wall);
+    return wall;
+}
+
+static void
+_weather_wall_destroy(WeatherWall *wall)
+{
+    nemotimer_destroy(wall->timer);
+    nemotool_unwatch_fd(wall->tool, threadpool_get_fd(wall->pool));
+    threadpool_destroy(wall->pool);
+    unsigned int i;
+    for (i = 0 ; i < wall->panel_cnt ; i++) {
+        _openweather_fini(&wall->panels[i].cur);
+    }
+    free(wall->panels);
+    free(wall);
 }
 
 int main(){
@@ -1092,21 +1625,34 @@ int main(){
     nemotale_path_attach_one(nemowin_get_group(win), group);
     ctx->group = group;
 
+    // OpenWeather updates every 10 minutes at most: keep responses at least
+    // that long, across launches too.
+    const char *home = getenv("HOME");
+    char *cache_dir = _strdup_printf("%s/.weather", home ? home : "/tmp");
+    nemocon_cache_set_min_ttl(WEATHER_CACHE_MIN_TTL);
+    nemocon_cache_set_dir(cache_dir);
+    free(cache_dir);
+
     // Fetch Current Weather
-    OpenWeather *ow = calloc(sizeof(OpenWeather *), 1);
+    OpenWeather *ow = calloc(sizeof(OpenWeather), 1);
     ow->ctx = ctx;
 
     const char *city = "Suwon";
     const char *country = "kr";
     char *url = _openweather_url_get(city, country, -1, 0, 0);
 
-#if 0
+    // Parsed while it arrives, the body is not kept
     NemoCon *con = nemocon_create(tool);
     nemocon_set_url(con, url);
+    ow->stream = json_stream_create();
+    nemocon_set_data_callback(con, _data_cb, ow);
     nemocon_set_end_callback(con, _end_cb, ow);
+    nemocon_set_keep_data(con, false);
+    // Shown right away: ahead of any background refresh
+    nemocon_set_priority(con, NEMOCON_PRIORITY_INTERACTIVE);
+    nemocon_set_deadline(con, 10000);
     nemocon_run(con);
     free(url);
-#endif
 
     const char *time = "22:46 PM";
     const char *date = "Monday, April 27";
@@ -1167,7 +1713,7 @@ int main(){
     nemotale_path_attach_one(group, one);
     nemotale_path_load_text(one, hum, strlen(hum));
     nemotale_path_translate(one, 70, 100);
-    ctx->temp = one;
+    ctx->humidity = one;
 
 
     one = nemotale_path_create_text();
@@ -1184,7 +1730,8 @@ int main(){
     ctx->desc = one;
 
 
-    one = nemotale_path_create_path(weather_path[26].cmd);
+    one = nemotale_path_create_path(NULL);
+    _weather_icon_load(one, 27, 1, 0, 0);
     nemotale_path_attach_style(one, NULL);
     //nemotale_path_set_anchor(one, -0.5, -0.5);
     nemotale_path_set_fill_color(NTPATH_STYLE(one), 1, 1, 0.5, 1);
@@ -1194,12 +1741,25 @@ int main(){
     nemotale_path_translate(one, w-256-10, 10);
     ctx->weather = one;
 
+    // Below the current weather
+    WeatherWall *wall = NULL;
+    const char *cities = getenv("WEATHER_CITIES");
+    if (cities) {
+        struct pathone *wall_group = nemotale_path_create_group();
+        nemotale_path_attach_one(group, wall_group);
+        nemotale_path_translate(wall_group, 0, 200);
+        wall = _weather_wall_create(tool, win, wall_group, w, cities);
+    }
+
     nemowin_dirty(win);
     nemowin_show(win);
 
     nemotool_run(tool);
 
+    if (wall) _weather_wall_destroy(wall);
+
     nemotale_path_destroy_one(ctx->group);
+    _weather_icon_fini();
 
     nemowin_destroy(win);
     nemotool_disconnect_wayland(tool);